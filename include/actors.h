@@ -0,0 +1,108 @@
+#ifndef ACTORS_INCLUDED
+	#define ACTORS_INCLUDED
+
+	#include "lisp_machine.h"
+	#include <pthread.h>
+	#include <stdbool.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	// Actors are numbered in the order they were made. Their records are kept in
+	// chunks that never move, so they can be found without a lock.
+	#define ACTOR_CHUNK_SIZE 256
+	#define ACTOR_MAX_CHUNKS 4096
+
+	// Calls a spawned machine makes before giving its thread to the next one
+	#define ACTOR_REDUCTIONS 2000
+
+	// States of an actor
+	#define ACTOR_RUNNABLE	0	// Queued or running
+	#define ACTOR_WAITING	1	// Parked in receive with an empty mailbox
+	#define ACTOR_DONE		2
+
+	// A cell of a message, copied out of the sender's heap. References are
+	// indexes of other packed cells, or one of the values below.
+	#define PACKED_NULL	-1
+	#define PACKED_NIL	-2
+
+	#define PACKED_CELL		0	// car and cdr are references
+	#define PACKED_DATA		1	// The car is data, like a character
+	#define PACKED_NUMBER	2
+	#define PACKED_SYMBOL	3	// Symbols and strings, parsed again from their name
+
+	typedef struct packed_cell_t {
+		uint8_t kind;
+		uint8_t type;
+		bool is_atom;
+		int car;
+		int cdr;
+		Cell_Word data;
+		Cell_Int number;
+		char * name;
+	} Packed_Cell;
+
+	typedef struct message_t Message;
+
+	// A value on its way between two heaps. It doesn't point into either.
+	struct message_t {
+		Message * next;
+		Packed_Cell * cells;
+		int count;
+		int root;
+	};
+
+	// Lock-free queue with many senders and one receiver. Senders swap
+	// themselves in at the tail, the receiver takes messages off the head. The
+	// stub keeps it from ever being empty.
+	typedef struct mailbox_t {
+		Message * head;
+		Message * tail;
+		Message stub;
+	} Mailbox;
+
+	struct actor_t {
+		int id;
+		int state;
+
+		// Spawned machines are made by the scheduler that first runs them, from
+		// the start message. Bound actors are machines like the REPL's that run
+		// on a thread of their own and block in receive.
+		Lisp_Machine * machine;
+		Message * start;
+		bool is_bound;
+		bool is_receiving;		// Gave up its thread in receive
+
+		Mailbox mailbox;
+
+		// Only used by bound actors, to wait for a message
+		pthread_mutex_t lock;
+		pthread_cond_t wakeup;
+
+		Actor * next_runnable;
+	};
+
+	// Every actor and the scheduler threads running the spawned ones. Started
+	// by the first spawn.
+	typedef struct actor_system_t {
+		Actor ** chunks[ACTOR_MAX_CHUNKS];
+		int actor_count;
+		pthread_mutex_t lock;		// Making actors and the run queue
+		pthread_cond_t runnable;
+		Actor * run_head;
+		Actor * run_tail;
+		pthread_t * threads;
+		int thread_count;
+		bool shutdown;
+	} Actor_System;
+
+	// Spawned machines share a thread, so they give it up now and then
+	#define SHOULD_YIELD() (machine->is_scheduled && --machine->reductions < 0)
+
+	Cell * spawn_machine(Cell * args);
+	Cell * send_message(Cell * id, Cell * value);
+	bool receive_message(Cell ** value);
+	Cell * self_id();
+	void retire_actor(Actor * actor);
+	void stop_actors();
+
+#endif
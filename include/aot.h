@@ -0,0 +1,94 @@
+#ifndef AOT_INCLUDED
+	#define AOT_INCLUDED
+
+	#include "lisp_machine.h"
+	#include "garbage_collector.h"
+	#include "memory_sys.h"
+	#include "shallow_binding.h"
+	#include "stack.h"
+	#include <stdbool.h>
+	#include <string.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	// A compiled lambda or top level form. Its registers start at @base and the
+	// first @count of them hold the arguments.
+	typedef Cell * (*Aot_Function)(int base, int count);
+
+	// A lambda written in the program and the function it was compiled to
+	typedef struct aot_lambda_t {
+		int constant;
+		Aot_Function function;
+	} Aot_Lambda;
+
+	// Everything a program translated by --emit-c needs to start. The program's
+	// source lines are parsed again at startup and its constants are found in
+	// them by a path of car ('a') and cdr ('d') steps.
+	typedef struct aot_program_t {
+		char ** lines;
+		int line_count;
+		int * constant_lines;
+		char ** constant_paths;
+		int constant_count;
+		char ** symbol_names;
+		Cell ** symbols;
+		int symbol_count;
+		Aot_Lambda * lambdas;
+		int lambda_count;
+		Aot_Function * forms;
+		int form_count;
+		bool fold;
+		bool hash_cons;
+	} Aot_Program;
+
+	extern int aot_constants;
+
+	// The registers of the running compiled function and the program's
+	// constants. Both live on the bytecode machine's register stack so the
+	// garbage collector sees them.
+	#define REG(i) (((Cell **)machine->vm_registers.data)[base + (i)])
+	#define CONSTANT(i) (((Cell **)machine->vm_registers.data)[aot_constants + (i)])
+
+	// Stores the value of a call in a register. The call can grow the register
+	// stack, so the register is only found once it returns.
+	#define SET(i, value) aot_set(base + (i), (value))
+
+	static inline void aot_set(int index, Cell * value) {
+		((Cell **)machine->vm_registers.data)[index] = value;
+	}
+
+	void emit_c();
+	int run_program(Aot_Program * program, int argc, char * argv[]);
+	Cell * aot_apply(int first, int count);
+	Cell * aot_lookup(Cell * symbol);
+	void aot_not_found(Cell * symbol);
+	void aot_quit();
+
+	// Gives a compiled function @size registers from @base up, the first @count
+	// of which hold its arguments. Returns the register stack height to hand
+	// back to aot_leave().
+	static inline int aot_enter(int base, int count, int size) {
+
+		Stack * registers = &machine->vm_registers;
+		int top = registers->n;
+		int end = base + size;
+		while(end > registers->cap) {
+			RESIZE((*registers), Cell *);
+		}
+
+		for(int i = base + count; i < end; ++i) {
+			((Cell **)registers->data)[i] = machine->nil;
+		}
+		registers->n = end > top ? end : top;
+
+		GC_SAFE_POINT();
+
+		return top;
+	}
+
+	static inline Cell * aot_leave(int top, Cell * value) {
+		machine->vm_registers.n = top;
+		return value;
+	}
+
+#endif
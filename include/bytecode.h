@@ -0,0 +1,59 @@
+#ifndef BYTECODE_INCLUDED
+	#define BYTECODE_INCLUDED
+
+	#include "lisp_machine.h"
+	#include <stdbool.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	#define CODE_CACHE_STARTING_SIZE 64
+	#define CODE_STARTING_SIZE 32
+
+	// Largest operand an instruction can hold
+	#define MAX_OPERAND 0xFFFF
+
+	/********************************* Instructions *******************************/
+	// Every instruction is an opcode followed by its operands, all 16 bits wide.
+	// Registers are numbered from the start of the running frame and constants
+	// index the code's constant table.
+
+	#define OP_CONST		0	// dst, constant
+	#define OP_LOOKUP		1	// dst, constant symbol
+	#define OP_LOCAL		2	// dst, constant parameter reference
+	#define OP_DEFINE		3	// dst, constant symbol, constant value
+	#define OP_JUMP			4	// target
+	#define OP_JUMP_NIL		5	// src, target
+	#define OP_CAR			6	// dst, src
+	#define OP_CDR			7	// dst, src
+	#define OP_ATOM			8	// dst, src
+	#define OP_NOT			9	// dst, src
+	#define OP_CONS			10	// dst, src, src
+	#define OP_EQ			11	// dst, src, src
+	#define OP_LESS			12	// dst, src, src
+	#define OP_EQUAL		13	// dst, src, src
+	#define OP_GREAT		14	// dst, src, src
+	#define OP_AND			15	// dst, src, src
+	#define OP_OR			16	// dst, src, src
+	#define OP_ARITH		17	// dst, operator type, first, count
+	#define OP_CALL			18	// dst, first, count. The function is in first, the arguments follow it.
+	#define OP_RETURN		19	// src
+	#define OP_TAIL_CALL	20	// dst, first, count. Like OP_CALL, but it can replace the running frame.
+
+	// Superinstructions for the forms fused by fusion.c
+	#define OP_JUMP_NOT_LESS	21	// src, src, target
+	#define OP_JUMP_NOT_NIL		22	// src, target
+	#define OP_DEC				23	// dst, src
+
+	// Futures, for pcall and future
+	#define OP_FUTURE		24	// dst, constant expression
+	#define OP_TOUCH		25	// dst, src
+
+	void init_code_cache(Code_Cache * cache);
+	void destroy_code_cache(Code_Cache * cache);
+	void sweep_code_cache(Code_Cache * cache, bool is_minor);
+
+	Code * compile_expression(Cell * expr);
+	Code * lambda_code(Cell * lambda);
+	void free_code(Code * code);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef CONSTANT_FOLD_INCLUDED
+	#define CONSTANT_FOLD_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	Cell * fold_constants(Cell * expr);
+
+#endif
@@ -4,7 +4,7 @@
 	#include "lisp_machine.h"
 	#include <stdint.h>
 
-	extern Lisp_Machine * machine;
+	extern THREAD_LOCAL Lisp_Machine * machine;
 
 	typedef struct tokenizer_t {
 		char * string;
@@ -0,0 +1,11 @@
+#ifndef FUSION_INCLUDED
+	#define FUSION_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	bool is_simple_operand(Cell * cell);
+	Cell * fuse_forms(Cell * expr);
+
+#endif
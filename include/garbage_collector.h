@@ -0,0 +1,47 @@
+#ifndef GARBAGE_COLLECTOR_INCLUDED
+	#define GARBAGE_COLLECTOR_INCLUDED
+
+	#include "lisp_machine.h"
+	#include <stdbool.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+	extern Shared_Heap * shared_heap;
+
+	// Number of nursery cells we try to keep in reserve. A collection is started at the
+	// next safe point once the nursery has less room than this. Must be larger than the
+	// number of cells allocated between two safe points.
+	#define GC_RESERVE_CELLS 256
+
+	// Collects garbage if the nursery is running low, or if another thread asked
+	// for a collection by lowering the limit. Must only be used at points where
+	// every live cell is reachable from the machine roots.
+	#define GC_SAFE_POINT()															\
+	do {																			\
+		if(machine->nursery_top >= __atomic_load_n(&machine->nursery_limit, __ATOMIC_RELAXED)) {	\
+			collect_garbage();														\
+		}																			\
+	} while(0)
+
+	// The nurseries of every thread sit between the guard cell and the old generation
+	#define IS_YOUNG(cell) ((cell) > machine->cell_base && (cell) < machine->memory_block)
+	#define IS_OLD(cell) ((cell) >= machine->memory_block && (cell) < machine->cell_base + machine->heap_reserved_cells)
+
+	// Shared cells are never collected and only ever point to each other
+	#define IS_SHARED(cell) (shared_heap != NULL && (cell) >= shared_heap->start && (cell) < shared_heap->end)
+
+	void collect_garbage();
+	void minor_collection();
+	void major_collection();
+	void write_barrier(Cell * cell);
+
+	Cell * forward_cell(Stack * scan_stack, Cell * cell);
+	void forward_values(Stack * scan_stack, Lisp_Machine * roots);
+	void mark_cell(Stack * mark_stack, Cell * cell);
+	void mark_values(Stack * mark_stack, Lisp_Machine * roots);
+	void forward_vm(Stack * scan_stack, Lisp_Machine * roots);
+	void forward_constants(Stack * scan_stack, Code * code);
+	void mark_vm(Stack * mark_stack, Lisp_Machine * roots);
+	void mark_constants(Stack * mark_stack, Code * code);
+	bool car_is_reference(Cell * cell);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef HASH_CONS_INCLUDED
+	#define HASH_CONS_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	#define CONS_TABLE_STARTING_SIZE 256
+
+	void init_cons_table(Cons_Table * table);
+	void destroy_cons_table(Cons_Table * table);
+	Cell * hash_cons(Cell * expr);
+	void sweep_cons_table(Cons_Table * table);
+
+#endif
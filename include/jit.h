@@ -0,0 +1,17 @@
+#ifndef JIT_INCLUDED
+	#define JIT_INCLUDED
+
+	#include "lisp_machine.h"
+	#include <stdbool.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	// Calls a lambda's code has to take on the VM before it's compiled to
+	// machine code
+	#define JIT_THRESHOLD 100
+
+	bool jit_supported();
+	void compile_native(Code * code);
+	void free_native(Code * code);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef LEXICAL_ADDRESS_INCLUDED
+	#define LEXICAL_ADDRESS_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	Cell * resolve_locals(Cell * expr);
+
+#endif
@@ -3,14 +3,31 @@
 
 	#include <stdint.h>
 	#include <stdbool.h>
+	#include <stdio.h>
 	#include <time.h>
 	#include "stack.h"
 
+	// Default size of the old generation. It can be changed with --heap-cells and
+	// grows in HEAP_CHUNK_CELLS steps up to the --max-heap reservation.
 	#define NUM_OF_CELLS 65536
+	#define HEAP_CHUNK_CELLS 65536
+	#define DEFAULT_MAX_HEAP_SIZE ((size_t)4 << 30)
+	#define NURSERY_CELLS 8192
+
+	// Every thread has its own current machine, so each --workers thread runs a
+	// separate machine through the same functions
+	#define THREAD_LOCAL __thread
 
 	#define INSTR_MAX_LENGTH 10
 	#define INPUT_BUFFER_LENGTH 64
 
+	// Reads and evaluates expressions until the program quits. It runs in the
+	// empty environment so that its definitions are global. Its repl is renamed
+	// REPL_FUNCTION, which programs can't write since names end at spaces, so
+	// they can't redefine it.
+	#define REPL_EXPRESSION "(begin (define repl (lambda () (begin (eval (in)) (repl)))) (repl))"
+	#define REPL_FUNCTION "repl loop"
+
 	/********************************* Cell Types *******************************/
 	// General variable symbol
 	#define SYS_GENERAL 0
@@ -37,56 +54,147 @@
 	#define SYS_SYM_EQ 		17
 	#define SYS_SYM_EVAL	18
 	#define SYS_SYM_FALSE	19
-	#define SYS_SYM_IF		20
-	#define SYS_SYM_IN 		21
-	#define SYS_SYM_JOIN	22
-	#define SYS_SYM_LAMBDA	23
-	#define SYS_SYM_MOD		24
-	#define SYS_SYM_NOT		25
-	#define SYS_SYM_NULL	26
-	#define SYS_SYM_OR		27
-	#define SYS_SYM_OUT 	28
-	#define SYS_SYM_QUIT	29
-	#define SYS_SYM_QUOTE	30
-	#define SYS_SYM_SUBSTR	31
-	#define SYS_SYM_TRUE	32
+	#define SYS_SYM_FUTURE	20
+	#define SYS_SYM_IF		21
+	#define SYS_SYM_IN 		22
+	#define SYS_SYM_JOIN	23
+	#define SYS_SYM_LAMBDA	24
+	#define SYS_SYM_MOD		25
+	#define SYS_SYM_NOT		26
+	#define SYS_SYM_NULL	27
+	#define SYS_SYM_OR		28
+	#define SYS_SYM_OUT 	29
+	#define SYS_SYM_PCALL	30
+	#define SYS_SYM_QUIT	31
+	#define SYS_SYM_QUOTE	32
+	#define SYS_SYM_RECEIVE	33
+	#define SYS_SYM_SELF	34
+	#define SYS_SYM_SEND	35
+	#define SYS_SYM_SPAWN	36
+	#define SYS_SYM_SUBSTR	37
+	#define SYS_SYM_TOUCH	38
+	#define SYS_SYM_TRUE	39
 
 	// Self evaluating number
-	#define SYS_SYM_NUM		33
+	#define SYS_SYM_NUM		40
 
 	// Tag for a string
-	#define SYS_SYM_STRING	34
-	#define SYS_SYM_CHAR	35
+	#define SYS_SYM_STRING	41
+	#define SYS_SYM_CHAR	42
+
+	// Reference to a parameter of the enclosing lambda. The car is the symbol and
+	// the cdr is a (params . index) pair of the lambda's parameter list and the
+	// fixnum index of the parameter in it (see lexical_address.c).
+	#define SYS_SYM_LOCAL	43
+
+	// Environment entry binding all the parameters of one lambda call. The car
+	// is the parameter list and the cdr the list of values, or the fixnum index
+	// of the VM register holding the first one (see vm.c).
+	#define SYS_ENV_FRAME	44
+
+	// Value of an expression being evaluated by another thread (see tasks.c). The
+	// car is the (expression . environment) pair until the value replaces it, and
+	// the cdr is the fixnum state.
+	#define SYS_FUTURE		45
+
+	// Heads of the forms fused by fusion.c. The car is the symbol they replace.
+	#define SYS_FUSED_IF_LT		46
+	#define SYS_FUSED_IF_NULL	47
+	#define SYS_FUSED_DEC		48
+	#define FUSED_TYPE_COUNT	3
+	#define FUSED_INDEX(type)	((type) - SYS_FUSED_IF_LT)
 
 	/********************************* System Calling Functions ***************************/
 	// Used for machine.calling_func so that functions know where to return.
 	#define SYS_EVAL		0
 	#define SYS_APPLY_0		1
 	#define SYS_APPLY_1		2
-	#define SYS_APPLY_2		3
 	#define SYS_EVLIS_0		4
 	#define SYS_EVLIS_1		5
 	#define SYS_EVIF		6
 	#define SYS_EVBEGIN		7
-	#define SYS_CONENV		8
 	#define SYS_RETURN 		9
 	#define SYS_REPL		10
+	#define SYS_UNBIND		11
+	#define SYS_EVPRIM_0	12
+	#define SYS_EVPRIM_1	13
 
+	// Passed to sys_eval in args[2] when the expression's value is returned
+	// straight from the innermost lambda with parameters. Calls made there are
+	// tail calls. Anywhere else args[2] is nil.
+	#define TAIL_POSITION makeFixnum(1)
+
+	// Only builds made with "make TRACE=1" can show the runtime info, the others
+	// leave the check out of every call
+#ifdef RUNTIME_INFO
 	#define SYSCALL(func)													\
 	do {																	\
+		GC_SAFE_POINT();													\
 		if(runtime_info_flag) {												\
 			print_runtime_info(#func);										\
 			struct timespec t = {0, 150999999};								\
 			nanosleep(&t, NULL);											\
 		}																\
 		goto func;															\
-	} while(0)																\
-
+	} while(0)
+#else
+	#define SYSCALL(func)													\
+	do {																	\
+		GC_SAFE_POINT();													\
+		goto func;															\
+	} while(0)
+#endif
 
 	extern int chars_per_pointer;
 
 	typedef struct cell_t Cell;
 	typedef struct lisp_machine_t Lisp_Machine;
+	typedef struct task_pool_t Task_Pool;
+	typedef struct task_deque_t Task_Deque;
+	typedef struct actor_t Actor;
+
+#ifdef COMPACT_CELLS
+	// Compact 16 byte cells. The car and cdr hold the index of the cell they refer to
+	// instead of a pointer, and all the flags are packed into a single header word.
+	// Only use the accessors in memory_sys.h to get at the fields.
+	typedef uint32_t Cell_Word;
+	typedef int32_t Cell_Int;
+
+	#define HEADER_TYPE_MASK		0xFF
+	#define HEADER_ATOM_BIT			(1 << 8)
+	#define HEADER_FETCHED_BIT		(1 << 9)
+	#define HEADER_MARKED_BIT		(1 << 10)
+	#define HEADER_REMEMBERED_BIT	(1 << 11)
+
+	struct cell_t {
+		Cell_Word car;
+		Cell_Word null_word; // Used to provide a null terminator if the car is interpreted as a string
+		Cell_Word cdr;
+		uint32_t header;
+	};
+
+	#define CELL_SIZE sizeof(Cell)
+#elif defined(SOA_CELLS)
+	// Struct of arrays cells, laid out like the FPGA memory unit. A cell is only a
+	// handle. Its index from cell_base selects its car, cdr, type and flags in
+	// separate arrays (see lisp_machine_t), so scans that only look at the type or
+	// flags touch one dense byte array. Only use the accessors in memory_sys.h.
+	typedef uint32_t Cell_Word;
+	typedef int32_t Cell_Int;
+
+	#define FLAG_ATOM_BIT		(1 << 0)
+	#define FLAG_FETCHED_BIT	(1 << 1)
+	#define FLAG_MARKED_BIT		(1 << 2)
+	#define FLAG_REMEMBERED_BIT	(1 << 3)
+
+	struct cell_t {
+		char handle[2]; // Never read or written. Two bytes keep the handles even (see IS_FIXNUM)
+	};
+
+	#define CELL_SIZE (2 * sizeof(Cell_Word) + 2 * sizeof(uint8_t))
+#else
+	typedef uintptr_t Cell_Word;
+	typedef intptr_t Cell_Int;
 
 	struct cell_t {
 		Cell *car;
@@ -97,8 +205,18 @@
 
 		// Runtime information
 		bool is_fetched;
+
+		// Set by the garbage collector for cells that are still reachable. A marked
+		// nursery cell has been promoted and its car is the forwarding address.
+		bool is_marked;
+
+		// Set for old cells that are in the remembered set
+		bool is_remembered;
 	};
 
+	#define CELL_SIZE sizeof(Cell)
+#endif
+
 	// ******************** Functions that should be present in the global environment *********************
 	// These functions won't actually be in the environment variable, they will instead be
 	// specially marked by the parser as they are encountered.
@@ -114,25 +232,222 @@
 		quit
 	*/
 
+	// One record on the system stack. Holds the function to return to and the
+	// arguments it still needs once the call returns.
+	typedef struct stack_frame_t {
+		void * continuation;	// Address of the label to return to
+		uint8_t calling_func;
+		uint8_t arg_count;
+		Cell * args[4];
+	} Stack_Frame;
+
+	// Maps every symbol name to the one cell chain that holds it (see symbol_table.c)
+	typedef struct symbol_entry_t {
+		char * name;
+		Cell * symbol;
+	} Symbol_Entry;
+
+	typedef struct symbol_table_t {
+		Symbol_Entry * entries;
+		int count;
+		int capacity;
+	} Symbol_Table;
+
+	// A line of a program parsed ahead of time by --shared-code. Blank lines are
+	// left for the machine to parse, as the REPL would.
+	typedef struct shared_line_t {
+		char * text;
+		Cell * form;
+	} Shared_Line;
+
+	typedef struct shared_program_t {
+		char * path;
+		Shared_Line * lines;
+		int line_count;
+	} Shared_Program;
+
+	// Frozen cells every worker machine reads but none writes (see shared_heap.c).
+	// They live in the old generation of the machine that parsed them, between
+	// start and end.
+	typedef struct shared_heap_t {
+		Lisp_Machine * owner;
+		Cell * start;
+		Cell * end;
+		Cell * nil;
+		Cell * repl;
+		Shared_Program * programs;
+		int program_count;
+	} Shared_Heap;
+
+	// Weak table of the shared cons cells built by hash consing (see hash_cons.c)
+	typedef struct cons_table_t {
+		Cell ** cells;
+		int count;
+		int capacity;
+	} Cons_Table;
+
+	// The value of a symbol in a Value_Table (see value_table.c)
+	typedef struct value_slot_t {
+		Cell * symbol;
+		Cell * value;
+		bool is_bound;
+	} Value_Slot;
+
+	typedef struct value_table_t {
+		Value_Slot * slots;
+		int count;
+		int capacity;
+	} Value_Table;
+
+	// Machine code compiled from a Code by jit.c. It runs the instructions from
+	// @pc on and returns the pc of the first one it leaves to the VM.
+	typedef int (*Native_Code)(Cell ** regs, Cell ** constants, int pc);
+
+	// Bytecode compiled from a lambda body or an evaluated expression (see bytecode.c)
+	typedef struct code_t {
+		uint16_t * ops;
+		int length;
+		int capacity;
+		Cell ** constants;
+		int constant_count;
+		int constant_capacity;
+		int register_count;
+		int call_count;
+		Native_Code native;		// NULL until the code gets hot under --engine=jit
+		void * native_memory;
+		size_t native_size;
+	} Code;
+
+	typedef struct code_entry_t {
+		Cell * lambda;
+		Code * code;
+	} Code_Entry;
+
+	// Weak table of the compiled lambdas, keyed by the lambda's cell
+	typedef struct code_cache_t {
+		Code_Entry * entries;
+		int count;
+		int capacity;
+	} Code_Cache;
+
+	// One activation on the bytecode machine's stack (see vm.c)
+	typedef struct vm_frame_t {
+		Code * code;
+		int pc;
+		int base;			// First register of the frame
+		int top;			// Height of the register stack to restore on return
+		int result;			// Caller's register that receives the return value
+		Cell * env;
+		Cell * lambda;		// Keeps the cached code of the running lambda alive
+		int binding_mark;	// Binding stack height to unbind to, or -1
+		uint8_t kind;
+	} VM_Frame;
+
+	// How many forms of one fused type were made and how often they ran
+	typedef struct fusion_stat_t {
+		long forms;
+		long runs;
+	} Fusion_Stat;
+
+	// How many forms constant_fold.c folded and how many cells that saved
+	typedef struct fold_stat_t {
+		long forms;
+		long nodes;
+	} Fold_Stat;
+
+	// How many lambdas the JIT compiled and the bytes of machine code it made
+	typedef struct jit_stat_t {
+		long lambdas;
+		long bytes;
+	} Jit_Stat;
+
 	struct lisp_machine_t {
 		bool is_running;
+
+		// Where in and the REPL read from and everything the program prints goes
+		FILE * in;
+		FILE * out;
+
+		// Under --shared-code, the parsed program in reads instead of in
+		Shared_Program * program;
+		int program_line;
+
+		// All cells live in one reserved region starting at cell_base. It holds
+		// the nursery followed by the old generation. Under --threads it holds a
+		// nursery for every thread, and the old generation, the symbols and the
+		// global environment are the owner's.
+		Cell * cell_base;
+#ifdef SOA_CELLS
+		Cell_Word * cell_car;
+		Cell_Word * cell_cdr;
+		uint8_t * cell_type;
+		uint8_t * cell_flags;
+#endif
+
+		// Old generation. Cells below heap_top have been handed out at least once,
+		// the rest of the committed cells are still untouched.
 		Cell * memory_block;
+		size_t heap_reserved_cells;
+		size_t heap_committed_cells;
+		int heap_committed;
+		int heap_top;
 
 		// System memory info
 		int mem_used;
 		int mem_free;
 		Cell *free_mem;
 		Cell *nil;
+		int gc_count;
+
+		// Young generation. New cells are bump allocated between nursery
+		// and nursery_end. Safe points collect once nursery_top reaches
+		// nursery_limit, which other threads lower to stop the machine.
+		Cell * nursery;
+		Cell * nursery_top;
+		Cell * nursery_end;
+		Cell * nursery_limit;
+		int minor_gc_count;
+
+		// Old cells that might point into the nursery
+		Stack remembered_set;
+
+		// Interned symbols. They live in the old generation and are never freed.
+		Symbol_Table symbol_table;
+
+		// Shared parsed code, only used with --hash-cons
+		Cons_Table cons_table;
+
+		// Definitions made at the top level, outside of any lambda's frame
+		Value_Table global_env;
+
+		// Only used with --shallow-binding. The binding stack holds Value_Slot
+		// records of the values to restore when a lambda returns.
+		Value_Table value_table;
+		Stack binding_stack;
+
+		// Only used with --engine=vm
+		Code_Cache code_cache;
+		Stack vm_frames;		// VM_Frame records
+		Stack vm_registers;		// Cell * registers of every frame
+
+		// Set while make_expression is running so the garbage collector
+		// can find the partially built expression.
+		Stack * parse_stack;
+		Cell ** parse_root;
+		Cell ** parse_cell;
 		//bool needs_return_address; // Set when the calling function needs it's return address. Otherwise, we will use that
 			// stack frame to record the next return address.
 
 		int memory_access_count;
 		int cycle_count;
 
+		Fusion_Stat fusion_stats[FUSED_TYPE_COUNT];
+		Fold_Stat fold_stats;
+		Jit_Stat jit_stats;
+
 		// System environment
 		// This serve as registers to hold the arguments to the evaluation functions
-		Cell * sys_stack;
-		int sys_stack_size;
+		Stack sys_stack; // Stack_Frame records. The depth is sys_stack.n
 
 		// Small, one context sized stack, that holds all the args necessary
 		// Holds the result from the last evaluation
@@ -147,20 +462,57 @@
 		int num_of_instrs;
 		void *instr_memory_block;	// The actual memory supporting the variable instructions.
 		char **instructions;				// Holds the list of supported instructions in alphabetical order.
+
+		// The machine this one shares a heap with, which is itself unless it runs
+		// futures for --threads (see tasks.c)
+		Lisp_Machine * owner;
+		Task_Pool * pool;		// Only set on the owner, while the threads run
+		Task_Deque * deque;		// Futures made here that nobody has started
+		int pool_index;
+		Stack futures;			// Futures being evaluated here, innermost last
+
+		// The actor this machine receives messages for, once it has one (see
+		// actors.c). Spawned machines share their thread with others and are
+		// suspended when they wait for a message or run out of reductions. The
+		// tree engine carries on from resume, the VM from its running frame.
+		Actor * actor;
+		bool is_scheduled;
+		bool is_suspended;
+		int reductions;
+		void * resume;
 	};
 
 	Lisp_Machine * init_machine();
+	Lisp_Machine * init_task_machine(Lisp_Machine * owner, int index);
 	void init_instr_list(char * funcs);
 	void destroy_machine(Lisp_Machine *machine);
+	void destroy_task_machine(Lisp_Machine * task);
 	Cell * get_free_cell();
+	Cell * get_old_cell();
 	void store_cell(Cell * cell);
-	void push_system_args(int arg_count);
-	void pop_system_args();
+	void push_system_args(int arg_count, void * continuation);
+	void * pop_system_args();
 	void execute();
+	Cell * evaluate(Cell * expr, Cell * env);
+	bool start_evaluation(Cell * expr);
+	bool resume_evaluation();
+	Cell * repl_expression();
+	Cell * make_repl_expression();
+	Cell * read_expression();
 
 	Cell * car(Cell * cell);
 	Cell * cdr(Cell * cell);
 	Cell * cons(Cell * cell1, Cell * cell2);
+	Cell * make_number(Cell_Int value);
+	bool local_value(Cell * local, Cell * env, Cell ** value);
+	Cell * frame_value(Cell * frame, Cell_Int index);
+	bool operand_value(Cell * operand, Cell * env, Cell ** value);
+	int primitive_arity(uint8_t type);
+	bool operand_count(Cell * form, int count);
+	Cell * apply_fixed_primitive(uint8_t type, Cell * first, Cell * second);
+	void define_symbol(Cell * symbol, Cell * value, Cell * env);
+	bool frame_shadowed(Cell * env, Cell * params);
+	bool lookup_symbol(Cell * symbol, Cell * env, Cell ** value);
 	Cell * quote(Cell * cell);
 	Cell * atom(Cell * cell);
 	Cell * eq(Cell * cell1, Cell * cell2);
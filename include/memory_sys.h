@@ -2,22 +2,386 @@
 	#define MEMORY_SYS_INCLUDED
 
 	#include "lisp_machine.h"
+	#include <stddef.h>
 	#include <stdint.h>
 	#include <stdbool.h>
 
-	extern Lisp_Machine * machine;
+	extern THREAD_LOCAL Lisp_Machine * machine;
 
-	Cell * getCar(Cell * cell);
-	void setCar(Cell *cell, Cell * value);
-	Cell * getCdr(Cell * cell);
-	void setCdr(Cell *cell, Cell * value);
-	bool getIsAtom(Cell * cell);
-	void setIsAtom(Cell * cell, bool value);
-	uint8_t getType(Cell * cell);
-	void setType(uint8_t value);
+	// Every access to the fields of a cell goes through these so the heap layout
+	// can be changed at build time (see struct cell_t).
+	// Small integers are tagged immediates rather than cells. Cells are at least two
+	// byte aligned, so a pointer with the low bit set can never be a real cell.
+	// Immediates must be checked for before anything is read through a pointer.
+	#define IS_FIXNUM(cell) (((uintptr_t)(cell) & 1) != 0)
+
+#if defined(COMPACT_CELLS) || defined(SOA_CELLS)
+	// A fixnum has to fit in a car or cdr word next to its tag bit
+	#define FIXNUM_MIN (INT32_MIN / 2)
+	#define FIXNUM_MAX (INT32_MAX / 2)
+#else
+	#define FIXNUM_MIN (INTPTR_MIN / 2)
+	#define FIXNUM_MAX (INTPTR_MAX / 2)
+#endif
+
+	static inline Cell * makeFixnum(Cell_Int value) {
+		return (Cell *)(((uintptr_t)value << 1) | 1);
+	}
+
+	static inline Cell_Int getFixnum(Cell * cell) {
+		return (Cell_Int)((intptr_t)cell >> 1);
+	}
+
+#if defined(COMPACT_CELLS) || defined(SOA_CELLS)
+	// Cells refer to each other by their index from cell_base, shifted left to leave
+	// room for the fixnum tag. Index 0 is never handed out so it can stand for NULL.
+	static inline Cell * wordToCell(Cell_Word word) {
+		if(word & 1) {
+			return (Cell *)(intptr_t)(int32_t)word;
+		}
+		return word == 0 ? NULL : machine->cell_base + (word >> 1);
+	}
+
+	static inline Cell_Word cellToWord(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return (Cell_Word)(uintptr_t)cell;
+		}
+		return cell == NULL ? 0 : (Cell_Word)(cell - machine->cell_base) << 1;
+	}
+#endif
+
+#ifdef COMPACT_CELLS
+	static inline Cell * getCar(Cell * cell) {
+		return wordToCell(cell->car);
+	}
+
+	static inline void setCar(Cell * cell, Cell * value) {
+		cell->car = cellToWord(value);
+	}
+
+	static inline Cell * getCdr(Cell * cell) {
+		return wordToCell(cell->cdr);
+	}
+
+	static inline void setCdr(Cell * cell, Cell * value) {
+		cell->cdr = cellToWord(value);
+	}
+
+	// Atomic access to the cdr, for the state of a future (see tasks.c)
+	static inline Cell * loadCdr(Cell * cell) {
+		return wordToCell(__atomic_load_n(&cell->cdr, __ATOMIC_ACQUIRE));
+	}
+
+	static inline void storeCdr(Cell * cell, Cell * value) {
+		__atomic_store_n(&cell->cdr, cellToWord(value), __ATOMIC_RELEASE);
+	}
+
+	static inline bool casCdr(Cell * cell, Cell * expected, Cell * value) {
+		Cell_Word word = cellToWord(expected);
+		return __atomic_compare_exchange_n(&cell->cdr, &word, cellToWord(value), false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	static inline Cell_Word getCarData(Cell * cell) {
+		return cell->car;
+	}
+
+	static inline void setCarData(Cell * cell, Cell_Word value) {
+		cell->car = value;
+	}
+
+	static inline bool getHeaderBit(Cell * cell, uint32_t bit) {
+		return (cell->header & bit) != 0;
+	}
+
+	static inline void setHeaderBit(Cell * cell, uint32_t bit, bool value) {
+		cell->header = value ? cell->header | bit : cell->header & ~bit;
+	}
+
+	static inline bool getIsAtom(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return true;
+		}
+		return getHeaderBit(cell, HEADER_ATOM_BIT);
+	}
+
+	static inline void setIsAtom(Cell * cell, bool value) {
+		setHeaderBit(cell, HEADER_ATOM_BIT, value);
+	}
+
+	static inline uint8_t getType(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return SYS_SYM_NUM;
+		}
+		return cell->header & HEADER_TYPE_MASK;
+	}
+
+	static inline void setType(Cell * cell, uint8_t value) {
+		cell->header = (cell->header & ~HEADER_TYPE_MASK) | value;
+	}
+
+	static inline bool getIsFetched(Cell * cell) {
+		return getHeaderBit(cell, HEADER_FETCHED_BIT);
+	}
+
+	static inline void setIsFetched(Cell * cell, bool value) {
+		setHeaderBit(cell, HEADER_FETCHED_BIT, value);
+	}
+
+	static inline bool getIsMarked(Cell * cell) {
+		return getHeaderBit(cell, HEADER_MARKED_BIT);
+	}
+
+	static inline void setIsMarked(Cell * cell, bool value) {
+		setHeaderBit(cell, HEADER_MARKED_BIT, value);
+	}
+
+	static inline bool getIsRemembered(Cell * cell) {
+		return getHeaderBit(cell, HEADER_REMEMBERED_BIT);
+	}
+
+	static inline void setIsRemembered(Cell * cell, bool value) {
+		setHeaderBit(cell, HEADER_REMEMBERED_BIT, value);
+	}
+
+	// Resets a cell to an empty, non atomic cell
+	static inline void clearCell(Cell * cell) {
+		cell->car = 0;
+		cell->cdr = 0;
+		cell->header = 0;
+	}
+
+	static inline void copyCell(Cell * dest, Cell * src) {
+		*dest = *src;
+	}
+#elif defined(SOA_CELLS)
+	static inline Cell * getCar(Cell * cell) {
+		return wordToCell(machine->cell_car[cell - machine->cell_base]);
+	}
+
+	static inline void setCar(Cell * cell, Cell * value) {
+		machine->cell_car[cell - machine->cell_base] = cellToWord(value);
+	}
+
+	static inline Cell * getCdr(Cell * cell) {
+		return wordToCell(machine->cell_cdr[cell - machine->cell_base]);
+	}
+
+	static inline void setCdr(Cell * cell, Cell * value) {
+		machine->cell_cdr[cell - machine->cell_base] = cellToWord(value);
+	}
+
+	// Atomic access to the cdr, for the state of a future (see tasks.c)
+	static inline Cell * loadCdr(Cell * cell) {
+		return wordToCell(__atomic_load_n(&machine->cell_cdr[cell - machine->cell_base], __ATOMIC_ACQUIRE));
+	}
+
+	static inline void storeCdr(Cell * cell, Cell * value) {
+		__atomic_store_n(&machine->cell_cdr[cell - machine->cell_base], cellToWord(value), __ATOMIC_RELEASE);
+	}
+
+	static inline bool casCdr(Cell * cell, Cell * expected, Cell * value) {
+		Cell_Word word = cellToWord(expected);
+		return __atomic_compare_exchange_n(&machine->cell_cdr[cell - machine->cell_base], &word,
+			cellToWord(value), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	static inline Cell_Word getCarData(Cell * cell) {
+		return machine->cell_car[cell - machine->cell_base];
+	}
+
+	static inline void setCarData(Cell * cell, Cell_Word value) {
+		machine->cell_car[cell - machine->cell_base] = value;
+	}
+
+	static inline bool getFlag(Cell * cell, uint8_t bit) {
+		return (machine->cell_flags[cell - machine->cell_base] & bit) != 0;
+	}
+
+	static inline void setFlag(Cell * cell, uint8_t bit, bool value) {
+		uint8_t * flags = &machine->cell_flags[cell - machine->cell_base];
+		*flags = value ? *flags | bit : *flags & ~bit;
+	}
+
+	static inline bool getIsAtom(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return true;
+		}
+		return getFlag(cell, FLAG_ATOM_BIT);
+	}
+
+	static inline void setIsAtom(Cell * cell, bool value) {
+		setFlag(cell, FLAG_ATOM_BIT, value);
+	}
+
+	static inline uint8_t getType(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return SYS_SYM_NUM;
+		}
+		return machine->cell_type[cell - machine->cell_base];
+	}
+
+	static inline void setType(Cell * cell, uint8_t value) {
+		machine->cell_type[cell - machine->cell_base] = value;
+	}
+
+	static inline bool getIsFetched(Cell * cell) {
+		return getFlag(cell, FLAG_FETCHED_BIT);
+	}
+
+	static inline void setIsFetched(Cell * cell, bool value) {
+		setFlag(cell, FLAG_FETCHED_BIT, value);
+	}
+
+	static inline bool getIsMarked(Cell * cell) {
+		return getFlag(cell, FLAG_MARKED_BIT);
+	}
+
+	static inline void setIsMarked(Cell * cell, bool value) {
+		setFlag(cell, FLAG_MARKED_BIT, value);
+	}
+
+	static inline bool getIsRemembered(Cell * cell) {
+		return getFlag(cell, FLAG_REMEMBERED_BIT);
+	}
+
+	static inline void setIsRemembered(Cell * cell, bool value) {
+		setFlag(cell, FLAG_REMEMBERED_BIT, value);
+	}
+
+	// Resets a cell to an empty, non atomic cell
+	static inline void clearCell(Cell * cell) {
+		ptrdiff_t index = cell - machine->cell_base;
+		machine->cell_car[index] = 0;
+		machine->cell_cdr[index] = 0;
+		machine->cell_type[index] = SYS_GENERAL;
+		machine->cell_flags[index] = 0;
+	}
+
+	static inline void copyCell(Cell * dest, Cell * src) {
+		ptrdiff_t dest_index = dest - machine->cell_base;
+		ptrdiff_t src_index = src - machine->cell_base;
+		machine->cell_car[dest_index] = machine->cell_car[src_index];
+		machine->cell_cdr[dest_index] = machine->cell_cdr[src_index];
+		machine->cell_type[dest_index] = machine->cell_type[src_index];
+		machine->cell_flags[dest_index] = machine->cell_flags[src_index];
+	}
+#else
+	static inline Cell * getCar(Cell * cell) {
+		return cell->car;
+	}
+
+	static inline void setCar(Cell * cell, Cell * value) {
+		cell->car = value;
+	}
+
+	static inline Cell * getCdr(Cell * cell) {
+		return cell->cdr;
+	}
+
+	static inline void setCdr(Cell * cell, Cell * value) {
+		cell->cdr = value;
+	}
+
+	// Atomic access to the cdr, for the state of a future (see tasks.c)
+	static inline Cell * loadCdr(Cell * cell) {
+		return __atomic_load_n(&cell->cdr, __ATOMIC_ACQUIRE);
+	}
+
+	static inline void storeCdr(Cell * cell, Cell * value) {
+		__atomic_store_n(&cell->cdr, value, __ATOMIC_RELEASE);
+	}
+
+	static inline bool casCdr(Cell * cell, Cell * expected, Cell * value) {
+		return __atomic_compare_exchange_n(&cell->cdr, &expected, value, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	static inline Cell_Word getCarData(Cell * cell) {
+		return (Cell_Word)cell->car;
+	}
+
+	static inline void setCarData(Cell * cell, Cell_Word value) {
+		cell->car = (Cell *)value;
+	}
+
+	static inline bool getIsAtom(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return true;
+		}
+		return cell->is_atom;
+	}
+
+	static inline void setIsAtom(Cell * cell, bool value) {
+		cell->is_atom = value;
+	}
+
+	static inline uint8_t getType(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return SYS_SYM_NUM;
+		}
+		return cell->type;
+	}
+
+	static inline void setType(Cell * cell, uint8_t value) {
+		cell->type = value;
+	}
+
+	static inline bool getIsFetched(Cell * cell) {
+		return cell->is_fetched;
+	}
+
+	static inline void setIsFetched(Cell * cell, bool value) {
+		cell->is_fetched = value;
+	}
+
+	static inline bool getIsMarked(Cell * cell) {
+		return cell->is_marked;
+	}
+
+	static inline void setIsMarked(Cell * cell, bool value) {
+		cell->is_marked = value;
+	}
+
+	static inline bool getIsRemembered(Cell * cell) {
+		return cell->is_remembered;
+	}
+
+	static inline void setIsRemembered(Cell * cell, bool value) {
+		cell->is_remembered = value;
+	}
+
+	// Resets a cell to an empty, non atomic cell
+	static inline void clearCell(Cell * cell) {
+		cell->car = NULL;
+		cell->cdr = NULL;
+		cell->is_atom = false;
+		cell->type = SYS_GENERAL;
+		cell->is_fetched = false;
+		cell->is_marked = false;
+		cell->is_remembered = false;
+	}
+
+	static inline void copyCell(Cell * dest, Cell * src) {
+		*dest = *src;
+	}
+#endif
+
+	// Value of a number, whether it's a fixnum or boxed in a cell
+	static inline Cell_Int getNumber(Cell * cell) {
+		if(IS_FIXNUM(cell)) {
+			return getFixnum(cell);
+		}
+		return (Cell_Int)getCarData(cell);
+	}
 
 	void putCellAway(Cell * cell); // Marks the cell as not fetched
 
 	void manageMetaData(Cell * cell);
 
+	// Heap backing
+	void reserve_heap(int max_cells, int initial_cells);
+	bool grow_heap(int cell_count);
+	void release_heap();
+
 #endif
\ No newline at end of file
@@ -1,23 +1,57 @@
 #ifndef REPL_INCLUDED
 	#define REPL_INCLUDED
 
+	#include <limits.h>
 	#include <stdbool.h>
+	#include <stddef.h>
 	#include "lisp_machine.h"
 
-	#define RUNTIME_LINES 10
+	#define RUNTIME_LINES 11
 	#define MAX_PRINT_EXPR_LENGTH 80
 	#define PRINT_EXPR_PADDING 20  // Used to help protect against the imperfect function of print_list_helper
 	#define MAX_PRINT_STACK_DEPTH 20
 
+	// Values of --engine. The tree engine is execute() and the vm engine runs
+	// the code compiled by bytecode.c. The jit engine is the vm engine with hot
+	// lambdas compiled to machine code by jit.c.
+	#define ENGINE_TREE 0
+	#define ENGINE_VM 1
+	#define ENGINE_JIT 2
+
+	// Most threads --workers, --threads or --schedulers can ask for
+	#define MAX_THREADS 256
+
+	// Most cells --heap-cells and --max-heap can ask for. Heap sizes are counted
+	// in ints, and compact cells can't address more than that either.
+	#define MAX_HEAP_CELLS INT_MAX
+
 	extern bool quiet_flag;
 	extern bool runtime_info_flag;
 	extern bool verbose_flag;
+	extern bool hash_cons_flag;
+	extern bool shallow_binding_flag;
+	extern bool stats_flag;
+	extern bool fold_flag;
+	extern bool emit_c_flag;
+	extern bool shared_code_flag;
+	extern int engine;
+	extern int heap_cells;
+	extern size_t max_heap_size;
+	extern int worker_count;
+	extern int thread_count;
+	extern int scheduler_count;
+	extern char ** program_paths;
+	extern int program_count;
 	
-	extern Lisp_Machine * machine;
+	extern THREAD_LOCAL Lisp_Machine * machine;
 
 	void process_args(int argc, char * argv[]);
+	void run_session();
+	size_t parse_size(char * option, char * value, size_t max);
+	int parse_count(char * option, char * value);
 	void print_runtime_info();
 	void print_runtime_stack();
+	void print_stats();
 
 	void print_list(Cell *cell);
 	int print_list_helper(Cell *list, char *string, int *index, bool is_in_list);
@@ -0,0 +1,15 @@
+#ifndef SHALLOW_BINDING_INCLUDED
+	#define SHALLOW_BINDING_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	Value_Slot * value_slot(Cell * symbol);
+	void bind_symbol(Cell * symbol, Cell * value);
+	void bind_params(Cell * params, Cell * values);
+	void bind_param_array(Cell * params, Cell ** values, int count);
+	void unbind_to(int height);
+	bool bindings_shadowed(int height, Cell * params);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SHARED_HEAP_INCLUDED
+	#define SHARED_HEAP_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+	extern Shared_Heap * shared_heap;
+
+	Shared_Heap * build_shared_heap(char ** paths, int path_count);
+	void destroy_shared_heap(Shared_Heap * heap);
+	Shared_Program * find_shared_program(Shared_Heap * heap, char * path);
+
+#endif
@@ -21,7 +21,7 @@
 
 	#define RESIZE(stack, type)										\
 	do {															\
-		void * new_data = malloc(2 * stack.cap);					\
+		void * new_data = malloc(sizeof(type) * 2 * stack.cap);	\
 		memcpy(new_data, stack.data, sizeof(type) * stack.n);		\
 		free(stack.data);											\
 		stack.data = new_data;										\
@@ -35,7 +35,8 @@
 			RESIZE(stack, type);															\
 		}																					\
 																							\
-		memcpy(stack.data + sizeof(type) * stack.n, &var_name, sizeof(type));				\
+		type pushed_value = (var_name);														\
+		memcpy(stack.data + sizeof(type) * stack.n, &pushed_value, sizeof(type));			\
 																							\
 		++stack.n;																			\
 																							\
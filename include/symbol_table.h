@@ -0,0 +1,16 @@
+#ifndef SYMBOL_TABLE_INCLUDED
+	#define SYMBOL_TABLE_INCLUDED
+
+	#include "lisp_machine.h"
+	#include <stdint.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	#define SYMBOL_TABLE_STARTING_SIZE 256
+
+	void init_symbol_table(Symbol_Table * table);
+	void destroy_symbol_table(Symbol_Table * table);
+	Cell * find_symbol(Symbol_Table * table, char * name);
+	Cell * intern_symbol(Symbol_Table * table, char * name, uint8_t type);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef TASKS_INCLUDED
+	#define TASKS_INCLUDED
+
+	#include "lisp_machine.h"
+	#include "memory_sys.h"
+	#include <pthread.h>
+	#include <stdbool.h>
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	#define DEQUE_STARTING_SIZE 64
+
+	// States of a future, kept as a fixnum in its cdr
+	#define FUTURE_PENDING	0
+	#define FUTURE_RUNNING	1
+	#define FUTURE_DONE		2
+
+	#define IS_FUTURE(cell) ((cell) != NULL && getType(cell) == SYS_FUTURE)
+
+	// Futures made by one machine that haven't been started. The machine takes
+	// the newest from the tail, other machines steal the oldest from the head.
+	struct task_deque_t {
+		pthread_mutex_t lock;
+		Cell ** futures;
+		int head;
+		int tail;
+		int capacity;
+	};
+
+	// The machines evaluating futures for --threads, one per thread. They all
+	// allocate in the heap of the first one, which runs the REPL.
+	struct task_pool_t {
+		Lisp_Machine ** machines;
+		pthread_t * threads;
+		int machine_count;
+
+		pthread_mutex_t heap_lock;		// Allocation in the old generation
+		pthread_mutex_t intern_lock;	// The symbol table and the shared code table
+
+		// Collections stop every machine. Machines waiting for work or for a
+		// future are parked and don't count as running, so they don't have to
+		// reach a safe point first.
+		pthread_mutex_t lock;
+		pthread_cond_t changed;		// A future was made or finished
+		pthread_cond_t stopped;		// The last running machine parked
+		pthread_cond_t resumed;		// The collection is over
+		int running;
+		bool stopping;
+		bool shutdown;
+
+		int queued;		// Futures in the deques, including ones already taken
+		int active;		// Futures that haven't finished
+		int sleeping;	// Machines waiting for a change
+	};
+
+	// The locks are only taken while the pool is running. The intern lock is
+	// always taken before the heap lock.
+	static inline void lock_heap() {
+		if(machine->owner->pool != NULL) {
+			pthread_mutex_lock(&machine->owner->pool->heap_lock);
+		}
+	}
+
+	static inline void unlock_heap() {
+		if(machine->owner->pool != NULL) {
+			pthread_mutex_unlock(&machine->owner->pool->heap_lock);
+		}
+	}
+
+	static inline void lock_interning() {
+		if(machine->owner->pool != NULL) {
+			pthread_mutex_lock(&machine->owner->pool->intern_lock);
+		}
+	}
+
+	static inline void unlock_interning() {
+		if(machine->owner->pool != NULL) {
+			pthread_mutex_unlock(&machine->owner->pool->intern_lock);
+		}
+	}
+
+	void start_tasks(int thread_count);
+	void stop_tasks();
+	Cell * make_future(Cell * expr, Cell * env);
+	Cell * parallel_call(Cell * call, Cell * env);
+	Cell * touch(Cell * value);
+	bool futures_active();
+	void park_machine();
+	void unpark_machine();
+	bool stop_machines();
+	void start_machines();
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef VALUE_TABLE_INCLUDED
+	#define VALUE_TABLE_INCLUDED
+
+	#include "lisp_machine.h"
+
+	#define VALUE_TABLE_STARTING_SIZE 256
+
+	void init_value_table(Value_Table * table);
+	void destroy_value_table(Value_Table * table);
+	Value_Slot * table_find(Value_Table * table, Cell * symbol);
+	Value_Slot * table_slot(Value_Table * table, Cell * symbol);
+
+#endif
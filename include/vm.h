@@ -0,0 +1,21 @@
+#ifndef VM_INCLUDED
+	#define VM_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	// Kinds of VM_Frame. Only call frames run cached code, the others own theirs.
+	#define VM_FRAME_CALL	0
+	#define VM_FRAME_EVAL	1
+	#define VM_FRAME_TOP	2
+
+	void run_vm();
+	Cell * vm_evaluate(Cell * expr, Cell * env);
+	bool vm_start(Cell * expr);
+	bool vm_resume();
+	bool is_primitive(uint8_t type);
+	Cell * arith(uint8_t type, Cell ** args, int count);
+	Cell * apply_primitive(uint8_t type, Cell ** args, int count);
+
+#endif
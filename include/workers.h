@@ -0,0 +1,10 @@
+#ifndef WORKERS_INCLUDED
+	#define WORKERS_INCLUDED
+
+	#include "lisp_machine.h"
+
+	extern THREAD_LOCAL Lisp_Machine * machine;
+
+	void run_workers(int worker_count, char ** paths, int path_count);
+
+#endif
@@ -0,0 +1,747 @@
+#include "actors.h"
+#include "lisp_machine.h"
+#include "expr_parser.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "repl.h"
+#include "tasks.h"
+#include "vm.h"
+#include "stack.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Machines that share nothing and talk by messages. (spawn f a1 ... an) makes a
+// machine with a heap of its own that evaluates (f a1 ... an) and returns its
+// id, (send id value) puts a copy of value in that machine's mailbox and
+// (receive) takes the oldest message out of the current machine's mailbox,
+// waiting for one if it's empty. (self) is the current machine's id.
+//
+// A message is flattened out of the sender's heap into a malloced array of
+// packed cells and rebuilt in the receiver's heap when it's received, so no
+// cell is ever reachable from two heaps and every machine collects its own
+// garbage without stopping the others. Cells referred to twice are packed once
+// and stay shared. A spawned machine starts with a copy of the definitions its
+// spawner could see, sent along with f and its arguments.
+//
+// Spawned machines run on a few scheduler threads, one per core unless
+// --schedulers says otherwise. A scheduler takes a machine off the run queue
+// and runs it until it finishes, waits in receive with an empty mailbox, or
+// makes ACTOR_REDUCTIONS calls, and then queues it again if it can still run.
+// Machines that run on a thread of their own, like the REPL's or a worker's,
+// get an actor the first time they use one of the primitives and simply block
+// in receive.
+//
+// Mailboxes are lock-free queues with many senders and one receiver. A machine
+// that finds its mailbox empty marks itself waiting before it checks the
+// mailbox one last time, and a sender marks the machine runnable again after
+// queueing the message. Whichever of the two moves the state from waiting to
+// runnable queues or wakes the machine, so a message is never left unseen.
+
+static Actor_System actors = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.runnable = PTHREAD_COND_INITIALIZER
+};
+
+/***********************************************************
+ ************************ Messages *************************
+ ***********************************************************/
+
+// Packed cells already made for cells of the sender's heap, by address
+typedef struct pack_entry_t {
+	Cell * cell;
+	int index;
+} Pack_Entry;
+
+typedef struct packer_t {
+	Message * message;
+	int capacity;
+	Cell ** sources;		// The cell each packed cell was copied from
+	Pack_Entry * entries;
+	int entry_capacity;
+	int entry_count;
+	Stack pending;			// Indexes of packed cells whose references aren't packed
+} Packer;
+
+static size_t hash_cell(Cell * cell, int capacity) {
+	return (size_t)(((uintptr_t)cell >> 3) * 2654435761u) & (size_t)(capacity - 1);
+}
+
+static Pack_Entry * find_entry(Pack_Entry * entries, int capacity, Cell * cell) {
+
+	size_t index = hash_cell(cell, capacity);
+	while(entries[index].cell != NULL && entries[index].cell != cell) {
+		index = (index + 1) & (size_t)(capacity - 1);
+	}
+
+	return &entries[index];
+}
+
+static void grow_entries(Packer * packer) {
+
+	Pack_Entry * old = packer->entries;
+	int old_capacity = packer->entry_capacity;
+
+	packer->entry_capacity *= 2;
+	packer->entries = calloc(packer->entry_capacity, sizeof(Pack_Entry));
+	for(int i = 0; i < old_capacity; ++i) {
+		if(old[i].cell != NULL) {
+			*find_entry(packer->entries, packer->entry_capacity, old[i].cell) = old[i];
+		}
+	}
+
+	free(old);
+}
+
+static int add_packed_cell(Packer * packer, Cell * source, uint8_t kind) {
+
+	Message * message = packer->message;
+	if(message->count == packer->capacity) {
+		packer->capacity *= 2;
+		message->cells = realloc(message->cells, sizeof(Packed_Cell) * packer->capacity);
+		packer->sources = realloc(packer->sources, sizeof(Cell *) * packer->capacity);
+	}
+
+	int index = message->count;
+	++message->count;
+
+	Packed_Cell * packed = &message->cells[index];
+	memset(packed, 0, sizeof(Packed_Cell));
+	packed->kind = kind;
+	packed->car = PACKED_NIL;
+	packed->cdr = PACKED_NIL;
+	packer->sources[index] = source;
+
+	return index;
+}
+
+// Returns the reference to the packed copy of @cell, packing it if it hasn't
+// been yet. The cells it refers to are left for pack_message() to pack.
+static int pack_reference(Packer * packer, Cell * cell) {
+
+	if(cell == NULL) {
+		return PACKED_NULL;
+	}
+	if(cell == machine->nil) {
+		return PACKED_NIL;
+	}
+
+	// A finished future is sent as its value
+	if(IS_FUTURE(cell)) {
+		if(loadCdr(cell) != makeFixnum(FUTURE_DONE)) {
+			fprintf(stderr, "Unable to send a future that hasn't finished.\n");
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+		return pack_reference(packer, getCar(cell));
+	}
+
+	int index;
+	uint8_t type = getType(cell);
+	if(type == SYS_SYM_NUM) {
+		index = add_packed_cell(packer, cell, PACKED_NUMBER);
+		packer->message->cells[index].number = getNumber(cell);
+		return index;
+	}
+
+	Pack_Entry * entry = find_entry(packer->entries, packer->entry_capacity, cell);
+	if(entry->cell != NULL) {
+		return entry->index;
+	}
+
+	if(type == SYS_SYM_STRING || (getIsAtom(cell) && type < SYS_SYM_NUM && type != SYS_RETURN_RECORD)) {
+		index = add_packed_cell(packer, cell, PACKED_SYMBOL);
+		packer->message->cells[index].name = get_symbol_name(cell);
+	}
+	else {
+		index = add_packed_cell(packer, cell, car_is_reference(cell) ? PACKED_CELL : PACKED_DATA);
+		Packed_Cell * packed = &packer->message->cells[index];
+		packed->type = type;
+		packed->is_atom = getIsAtom(cell);
+		if(packed->kind == PACKED_DATA) {
+			packed->data = getCarData(cell);
+		}
+		PUSH(packer->pending, int, index);
+	}
+
+	entry->cell = cell;
+	entry->index = index;
+	++packer->entry_count;
+	if(packer->entry_count * 2 > packer->entry_capacity) {
+		grow_entries(packer);
+	}
+
+	return index;
+}
+
+// Copies @value out of the current machine's heap
+static Message * pack_message(Cell * value) {
+
+	Packer packer;
+	packer.message = malloc(sizeof(Message));
+	packer.message->next = NULL;
+	packer.message->count = 0;
+	packer.capacity = 16;
+	packer.message->cells = malloc(sizeof(Packed_Cell) * packer.capacity);
+	packer.sources = malloc(sizeof(Cell *) * packer.capacity);
+	packer.entry_capacity = 32;
+	packer.entry_count = 0;
+	packer.entries = calloc(packer.entry_capacity, sizeof(Pack_Entry));
+	MAKE_STACK(packer.pending, int);
+
+	packer.message->root = pack_reference(&packer, value);
+
+	int index;
+	while(packer.pending.n != 0) {
+		POP(packer.pending, int, index);
+		Cell * source = packer.sources[index];
+
+		int car = PACKED_NIL;
+		if(packer.message->cells[index].kind == PACKED_CELL) {
+			car = pack_reference(&packer, getCar(source));
+		}
+		int cdr = pack_reference(&packer, getCdr(source));
+
+		packer.message->cells[index].car = car;
+		packer.message->cells[index].cdr = cdr;
+	}
+
+	DESTROY_STACK(&packer.pending);
+	free(packer.entries);
+	free(packer.sources);
+
+	return packer.message;
+}
+
+static void free_message(Message * message) {
+
+	for(int i = 0; i < message->count; ++i) {
+		free(message->cells[i].name);
+	}
+	free(message->cells);
+	free(message);
+}
+
+static Cell * unpacked_reference(Cell ** cells, int reference) {
+
+	if(reference == PACKED_NULL) {
+		return NULL;
+	}
+	if(reference == PACKED_NIL) {
+		return machine->nil;
+	}
+
+	return cells[reference];
+}
+
+// Rebuilds @message in the current machine's heap. Every cell is made before
+// any of them is linked, and nothing in between can collect garbage.
+static Cell * unpack_message(Message * message) {
+
+	if(message->root < 0) {
+		return unpacked_reference(NULL, message->root);
+	}
+
+	Cell ** cells = malloc(sizeof(Cell *) * message->count);
+	for(int i = 0; i < message->count; ++i) {
+		Packed_Cell * packed = &message->cells[i];
+		switch(packed->kind) {
+			case PACKED_NUMBER:
+				cells[i] = make_number(packed->number);
+				break;
+			case PACKED_SYMBOL:
+				cells[i] = make_symbol(packed->name);
+				break;
+			default:
+				cells[i] = get_free_cell();
+				setType(cells[i], packed->type);
+				setIsAtom(cells[i], packed->is_atom);
+				if(packed->kind == PACKED_DATA) {
+					setCarData(cells[i], packed->data);
+				}
+				break;
+		}
+	}
+
+	for(int i = 0; i < message->count; ++i) {
+		Packed_Cell * packed = &message->cells[i];
+		if(packed->kind == PACKED_CELL) {
+			setCar(cells[i], unpacked_reference(cells, packed->car));
+		}
+		if(packed->kind == PACKED_CELL || packed->kind == PACKED_DATA) {
+			setCdr(cells[i], unpacked_reference(cells, packed->cdr));
+		}
+	}
+
+	Cell * value = cells[message->root];
+	free(cells);
+
+	return value;
+}
+
+/***********************************************************
+ ************************ Mailboxes ************************
+ ***********************************************************/
+
+static void init_mailbox(Mailbox * mailbox) {
+	mailbox->stub.next = NULL;
+	mailbox->head = &mailbox->stub;
+	mailbox->tail = &mailbox->stub;
+}
+
+// Safe to call from any thread
+static void push_message(Mailbox * mailbox, Message * message) {
+
+	message->next = NULL;
+	Message * prev = __atomic_exchange_n(&mailbox->tail, message, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+// Only called by the machine the mailbox belongs to. Returns NULL if it's
+// empty, or if a sender is halfway through pushing the only message.
+static Message * pop_message(Mailbox * mailbox) {
+
+	Message * head = mailbox->head;
+	Message * next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	if(head == &mailbox->stub) {
+		if(next == NULL) {
+			return NULL;
+		}
+		mailbox->head = next;
+		head = next;
+		next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	}
+
+	if(next != NULL) {
+		mailbox->head = next;
+		return head;
+	}
+
+	if(head != __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	// Push the stub back behind the last message so it can be taken
+	push_message(mailbox, &mailbox->stub);
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	if(next != NULL) {
+		mailbox->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+// True if a message has been or is being pushed since the last pop. Between
+// pops the stub is at the tail only once every message has been taken, so
+// this doesn't race with the receiver.
+static bool mailbox_ready(Mailbox * mailbox) {
+	return __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE) != &mailbox->stub;
+}
+
+/***********************************************************
+ ************************* Actors **************************
+ ***********************************************************/
+
+// Called with the system lock held
+static Actor * make_actor(bool is_bound) {
+
+	int id = actors.actor_count;
+	if(id == ACTOR_CHUNK_SIZE * ACTOR_MAX_CHUNKS) {
+		fprintf(stderr, "Unable to spawn more than %d machines.\n", id);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Actor ** chunk = actors.chunks[id / ACTOR_CHUNK_SIZE];
+	if(chunk == NULL) {
+		chunk = calloc(ACTOR_CHUNK_SIZE, sizeof(Actor *));
+		__atomic_store_n(&actors.chunks[id / ACTOR_CHUNK_SIZE], chunk, __ATOMIC_RELEASE);
+	}
+
+	Actor * actor = calloc(1, sizeof(Actor));
+	actor->id = id;
+	actor->state = ACTOR_RUNNABLE;
+	actor->is_bound = is_bound;
+	init_mailbox(&actor->mailbox);
+	if(is_bound) {
+		pthread_mutex_init(&actor->lock, NULL);
+		pthread_cond_init(&actor->wakeup, NULL);
+	}
+
+	__atomic_store_n(&chunk[id % ACTOR_CHUNK_SIZE], actor, __ATOMIC_RELEASE);
+	__atomic_store_n(&actors.actor_count, id + 1, __ATOMIC_RELEASE);
+
+	return actor;
+}
+
+// Returns the actor numbered @id, or NULL if there's no such actor
+static Actor * find_actor(Cell * id) {
+
+	if(id == NULL || getType(id) != SYS_SYM_NUM) {
+		return NULL;
+	}
+
+	Cell_Int index = getNumber(id);
+	if(index < 0 || index >= __atomic_load_n(&actors.actor_count, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	Actor ** chunk = __atomic_load_n(&actors.chunks[index / ACTOR_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&chunk[index % ACTOR_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+}
+
+// The current machine's actor. A machine with a thread of its own gets one the
+// first time it needs it.
+static Actor * current_actor() {
+
+	if(machine->actor == NULL) {
+		pthread_mutex_lock(&actors.lock);
+		machine->actor = make_actor(true);
+		machine->actor->machine = machine;
+		pthread_mutex_unlock(&actors.lock);
+	}
+
+	return machine->actor;
+}
+
+// Called with the system lock held
+static void queue_actor(Actor * actor) {
+
+	actor->next_runnable = NULL;
+	if(actors.run_tail != NULL) {
+		actors.run_tail->next_runnable = actor;
+	}
+	else {
+		actors.run_head = actor;
+	}
+	actors.run_tail = actor;
+
+	pthread_cond_signal(&actors.runnable);
+}
+
+static void requeue_actor(Actor * actor) {
+	pthread_mutex_lock(&actors.lock);
+	queue_actor(actor);
+	pthread_mutex_unlock(&actors.lock);
+}
+
+// Moves a waiting actor back to runnable. Returns false if it wasn't waiting or
+// somebody else got there first.
+static bool claim_actor(Actor * actor) {
+
+	int waiting = ACTOR_WAITING;
+	return __atomic_compare_exchange_n(&actor->state, &waiting, ACTOR_RUNNABLE, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void wake_actor(Actor * actor) {
+
+	if(actor->is_bound) {
+		pthread_mutex_lock(&actor->lock);
+		pthread_cond_broadcast(&actor->wakeup);
+		pthread_mutex_unlock(&actor->lock);
+	}
+	else {
+		requeue_actor(actor);
+	}
+}
+
+// Called when the actor's machine is destroyed. Messages still on their way to
+// it are freed by stop_actors().
+void retire_actor(Actor * actor) {
+	__atomic_store_n(&actor->state, ACTOR_DONE, __ATOMIC_RELEASE);
+	actor->machine = NULL;
+}
+
+/***********************************************************
+ *********************** Scheduling ************************
+ ***********************************************************/
+
+// Makes the machine of a spawned actor from its start message and starts
+// evaluating the call. Returns true if it finished straight away.
+static bool start_actor(Actor * actor) {
+
+	machine = init_machine();
+	machine->actor = actor;
+	machine->is_scheduled = true;
+	actor->machine = machine;
+
+	Cell * start = unpack_message(actor->start);
+	free_message(actor->start);
+	actor->start = NULL;
+
+	for(Cell * global = getCdr(start); global != machine->nil; global = getCdr(global)) {
+		define_symbol(getCar(getCar(global)), getCdr(getCar(global)), machine->nil);
+	}
+
+	// The arguments are values already, so they are quoted to keep them from
+	// being evaluated again. A lambda is applied where it stands.
+	Stack args;
+	MAKE_STACK(args, Cell *);
+	for(Cell * arg = getCdr(getCar(start)); arg != machine->nil; arg = getCdr(arg)) {
+		PUSH(args, Cell *, getCar(arg));
+	}
+
+	Cell * quote = make_symbol("quote");
+	Cell * call = machine->nil;
+	Cell * arg;
+	while(args.n != 0) {
+		POP(args, Cell *, arg);
+		call = cons(cons(quote, cons(arg, machine->nil)), call);
+	}
+	call = cons(getCar(getCar(start)), call);
+	DESTROY_STACK(&args);
+
+	machine->reductions = ACTOR_REDUCTIONS;
+	if(engine == ENGINE_TREE) {
+		return start_evaluation(call);
+	}
+	return vm_start(call);
+}
+
+// Runs @actor until it finishes or gives up the thread
+static void run_actor(Actor * actor) {
+
+	bool is_finished;
+	if(actor->machine == NULL) {
+		is_finished = start_actor(actor);
+	}
+	else {
+		machine = actor->machine;
+		machine->reductions = ACTOR_REDUCTIONS;
+		is_finished = engine == ENGINE_TREE ? resume_evaluation() : vm_resume();
+	}
+
+	if(is_finished) {
+		destroy_machine(machine);
+		machine = NULL;
+		return;
+	}
+
+	if(!actor->is_receiving) {
+		requeue_actor(actor);
+		return;
+	}
+
+	// The fence pairs with the one in send_message(), so that either we see the
+	// message or the sender sees us waiting
+	actor->is_receiving = false;
+	__atomic_store_n(&actor->state, ACTOR_WAITING, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(mailbox_ready(&actor->mailbox) && claim_actor(actor)) {
+		requeue_actor(actor);
+	}
+}
+
+static void * scheduler_thread(void * arg) {
+
+	(void)arg;
+
+	pthread_mutex_lock(&actors.lock);
+	for(;;) {
+		while(actors.run_head == NULL && !actors.shutdown) {
+			pthread_cond_wait(&actors.runnable, &actors.lock);
+		}
+		if(actors.shutdown) {
+			break;
+		}
+
+		Actor * actor = actors.run_head;
+		actors.run_head = actor->next_runnable;
+		if(actors.run_head == NULL) {
+			actors.run_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&actors.lock);
+		run_actor(actor);
+		pthread_mutex_lock(&actors.lock);
+	}
+	pthread_mutex_unlock(&actors.lock);
+
+	return NULL;
+}
+
+// Called with the system lock held
+static void start_schedulers() {
+
+	int count = scheduler_count;
+	if(count <= 0) {
+		count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(count <= 0) {
+			count = 1;
+		}
+	}
+
+	actors.threads = malloc(sizeof(pthread_t) * count);
+	actors.thread_count = count;
+	for(int i = 0; i < count; ++i) {
+		if(pthread_create(&actors.threads[i], NULL, scheduler_thread, NULL) != 0) {
+			fprintf(stderr, "Unable to start scheduler thread %d.\n", i);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/***********************************************************
+ *********************** Primitives ************************
+ ***********************************************************/
+
+// Spawns a machine to evaluate the call @args, a list of the function and its
+// arguments, already evaluated. Returns the new machine's id.
+Cell * spawn_machine(Cell * args) {
+
+	if(args == machine->nil) {
+		fprintf(stderr, "Unable to spawn a machine without a function to run.\n");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+	if(runtime_info_flag) {
+		fprintf(stderr, "Unable to spawn a machine with '%s'.\n", "--show-runtime-info");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// The definitions the new machine starts with
+	Value_Table * table = shallow_binding_flag ? &machine->value_table : &machine->owner->global_env;
+	Cell * globals = machine->nil;
+	for(int i = 0; i < table->capacity; ++i) {
+		Value_Slot * slot = &table->slots[i];
+		if(slot->symbol != NULL && slot->is_bound) {
+			globals = cons(cons(slot->symbol, slot->value), globals);
+		}
+	}
+
+	Message * start = pack_message(cons(args, globals));
+
+	pthread_mutex_lock(&actors.lock);
+	if(actors.threads == NULL) {
+		start_schedulers();
+	}
+	Actor * actor = make_actor(false);
+	actor->start = start;
+	queue_actor(actor);
+	pthread_mutex_unlock(&actors.lock);
+
+	return make_number(actor->id);
+}
+
+// Sends a copy of @value to the machine @id. Returns nil if there's no such
+// machine or it has finished.
+Cell * send_message(Cell * id, Cell * value) {
+
+	Actor * actor = find_actor(id);
+	if(actor == NULL || __atomic_load_n(&actor->state, __ATOMIC_ACQUIRE) == ACTOR_DONE) {
+		return machine->nil;
+	}
+
+	push_message(&actor->mailbox, pack_message(value));
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&actor->state, __ATOMIC_RELAXED) == ACTOR_WAITING && claim_actor(actor)) {
+		wake_actor(actor);
+	}
+
+	return NULL;
+}
+
+// Takes the oldest message out of the current machine's mailbox. A spawned
+// machine with an empty mailbox returns false and gives up its thread, and
+// receives again once it's woken. Any other machine waits for a message.
+bool receive_message(Cell ** value) {
+
+	Actor * actor = current_actor();
+	for(;;) {
+		Message * message = pop_message(&actor->mailbox);
+		if(message != NULL) {
+			*value = unpack_message(message);
+			free_message(message);
+			return true;
+		}
+
+		if(machine->is_scheduled) {
+			actor->is_receiving = true;
+			return false;
+		}
+
+		// Other threads of --threads can collect while this one waits
+		park_machine();
+		pthread_mutex_lock(&actor->lock);
+		__atomic_store_n(&actor->state, ACTOR_WAITING, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(mailbox_ready(&actor->mailbox)) {
+			claim_actor(actor);
+		}
+		while(__atomic_load_n(&actor->state, __ATOMIC_ACQUIRE) == ACTOR_WAITING) {
+			pthread_cond_wait(&actor->wakeup, &actor->lock);
+		}
+		pthread_mutex_unlock(&actor->lock);
+		unpark_machine();
+	}
+}
+
+Cell * self_id() {
+	return make_number(current_actor()->id);
+}
+
+// Stops the schedulers and frees every actor. Spawned machines that haven't
+// finished are dropped along with the messages nobody received.
+void stop_actors() {
+
+	pthread_mutex_lock(&actors.lock);
+	actors.shutdown = true;
+	pthread_cond_broadcast(&actors.runnable);
+	pthread_mutex_unlock(&actors.lock);
+
+	for(int i = 0; i < actors.thread_count; ++i) {
+		pthread_join(actors.threads[i], NULL);
+	}
+	free(actors.threads);
+
+	Lisp_Machine * current = machine;
+	for(int i = 0; i < actors.actor_count; ++i) {
+		Actor * actor = actors.chunks[i / ACTOR_CHUNK_SIZE][i % ACTOR_CHUNK_SIZE];
+
+		if(actor->machine != NULL) {
+			if(actor->is_bound) {
+				actor->machine->actor = NULL;
+			}
+			else {
+				machine = actor->machine;
+				destroy_machine(machine);
+			}
+		}
+		machine = current;
+
+		if(actor->start != NULL) {
+			free_message(actor->start);
+		}
+		Message * message;
+		while((message = pop_message(&actor->mailbox)) != NULL) {
+			free_message(message);
+		}
+
+		if(actor->is_bound) {
+			pthread_mutex_destroy(&actor->lock);
+			pthread_cond_destroy(&actor->wakeup);
+		}
+		free(actor);
+	}
+
+	for(int i = 0; i < ACTOR_MAX_CHUNKS && actors.chunks[i] != NULL; ++i) {
+		free(actors.chunks[i]);
+		actors.chunks[i] = NULL;
+	}
+
+	actors.actor_count = 0;
+	actors.run_head = NULL;
+	actors.run_tail = NULL;
+	actors.threads = NULL;
+	actors.thread_count = 0;
+	actors.shutdown = false;
+}
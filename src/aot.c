@@ -0,0 +1,1001 @@
+#include "aot.h"
+#include "vm.h"
+#include "actors.h"
+#include "lisp_machine.h"
+#include "expr_parser.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "shallow_binding.h"
+#include "repl.h"
+#include "stack.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ahead of time compiler for fixed programs. "lisp --emit-c" reads a program the
+// way the REPL does, one make_expression per line, and writes it out as C
+// against the runtime. "make aot PROG=foo.lisp" builds that with the runtime into
+// bin/foo, which prints what the REPL prints running foo.lisp on the bytecode
+// machine.
+//
+// Every lambda written in the program becomes a C function and every top level
+// line another one run in order. They keep their values in registers on the
+// bytecode machine's register stack, so collections can happen on entry to any
+// of them. A lambda defined once at the top level, under a name nothing ever
+// binds, is called directly, and its calls to itself in tail position loop.
+// Arithmetic and comparisons work on C integers. Everything else calls the
+// runtime.
+//
+// Scoping stays dynamic. Compiled programs run with shallow binding, and only
+// a parameter that some code refers to from outside the lambda binding it is
+// bound in its value slot. The others never leave their register.
+//
+// eval is left to the interpreters, since it needs code that only exists at
+// run time. A program using it isn't translated, and calling a lambda built at
+// run time stops the program.
+
+/***********************************************************
+ ************************ Translator ***********************
+ ***********************************************************/
+
+typedef struct symbol_info_t {
+	char * name;
+	bool is_free;		// Referred to from outside of any lambda binding it
+	bool is_param;
+	int define_count;
+	int lambda;			// Lambda it's defined as, or -1
+} Symbol_Info;
+
+typedef struct lambda_info_t {
+	Cell * form;
+	int constant;
+	int * params;		// Symbol of each parameter
+	int param_count;
+	bool defines;		// Has a define in its body
+} Lambda_Info;
+
+typedef struct constant_info_t {
+	Cell * cell;
+	int line;
+	char * path;
+} Constant_Info;
+
+typedef struct translator_t {
+	Stack lines;		// char *
+	Stack symbols;		// Symbol_Info
+	Stack lambdas;		// Lambda_Info
+	Stack constants;	// Constant_Info
+	int line;			// Line being analysed
+} Translator;
+
+// One C function being written
+typedef struct function_t {
+	Translator * t;
+	FILE * out;
+	int lambda;			// -1 for a top level line
+	int next;			// First free register
+	int size;			// Registers used so far
+	int indent;
+	bool loops;			// Calls itself in tail position
+} Function;
+
+#define SYMBOLS(t) ((Symbol_Info *)(t)->symbols.data)
+#define LAMBDAS(t) ((Lambda_Info *)(t)->lambdas.data)
+#define CONSTANTS(t) ((Constant_Info *)(t)->constants.data)
+
+static void analyse(Translator * t, Cell * form, char * path, int scope);
+static void compile_form(Function * f, Cell * form, int dst, bool tail);
+
+static void fail(Translator * t, char * what) {
+	fprintf(stderr, "Line %d: %s can't be compiled ahead of time.\n", t->line + 1, what);
+	fprintf(stderr, "Exiting...\n");
+	exit(EXIT_FAILURE);
+}
+
+static bool is_list(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && !getIsAtom(cell) && getType(cell) == SYS_GENERAL;
+}
+
+static bool is_symbol(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && getIsAtom(cell)
+		&& (getType(cell) == SYS_GENERAL || getType(cell) == SYS_SYM_LOCAL);
+}
+
+// Type of the atom at the head of a form. Fused heads count as the symbol they
+// replace, anything that isn't an atom as a general symbol.
+static uint8_t head_type(Cell * head) {
+
+	if(head == NULL || IS_FIXNUM(head) || head == machine->nil || !getIsAtom(head)) {
+		return SYS_GENERAL;
+	}
+
+	uint8_t type = getType(head);
+	return type >= SYS_FUSED_IF_LT ? getType(getCar(head)) : type;
+}
+
+static Cell * nth(Cell * list, int n) {
+	for(; n > 0 && list != machine->nil; --n) {
+		list = getCdr(list);
+	}
+	return list == machine->nil ? machine->nil : getCar(list);
+}
+
+static int length(Cell * list) {
+	int count = 0;
+	for(; is_list(list); list = getCdr(list)) {
+		++count;
+	}
+	return count;
+}
+
+// Returns the path to element @n of the list at @path
+static char * nth_path(char * path, int n) {
+
+	char * result = malloc(strlen(path) + n + 2);
+	strcpy(result, path);
+
+	char * end = result + strlen(path);
+	for(int i = 0; i < n; ++i) {
+		*end++ = 'd';
+	}
+	*end++ = 'a';
+	*end = '\0';
+
+	return result;
+}
+
+static int symbol_index(Translator * t, Cell * symbol) {
+
+	char * name = get_symbol_name(symbol);
+	for(int i = 0; i < t->symbols.n; ++i) {
+		if(strcmp(SYMBOLS(t)[i].name, name) == 0) {
+			free(name);
+			return i;
+		}
+	}
+
+	Symbol_Info info;
+	info.name = name;
+	info.is_free = false;
+	info.is_param = false;
+	info.define_count = 0;
+	info.lambda = -1;
+	PUSH(t->symbols, Symbol_Info, info);
+
+	return t->symbols.n - 1;
+}
+
+static int param_index(Translator * t, int lambda, int symbol) {
+
+	if(lambda < 0) {
+		return -1;
+	}
+
+	Lambda_Info * info = &LAMBDAS(t)[lambda];
+	for(int i = 0; i < info->param_count; ++i) {
+		if(info->params[i] == symbol) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// A lambda's name if it's defined once at the top level under a name that's
+// never a parameter, so calls to the name can go straight to it
+static int stable_lambda(Translator * t, int symbol) {
+	Symbol_Info * info = &SYMBOLS(t)[symbol];
+	return info->define_count == 1 && !info->is_param ? info->lambda : -1;
+}
+
+static bool is_dynamic(Translator * t, int lambda, int param) {
+	return SYMBOLS(t)[LAMBDAS(t)[lambda].params[param]].is_free;
+}
+
+// True if the lambda binds anything in value slots, which it has to undo when
+// it returns. Like on the bytecode machine, a lambda without parameters leaves
+// its definitions to its caller.
+static bool binds_symbols(Translator * t, int lambda) {
+
+	if(LAMBDAS(t)[lambda].param_count == 0) {
+		return false;
+	}
+	if(LAMBDAS(t)[lambda].defines) {
+		return true;
+	}
+
+	for(int i = 0; i < LAMBDAS(t)[lambda].param_count; ++i) {
+		if(is_dynamic(t, lambda, i)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int constant_index(Translator * t, Cell * cell) {
+	for(int i = 0; i < t->constants.n; ++i) {
+		if(CONSTANTS(t)[i].cell == cell) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int add_constant(Translator * t, Cell * cell, char * path) {
+
+	int index = constant_index(t, cell);
+	if(index >= 0) {
+		return index;
+	}
+
+	Constant_Info info;
+	info.cell = cell;
+	info.line = t->line;
+	info.path = strdup(path);
+	PUSH(t->constants, Constant_Info, info);
+
+	return t->constants.n - 1;
+}
+
+static int lambda_index(Translator * t, Cell * form) {
+	for(int i = 0; i < t->lambdas.n; ++i) {
+		if(LAMBDAS(t)[i].form == form) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int add_lambda(Translator * t, Cell * form, char * path) {
+
+	int index = lambda_index(t, form);
+	if(index >= 0) {
+		return index;
+	}
+
+	Cell * params = nth(form, 1);
+
+	Lambda_Info info;
+	info.form = form;
+	info.constant = add_constant(t, form, path);
+	info.param_count = length(params);
+	info.defines = false;
+	info.params = malloc(sizeof(int) * (info.param_count + 1));
+	for(int i = 0; i < info.param_count; ++i) {
+		info.params[i] = symbol_index(t, nth(params, i));
+		SYMBOLS(t)[info.params[i]].is_param = true;
+	}
+	PUSH(t->lambdas, Lambda_Info, info);
+	index = t->lambdas.n - 1;
+
+	char * body = nth_path(path, 2);
+	analyse(t, nth(form, 2), body, index);
+	free(body);
+
+	return index;
+}
+
+// Finds the symbols, lambdas and constants of a form evaluated inside the
+// lambda @scope, or at the top level if it's -1
+static void analyse(Translator * t, Cell * form, char * path, int scope) {
+
+	if(is_symbol(form)) {
+		int symbol = symbol_index(t, form);
+		if(param_index(t, scope, symbol) < 0) {
+			SYMBOLS(t)[symbol].is_free = true;
+		}
+		return;
+	}
+
+	if(!is_list(form)) {
+		if(form == NULL || form == machine->nil || IS_FIXNUM(form)) {
+			return;
+		}
+
+		// Other atoms evaluate to themselves, like on the bytecode machine
+		uint8_t type = getType(form);
+		if(type != SYS_SYM_TRUE && type != SYS_SYM_FALSE && type != SYS_SYM_NULL) {
+			add_constant(t, form, path);
+		}
+		return;
+	}
+
+	Cell * head = getCar(form);
+	uint8_t type = head_type(head);
+	int count = length(form);
+
+	switch(type) {
+		case SYS_SYM_QUOTE: {
+			char * datum = nth_path(path, 1);
+			add_constant(t, nth(form, 1), datum);
+			free(datum);
+			return;
+		}
+		case SYS_SYM_LAMBDA:
+			add_lambda(t, form, path);
+			return;
+		case SYS_SYM_DEFINE: {
+			if(!is_symbol(nth(form, 1))) {
+				fail(t, "define of something other than a symbol");
+			}
+
+			// The value is stored as it's written, so only a lambda holds code
+			int symbol = symbol_index(t, nth(form, 1));
+			Cell * value = nth(form, 2);
+			char * value_path = nth_path(path, 2);
+			add_constant(t, value, value_path);
+			if(is_list(value) && head_type(getCar(value)) == SYS_SYM_LAMBDA) {
+				int lambda = add_lambda(t, value, value_path);
+				if(scope < 0) {
+					SYMBOLS(t)[symbol].lambda = lambda;
+				}
+			}
+			++SYMBOLS(t)[symbol].define_count;
+
+			// A define inside a lambda binds the symbol until the lambda returns
+			if(scope >= 0) {
+				SYMBOLS(t)[symbol].is_free = true;
+				LAMBDAS(t)[scope].defines = true;
+			}
+			free(value_path);
+			return;
+		}
+		case SYS_SYM_EVAL:
+			fail(t, "eval");
+	}
+
+	// Only the arguments of special forms and primitives are evaluated. The
+	// call in a pcall is evaluated as a whole.
+	int first = 1;
+	if(type == SYS_GENERAL || !(type == SYS_SYM_IF || type == SYS_SYM_BEGIN || type == SYS_SYM_FUTURE
+		|| type == SYS_SYM_PCALL || is_primitive(type))) {
+		first = 0;
+	}
+
+	for(int i = first; i < count; ++i) {
+		char * element = nth_path(path, i);
+		analyse(t, nth(form, i), element, scope);
+		free(element);
+	}
+}
+
+/***********************************************************
+ ********************** Code Generation ********************
+ ***********************************************************/
+
+static void emit(Function * f, char * format, ...) {
+
+	for(int i = 0; i < f->indent; ++i) {
+		fputc('\t', f->out);
+	}
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(f->out, format, args);
+	va_end(args);
+
+	fputc('\n', f->out);
+}
+
+static int allocate(Function * f, int count) {
+
+	int first = f->next;
+	f->next += count;
+	if(f->next > f->size) {
+		f->size = f->next;
+	}
+
+	return first;
+}
+
+static char * type_name(uint8_t type) {
+
+	switch(type) {
+		case SYS_SYM_MULT: return "SYS_SYM_MULT";
+		case SYS_SYM_ADD: return "SYS_SYM_ADD";
+		case SYS_SYM_SUB: return "SYS_SYM_SUB";
+		case SYS_SYM_DIV: return "SYS_SYM_DIV";
+		case SYS_SYM_MOD: return "SYS_SYM_MOD";
+		case SYS_SYM_CHARAT: return "SYS_SYM_CHARAT";
+		case SYS_SYM_JOIN: return "SYS_SYM_JOIN";
+		case SYS_SYM_SUBSTR: return "SYS_SYM_SUBSTR";
+		case SYS_SYM_IN: return "SYS_SYM_IN";
+		case SYS_SYM_OUT: return "SYS_SYM_OUT";
+		case SYS_SYM_CAR: return "SYS_SYM_CAR";
+		case SYS_SYM_CDR: return "SYS_SYM_CDR";
+		case SYS_SYM_CONS: return "SYS_SYM_CONS";
+		case SYS_SYM_EQ: return "SYS_SYM_EQ";
+		case SYS_SYM_ATOM: return "SYS_SYM_ATOM";
+		case SYS_SYM_LESS: return "SYS_SYM_LESS";
+		case SYS_SYM_EQUAL: return "SYS_SYM_EQUAL";
+		case SYS_SYM_GREAT: return "SYS_SYM_GREAT";
+		case SYS_SYM_AND: return "SYS_SYM_AND";
+		case SYS_SYM_OR: return "SYS_SYM_OR";
+		case SYS_SYM_TOUCH: return "SYS_SYM_TOUCH";
+		case SYS_SYM_SPAWN: return "SYS_SYM_SPAWN";
+		case SYS_SYM_SEND: return "SYS_SYM_SEND";
+		case SYS_SYM_RECEIVE: return "SYS_SYM_RECEIVE";
+		case SYS_SYM_SELF: return "SYS_SYM_SELF";
+		default: return "SYS_SYM_NOT";
+	}
+}
+
+// Evaluates the elements of @form from @from on into consecutive new registers
+static int compile_operands(Function * f, Cell * form, int from) {
+
+	int count = length(form) - from;
+	int first = allocate(f, count);
+	for(int i = 0; i < count; ++i) {
+		compile_form(f, nth(form, from + i), first + i, false);
+	}
+
+	return first;
+}
+
+static void compile_symbol(Function * f, Cell * form, int dst) {
+
+	int symbol = symbol_index(f->t, form);
+	int param = param_index(f->t, f->lambda, symbol);
+
+	if(param < 0) {
+		emit(f, "REG(%d) = aot_lookup(symbols[%d]);", dst, symbol);
+	}
+	else if(is_dynamic(f->t, f->lambda, param)) {
+		emit(f, "REG(%d) = value_slot(symbols[%d])->value;", dst, symbol);
+	}
+	else {
+		emit(f, "REG(%d) = REG(%d);", dst, param);
+	}
+}
+
+static void compile_primitive(Function * f, uint8_t type, Cell * form, int dst) {
+
+	int count = length(form) - 1;
+	int first = compile_operands(f, form, 1);
+	int second = first + 1;
+
+	if(type == SYS_SYM_QUIT) {
+		emit(f, "aot_quit();");
+	}
+	else if(count == 2 && (type == SYS_SYM_ADD || type == SYS_SYM_SUB || type == SYS_SYM_MULT)) {
+		// Overflowing a whole word wraps around, like arith()
+		char op = type == SYS_SYM_ADD ? '+' : type == SYS_SYM_SUB ? '-' : '*';
+		emit(f, "REG(%d) = make_number((Cell_Int)((Cell_Word)getNumber(REG(%d)) %c (Cell_Word)getNumber(REG(%d))));",
+			dst, first, op, second);
+	}
+	else if(count == 2 && (type == SYS_SYM_DIV || type == SYS_SYM_MOD)) {
+		emit(f, "REG(%d) = make_number(getNumber(REG(%d)) %c getNumber(REG(%d)));",
+			dst, first, type == SYS_SYM_DIV ? '/' : '%', second);
+	}
+	else if(type == SYS_SYM_ADD || type == SYS_SYM_SUB || type == SYS_SYM_MULT
+		|| type == SYS_SYM_DIV || type == SYS_SYM_MOD) {
+		emit(f, "REG(%d) = arith(%s, &REG(%d), %d);", dst, type_name(type), first, count);
+	}
+	else if(count == 1 && type == SYS_SYM_CAR) {
+		emit(f, "REG(%d) = getCar(REG(%d));", dst, first);
+	}
+	else if(count == 1 && type == SYS_SYM_CDR) {
+		emit(f, "REG(%d) = getCdr(REG(%d));", dst, first);
+	}
+	else if(count == 1 && type == SYS_SYM_ATOM) {
+		emit(f, "REG(%d) = atom(REG(%d));", dst, first);
+	}
+	else if(count == 1 && type == SYS_SYM_NOT) {
+		emit(f, "REG(%d) = REG(%d) == NULL ? machine->nil : NULL;", dst, first);
+	}
+	else if(count == 2 && type == SYS_SYM_CONS) {
+		emit(f, "REG(%d) = cons(REG(%d), REG(%d));", dst, first, second);
+	}
+	else if(count == 2 && type == SYS_SYM_EQ) {
+		emit(f, "REG(%d) = eq(REG(%d), REG(%d));", dst, first, second);
+	}
+	else if(count == 2 && (type == SYS_SYM_LESS || type == SYS_SYM_EQUAL || type == SYS_SYM_GREAT)) {
+		char * op = type == SYS_SYM_LESS ? "<" : type == SYS_SYM_EQUAL ? "==" : ">";
+		emit(f, "REG(%d) = getNumber(REG(%d)) %s getNumber(REG(%d)) ? NULL : machine->nil;", dst, first, op, second);
+	}
+	else if(count == 2 && type == SYS_SYM_AND) {
+		emit(f, "REG(%d) = REG(%d) == NULL && REG(%d) == NULL ? NULL : machine->nil;", dst, first, second);
+	}
+	else if(count == 2 && type == SYS_SYM_OR) {
+		emit(f, "REG(%d) = REG(%d) == NULL || REG(%d) == NULL ? NULL : machine->nil;", dst, first, second);
+	}
+	else {
+		emit(f, "REG(%d) = apply_primitive(%s, &REG(%d), %d);", dst, type_name(type), first, count);
+	}
+
+	f->next = first;
+}
+
+// Evaluates the test of an if and returns it as a C condition. Comparisons of
+// two numbers don't need a cell for their result.
+static char * compile_test(Function * f, Cell * test) {
+
+	char * condition = malloc(128);
+	int first = f->next;
+
+	uint8_t type = is_list(test) ? head_type(getCar(test)) : SYS_GENERAL;
+	if(length(test) == 3 && (type == SYS_SYM_LESS || type == SYS_SYM_EQUAL || type == SYS_SYM_GREAT)) {
+		compile_operands(f, test, 1);
+		char * op = type == SYS_SYM_LESS ? "<" : type == SYS_SYM_EQUAL ? "==" : ">";
+		snprintf(condition, 128, "getNumber(REG(%d)) %s getNumber(REG(%d))", first, op, first + 1);
+	}
+	else {
+		compile_form(f, test, allocate(f, 1), false);
+		snprintf(condition, 128, "REG(%d) != machine->nil", first);
+	}
+
+	f->next = first;
+	return condition;
+}
+
+static void compile_if(Function * f, Cell * form, int dst, bool tail) {
+
+	char * condition = compile_test(f, nth(form, 1));
+	emit(f, "if(%s) {", condition);
+	free(condition);
+
+	++f->indent;
+	compile_form(f, nth(form, 2), dst, tail);
+	--f->indent;
+	emit(f, "}");
+	emit(f, "else {");
+	++f->indent;
+	compile_form(f, nth(form, 3), dst, tail);
+	--f->indent;
+	emit(f, "}");
+}
+
+static void compile_call(Function * f, Cell * form, int dst, bool tail) {
+
+	Translator * t = f->t;
+	Cell * head = getCar(form);
+	int count = length(form) - 1;
+
+	int lambda = is_symbol(head) ? stable_lambda(t, symbol_index(t, head)) : -1;
+	if(lambda < 0) {
+		int first = compile_operands(f, form, 0);
+		emit(f, "SET(%d, aot_apply(base + %d, %d));", dst, first, count);
+		f->next = first;
+		return;
+	}
+
+	// Like a lookup, the call fails if the definition hasn't run yet
+	int symbol = symbol_index(t, head);
+	emit(f, "if(!defined[%d]) {", symbol);
+	emit(f, "\taot_not_found(symbols[%d]);", symbol);
+	emit(f, "}");
+
+	int first = compile_operands(f, form, 1);
+	if(tail && lambda == f->lambda) {
+		int param_count = LAMBDAS(t)[lambda].param_count;
+		for(int i = 0; i < param_count; ++i) {
+			if(i < count) {
+				emit(f, "REG(%d) = REG(%d);", i, first + i);
+			}
+			else {
+				emit(f, "REG(%d) = machine->nil;", i);
+			}
+		}
+		// Definitions survive a tail call unless the parameters hide them,
+		// like call() on the bytecode machine
+		if(binds_symbols(t, lambda) && LAMBDAS(t)[lambda].defines) {
+			emit(f, "if(bindings_shadowed(mark, getCar(getCdr(CONSTANT(%d))))) {", LAMBDAS(t)[lambda].constant);
+			emit(f, "\tunbind_to(mark);");
+			emit(f, "}");
+		}
+		else if(binds_symbols(t, lambda)) {
+			emit(f, "unbind_to(mark);");
+		}
+		emit(f, "GC_SAFE_POINT();");
+		emit(f, "goto start;");
+		f->loops = true;
+	}
+	else {
+		emit(f, "SET(%d, lambda_%d(base + %d, %d));", dst, lambda, first, count);
+	}
+
+	f->next = first;
+}
+
+// Evaluates @form into register @dst. Calls in @tail position return straight
+// from the function.
+static void compile_form(Function * f, Cell * form, int dst, bool tail) {
+
+	Translator * t = f->t;
+
+	// Like the interpreters, () is looked up as a symbol
+	if(form == machine->nil) {
+		emit(f, "REG(%d) = aot_lookup(machine->nil);", dst);
+		return;
+	}
+	if(IS_FIXNUM(form)) {
+		emit(f, "REG(%d) = makeFixnum(%lld);", dst, (long long)getFixnum(form));
+		return;
+	}
+	if(is_symbol(form)) {
+		compile_symbol(f, form, dst);
+		return;
+	}
+	if(!is_list(form)) {
+		if(getType(form) == SYS_SYM_TRUE) {
+			emit(f, "REG(%d) = NULL;", dst);
+		}
+		else if(getType(form) == SYS_SYM_FALSE || getType(form) == SYS_SYM_NULL) {
+			emit(f, "REG(%d) = machine->nil;", dst);
+		}
+		else {
+			emit(f, "REG(%d) = CONSTANT(%d);", dst, constant_index(t, form));
+		}
+		return;
+	}
+
+	uint8_t type = head_type(getCar(form));
+	switch(type) {
+		case SYS_SYM_QUOTE:
+			emit(f, "REG(%d) = CONSTANT(%d);", dst, constant_index(t, nth(form, 1)));
+			break;
+		case SYS_SYM_LAMBDA:
+			emit(f, "REG(%d) = CONSTANT(%d);", dst, constant_index(t, form));
+			break;
+		case SYS_SYM_DEFINE: {
+			int symbol = symbol_index(t, nth(form, 1));
+			emit(f, "define_symbol(symbols[%d], CONSTANT(%d), machine->nil);",
+				symbol, constant_index(t, nth(form, 2)));
+			if(stable_lambda(t, symbol) >= 0) {
+				emit(f, "defined[%d] = true;", symbol);
+			}
+			emit(f, "REG(%d) = NULL;", dst);
+			break;
+		}
+		case SYS_SYM_IF:
+			compile_if(f, form, dst, tail);
+			break;
+		// Compiled programs run on one thread, so futures are evaluated in
+		// place like they are without --threads
+		case SYS_SYM_FUTURE:
+			compile_form(f, nth(form, 1), dst, tail);
+			break;
+		case SYS_SYM_PCALL:
+			if(length(form) == 1) {
+				emit(f, "REG(%d) = machine->nil;", dst);
+			}
+			else {
+				compile_form(f, getCdr(form), dst, tail);
+			}
+			break;
+		case SYS_SYM_BEGIN: {
+			int count = length(form);
+			if(count == 1) {
+				emit(f, "REG(%d) = machine->nil;", dst);
+			}
+			for(int i = 1; i < count; ++i) {
+				compile_form(f, nth(form, i), dst, tail && i == count - 1);
+			}
+			break;
+		}
+		default:
+			if(type != SYS_GENERAL && (is_primitive(type) || type == SYS_SYM_QUIT)) {
+				compile_primitive(f, type, form, dst);
+			}
+			else {
+				compile_call(f, form, dst, tail);
+			}
+	}
+}
+
+// Writes the function for lambda @lambda, or for the top level @form if it's -1
+static void compile_function(Translator * t, FILE * out, int lambda, Cell * form, int index) {
+
+	char * body;
+	size_t body_size;
+
+	Function f;
+	f.t = t;
+	f.out = open_memstream(&body, &body_size);
+	f.lambda = lambda;
+	f.next = 0;
+	f.size = 0;
+	f.indent = 1;
+	f.loops = false;
+
+	bool dynamic = lambda >= 0 && binds_symbols(t, lambda);
+	if(lambda >= 0) {
+		Lambda_Info * info = &LAMBDAS(t)[lambda];
+		allocate(&f, info->param_count);
+		for(int i = 0; i < info->param_count; ++i) {
+			if(is_dynamic(t, lambda, i)) {
+				emit(&f, "bind_symbol(symbols[%d], REG(%d));", info->params[i], i);
+			}
+		}
+		form = nth(info->form, 2);
+	}
+
+	int result = allocate(&f, 1);
+	compile_form(&f, form, result, lambda >= 0);
+	if(dynamic) {
+		emit(&f, "unbind_to(mark);");
+	}
+	emit(&f, "return aot_leave(top, REG(%d));", result);
+	fclose(f.out);
+
+	if(lambda >= 0) {
+		fprintf(out, "static Cell * lambda_%d(int base, int count) {\n", lambda);
+	}
+	else {
+		fprintf(out, "static Cell * line_%d(int base, int count) {\n", index);
+	}
+	fprintf(out, "\tint top = aot_enter(base, count, %d);\n", f.size);
+	if(dynamic) {
+		fprintf(out, "\tint mark = machine->binding_stack.n;\n");
+	}
+	if(f.loops) {
+		fprintf(out, "start:\n");
+	}
+	fputs(body, out);
+	fprintf(out, "}\n\n");
+
+	free(body);
+}
+
+static void emit_string(FILE * out, char * string) {
+
+	fputc('"', out);
+	for(; *string != '\0'; ++string) {
+		switch(*string) {
+			case '"': fputs("\\\"", out); break;
+			case '\\': fputs("\\\\", out); break;
+			case '\n': fputs("\\n", out); break;
+			case '\t': fputs("\\t", out); break;
+			default: fputc(*string, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static bool is_blank(char * string) {
+	for(; *string != '\0'; ++string) {
+		if(*string != ' ' && *string != '\t' && *string != '\n') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Translates the program on stdin to C on stdout
+void emit_c() {
+
+	Translator t;
+	MAKE_STACK(t.lines, char *);
+	MAKE_STACK(t.symbols, Symbol_Info);
+	MAKE_STACK(t.lambdas, Lambda_Info);
+	MAKE_STACK(t.constants, Constant_Info);
+
+	// Lines are read like the REPL's in does. The parsed lines stay on the
+	// register stack until the translation is done so they aren't collected.
+	char * string = malloc(sizeof(char) * INPUT_BUFFER_LENGTH);
+	while(fgets(string, INPUT_BUFFER_LENGTH, stdin) != NULL) {
+		if(!is_blank(string)) {
+			PUSH(t.lines, char *, strdup(string));
+			Cell * form = make_expression(string);
+			PUSH(machine->vm_registers, Cell *, form);
+		}
+	}
+	free(string);
+
+	Cell ** forms = machine->vm_registers.data;
+	for(t.line = 0; t.line < t.lines.n; ++t.line) {
+		analyse(&t, forms[t.line], "", -1);
+	}
+
+	char ** lines = t.lines.data;
+	FILE * out = stdout;
+
+	fprintf(out, "// Translated by lisp --emit-c\n");
+	fprintf(out, "#include \"aot.h\"\n");
+	fprintf(out, "#include \"vm.h\"\n");
+	fprintf(out, "#include \"lisp_machine.h\"\n\n");
+
+	fprintf(out, "static char * lines[] = {\n");
+	for(int i = 0; i < t.lines.n; ++i) {
+		fprintf(out, "\t");
+		emit_string(out, lines[i]);
+		fprintf(out, ",\n");
+	}
+	fprintf(out, "\tNULL\n};\n\n");
+
+	fprintf(out, "static int constant_lines[] = {");
+	for(int i = 0; i < t.constants.n; ++i) {
+		fprintf(out, "%d, ", CONSTANTS(&t)[i].line);
+	}
+	fprintf(out, "-1};\n");
+
+	fprintf(out, "static char * constant_paths[] = {");
+	for(int i = 0; i < t.constants.n; ++i) {
+		fprintf(out, "\"%s\", ", CONSTANTS(&t)[i].path);
+	}
+	fprintf(out, "NULL};\n\n");
+
+	fprintf(out, "static char * symbol_names[] = {\n");
+	for(int i = 0; i < t.symbols.n; ++i) {
+		fprintf(out, "\t");
+		emit_string(out, SYMBOLS(&t)[i].name);
+		fprintf(out, ",\n");
+	}
+	fprintf(out, "\tNULL\n};\n\n");
+
+	fprintf(out, "static Cell * symbols[%d];\n", t.symbols.n + 1);
+	fprintf(out, "static bool defined[%d];\n\n", t.symbols.n + 1);
+
+	for(int i = 0; i < t.lambdas.n; ++i) {
+		fprintf(out, "static Cell * lambda_%d(int base, int count);\n", i);
+	}
+	fprintf(out, "\n");
+
+	for(int i = 0; i < t.lambdas.n; ++i) {
+		compile_function(&t, out, i, NULL, i);
+	}
+	for(t.line = 0; t.line < t.lines.n; ++t.line) {
+		compile_function(&t, out, -1, forms[t.line], t.line);
+	}
+
+	fprintf(out, "static Aot_Lambda lambdas[] = {\n");
+	for(int i = 0; i < t.lambdas.n; ++i) {
+		fprintf(out, "\t{%d, lambda_%d},\n", LAMBDAS(&t)[i].constant, i);
+	}
+	fprintf(out, "\t{-1, NULL}\n};\n\n");
+
+	fprintf(out, "static Aot_Function forms[] = {\n");
+	for(int i = 0; i < t.lines.n; ++i) {
+		fprintf(out, "\tline_%d,\n", i);
+	}
+	fprintf(out, "\tNULL\n};\n\n");
+
+	fprintf(out, "static Aot_Program program = {\n");
+	fprintf(out, "\tlines, %d,\n", t.lines.n);
+	fprintf(out, "\tconstant_lines, constant_paths, %d,\n", t.constants.n);
+	fprintf(out, "\tsymbol_names, symbols, %d,\n", t.symbols.n);
+	fprintf(out, "\tlambdas, %d,\n", t.lambdas.n);
+	fprintf(out, "\tforms, %d,\n", t.lines.n);
+	fprintf(out, "\t%s, %s\n", fold_flag ? "true" : "false", hash_cons_flag ? "true" : "false");
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "int main(int argc, char * argv[]) {\n");
+	fprintf(out, "\treturn run_program(&program, argc, argv);\n");
+	fprintf(out, "}\n");
+
+	machine->vm_registers.n = 0;
+}
+
+/***********************************************************
+ ************************* Runtime *************************
+ ***********************************************************/
+
+// The compiled program's first constant register
+int aot_constants;
+
+static Aot_Program * aot_program;
+
+void aot_quit() {
+
+	stop_actors();
+
+	fprintf(machine->out, " => Program requested the machine to quit execution. Quiting...\n");
+	fprintf(machine->out, " > ");
+	print_list(make_expression("HALT"));
+	fprintf(machine->out, "\n");
+
+	if(stats_flag) {
+		print_stats();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+void aot_not_found(Cell * symbol) {
+
+	char * name = get_symbol_name(symbol);
+	fprintf(machine->out, " => Symbol not found: %s\n", name);
+	free(name);
+
+	aot_quit();
+}
+
+Cell * aot_lookup(Cell * symbol) {
+
+	Value_Slot * slot = value_slot(symbol);
+	if(!slot->is_bound) {
+		aot_not_found(symbol);
+	}
+
+	return slot->value;
+}
+
+// Calls the function in register @first with the @count registers after it as
+// arguments, like the bytecode machine's call()
+Cell * aot_apply(int first, int count) {
+
+	Cell ** registers = machine->vm_registers.data;
+	Cell * function = registers[first];
+	while(function != NULL && getIsAtom(function)
+		&& (getType(function) == SYS_GENERAL || getType(function) == SYS_SYM_LOCAL)) {
+		function = aot_lookup(getType(function) == SYS_SYM_LOCAL ? getCar(function) : function);
+	}
+
+	if(function == NULL || getIsAtom(function)) {
+		uint8_t type = function == NULL ? SYS_SYM_TRUE : getType(function);
+
+		if(type == SYS_SYM_QUIT) {
+			aot_quit();
+		}
+		else if(type == SYS_SYM_EVAL) {
+			fprintf(stderr, "Compiled programs can't call eval.\n");
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+		else if(!is_primitive(type)) {
+			fprintf(machine->out, " => Not a function: ");
+			print_list(function);
+			aot_quit();
+		}
+
+		return apply_primitive(type, &registers[first + 1], count);
+	}
+
+	for(int i = 0; i < aot_program->lambda_count; ++i) {
+		if(CONSTANT(aot_program->lambdas[i].constant) == function) {
+			return aot_program->lambdas[i].function(first + 1, count);
+		}
+	}
+
+	fprintf(stderr, "Compiled programs can only call the lambdas written in them.\n");
+	fprintf(stderr, "Exiting...\n");
+	exit(EXIT_FAILURE);
+}
+
+// Runs a program translated by emit_c(), printing the value of each line the
+// way the REPL does
+int run_program(Aot_Program * program, int argc, char * argv[]) {
+
+	process_args(argc, argv);
+	fold_flag = program->fold;
+	hash_cons_flag = program->hash_cons;
+
+	machine = init_machine();
+	aot_program = program;
+
+	// The lines are parsed again to rebuild the constants, and both are kept at
+	// the bottom of the register stack where the collector sees them
+	for(int i = 0; i < program->line_count; ++i) {
+		Cell * form = make_expression(program->lines[i]);
+		PUSH(machine->vm_registers, Cell *, form);
+	}
+
+	aot_constants = machine->vm_registers.n;
+	for(int i = 0; i < program->constant_count; ++i) {
+		Cell * cell = ((Cell **)machine->vm_registers.data)[program->constant_lines[i]];
+		for(char * step = program->constant_paths[i]; *step != '\0'; ++step) {
+			cell = *step == 'a' ? getCar(cell) : getCdr(cell);
+		}
+		PUSH(machine->vm_registers, Cell *, cell);
+	}
+
+	for(int i = 0; i < program->symbol_count; ++i) {
+		program->symbols[i] = make_symbol(program->symbol_names[i]);
+	}
+
+	shallow_binding_flag = true;
+
+	for(int i = 0; i < program->form_count; ++i) {
+		fprintf(machine->out, " <= ");
+		Cell * value = program->forms[i](machine->vm_registers.n, 0);
+		fprintf(machine->out, " > ");
+		print_list(value);
+		fprintf(machine->out, "\n");
+	}
+
+	// Running out of program ends it like quit
+	aot_quit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,517 @@
+#include "bytecode.h"
+#include "jit.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Compiler from parsed code to the bytecode run by vm.c. Each lambda body is
+// compiled the first time it's called and kept in a cache keyed by the lambda's
+// cell. Expressions given to eval are compiled each time and freed once they
+// return.
+//
+// Values are kept in registers. Every subexpression is compiled into a given
+// register, using the registers above it for its temporaries, so a frame needs
+// as many registers as the deepest nesting of its body. The arguments of a call
+// go in consecutive registers after the function, where they become the first
+// registers of the called lambda's frame. Lambda bodies leave a register for
+// each parameter below their own.
+//
+// Calls whose value is returned straight away, in the last form of a begin, the
+// branches of an if or the whole body, are compiled as tail calls.
+
+typedef struct compiler_t {
+	Code * code;
+	int next_register;
+} Compiler;
+
+static void compile_form(Compiler * compiler, Cell * form, int dst, bool tail);
+
+/***********************************************************
+ *********************** Code Objects **********************
+ ***********************************************************/
+
+static Code * make_code() {
+
+	Code * code = malloc(sizeof(Code));
+	code->ops = malloc(sizeof(uint16_t) * CODE_STARTING_SIZE);
+	code->length = 0;
+	code->capacity = CODE_STARTING_SIZE;
+	code->constants = malloc(sizeof(Cell *) * CODE_STARTING_SIZE);
+	code->constant_count = 0;
+	code->constant_capacity = CODE_STARTING_SIZE;
+	code->register_count = 0;
+	code->call_count = 0;
+	code->native = NULL;
+	code->native_memory = NULL;
+	code->native_size = 0;
+
+	return code;
+}
+
+void free_code(Code * code) {
+	free_native(code);
+	free(code->ops);
+	free(code->constants);
+	free(code);
+}
+
+static void check_operand(int operand) {
+	if(operand < 0 || operand > MAX_OPERAND) {
+		fprintf(stderr, "Bytecode operand %d does not fit in an instruction.\n", operand);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void emit(Code * code, int value) {
+
+	check_operand(value);
+
+	if(code->length == code->capacity) {
+		code->capacity *= 2;
+		code->ops = realloc(code->ops, sizeof(uint16_t) * code->capacity);
+	}
+
+	code->ops[code->length] = value;
+	++code->length;
+}
+
+// Returns the index of @cell in the constant table, adding it if needed
+static int add_constant(Code * code, Cell * cell) {
+
+	for(int i = 0; i < code->constant_count; ++i) {
+		if(code->constants[i] == cell) {
+			return i;
+		}
+	}
+
+	if(code->constant_count == code->constant_capacity) {
+		code->constant_capacity *= 2;
+		code->constants = realloc(code->constants, sizeof(Cell *) * code->constant_capacity);
+	}
+
+	code->constants[code->constant_count] = cell;
+	++code->constant_count;
+
+	return code->constant_count - 1;
+}
+
+/***********************************************************
+ ************************ Compiler *************************
+ ***********************************************************/
+
+// Reserves @count registers above the ones in use and returns the first
+static int alloc_registers(Compiler * compiler, int count) {
+
+	int first = compiler->next_register;
+	compiler->next_register += count;
+	check_operand(compiler->next_register);
+
+	if(compiler->next_register > compiler->code->register_count) {
+		compiler->code->register_count = compiler->next_register;
+	}
+
+	return first;
+}
+
+static void compile_constant(Compiler * compiler, Cell * value, int dst) {
+	emit(compiler->code, OP_CONST);
+	emit(compiler->code, dst);
+	emit(compiler->code, add_constant(compiler->code, value));
+}
+
+static void compile_atom(Compiler * compiler, Cell * atom, int dst) {
+
+	switch(getType(atom)) {
+		case SYS_GENERAL:
+			emit(compiler->code, OP_LOOKUP);
+			emit(compiler->code, dst);
+			emit(compiler->code, add_constant(compiler->code, atom));
+			break;
+		case SYS_SYM_LOCAL:
+			emit(compiler->code, OP_LOCAL);
+			emit(compiler->code, dst);
+			emit(compiler->code, add_constant(compiler->code, atom));
+			break;
+		case SYS_SYM_NULL:
+		case SYS_SYM_FALSE:
+			compile_constant(compiler, machine->nil, dst);
+			break;
+		case SYS_SYM_TRUE:
+			compile_constant(compiler, NULL, dst);
+			break;
+		default:
+			// Numbers, characters and strings evaluate to themselves
+			compile_constant(compiler, atom, dst);
+			break;
+	}
+}
+
+// Compiles the test of an if headed by @type into a jump taken when the test
+// fails. Returns the position of the jump's target.
+static int compile_test(Compiler * compiler, uint8_t type, Cell * test, int dst) {
+
+	Code * code = compiler->code;
+
+	switch(type) {
+		case SYS_FUSED_IF_LT: {
+			int first = alloc_registers(compiler, 2);
+			compile_form(compiler, getCar(getCdr(test)), first, false);
+			compile_form(compiler, getCar(getCdr(getCdr(test))), first + 1, false);
+			compiler->next_register = first;
+
+			emit(code, OP_JUMP_NOT_LESS);
+			emit(code, first);
+			emit(code, first + 1);
+			break;
+		}
+		case SYS_FUSED_IF_NULL: {
+			// One side is null, the other one is tested
+			Cell * operand = getCar(getCdr(test));
+			if(!IS_FIXNUM(operand) && getIsAtom(operand) && getType(operand) == SYS_SYM_NULL) {
+				operand = getCar(getCdr(getCdr(test)));
+			}
+			compile_form(compiler, operand, dst, false);
+
+			emit(code, OP_JUMP_NOT_NIL);
+			emit(code, dst);
+			break;
+		}
+		default:
+			compile_form(compiler, test, dst, false);
+
+			emit(code, OP_JUMP_NIL);
+			emit(code, dst);
+			break;
+	}
+
+	emit(code, 0);
+	return code->length - 1;
+}
+
+static void compile_if(Compiler * compiler, Cell * form, int dst, bool tail) {
+
+	Code * code = compiler->code;
+
+	int else_jump = compile_test(compiler, getType(getCar(form)), getCar(getCdr(form)), dst);
+
+	compile_form(compiler, getCar(getCdr(getCdr(form))), dst, tail);
+
+	emit(code, OP_JUMP);
+	int end_jump = code->length;
+	emit(code, 0);
+
+	code->ops[else_jump] = code->length;
+	compile_form(compiler, getCar(getCdr(getCdr(getCdr(form)))), dst, tail);
+
+	check_operand(code->length);
+	code->ops[end_jump] = code->length;
+}
+
+static void compile_begin(Compiler * compiler, Cell * form, int dst, bool tail) {
+
+	if(getCdr(form) == machine->nil) {
+		compile_constant(compiler, machine->nil, dst);
+		return;
+	}
+
+	for(Cell * body = getCdr(form); body != machine->nil; body = getCdr(body)) {
+		compile_form(compiler, getCar(body), dst, tail && getCdr(body) == machine->nil);
+	}
+}
+
+// Returns the opcode that applies the primitive @type to @count arguments
+// directly, or -1 if it has to go through OP_CALL
+static int primitive_opcode(uint8_t type, int count) {
+
+	switch(type) {
+		case SYS_SYM_CAR:		return count >= 1 ? OP_CAR : -1;
+		case SYS_SYM_CDR:		return count >= 1 ? OP_CDR : -1;
+		case SYS_SYM_ATOM:		return count >= 1 ? OP_ATOM : -1;
+		case SYS_SYM_NOT:		return count >= 1 ? OP_NOT : -1;
+		case SYS_SYM_CONS:		return count >= 2 ? OP_CONS : -1;
+		case SYS_SYM_EQ:		return count >= 2 ? OP_EQ : -1;
+		case SYS_SYM_LESS:		return count >= 2 ? OP_LESS : -1;
+		case SYS_SYM_EQUAL:		return count >= 2 ? OP_EQUAL : -1;
+		case SYS_SYM_GREAT:		return count >= 2 ? OP_GREAT : -1;
+		case SYS_SYM_AND:		return count >= 2 ? OP_AND : -1;
+		case SYS_SYM_OR:		return count >= 2 ? OP_OR : -1;
+		case SYS_SYM_MULT:
+		case SYS_SYM_ADD:		return OP_ARITH;
+		case SYS_SYM_SUB:
+		case SYS_SYM_DIV:
+		case SYS_SYM_MOD:		return count >= 1 ? OP_ARITH : -1;
+		case SYS_SYM_TOUCH:		return count >= 1 ? OP_TOUCH : -1;
+		default:				return -1;
+	}
+}
+
+// Like sys_eval, all the arguments are evaluated before the function. In a
+// @parallel call the arguments after the first are made into futures and
+// touched once the first one has its value.
+static void compile_call(Compiler * compiler, Cell * form, int dst, bool tail, bool parallel) {
+
+	Code * code = compiler->code;
+	Cell * head = getCar(form);
+
+	int count = 0;
+	for(Cell * arg = getCdr(form); arg != machine->nil; arg = getCdr(arg)) {
+		++count;
+	}
+
+	int first = alloc_registers(compiler, count + 1);
+
+	int index = first + 1;
+	for(Cell * arg = getCdr(form); arg != machine->nil; arg = getCdr(arg)) {
+		if(parallel && index > first + 1) {
+			emit(code, OP_FUTURE);
+			emit(code, index);
+			emit(code, add_constant(code, getCar(arg)));
+		}
+		++index;
+	}
+	index = first + 1;
+	for(Cell * arg = getCdr(form); arg != machine->nil; arg = getCdr(arg)) {
+		if(!parallel || index == first + 1) {
+			compile_form(compiler, getCar(arg), index, false);
+		}
+		else {
+			emit(code, OP_TOUCH);
+			emit(code, index);
+			emit(code, index);
+		}
+		++index;
+	}
+
+	int opcode = getIsAtom(head) ? primitive_opcode(getType(head), count) : -1;
+	if(opcode == OP_ARITH) {
+		emit(code, OP_ARITH);
+		emit(code, dst);
+		emit(code, getType(head));
+		emit(code, first + 1);
+		emit(code, count);
+	}
+	else if(opcode != -1) {
+		emit(code, opcode);
+		emit(code, dst);
+		emit(code, first + 1);
+		if(opcode >= OP_CONS && opcode <= OP_OR) {
+			emit(code, first + 2);
+		}
+	}
+	else {
+		// A list in the function position is applied as a lambda without being
+		// evaluated. Primitives are applied as they are.
+		if(!getIsAtom(head) || (getType(head) != SYS_GENERAL && getType(head) != SYS_SYM_LOCAL)) {
+			compile_constant(compiler, head, first);
+		}
+		else {
+			compile_form(compiler, head, first, false);
+		}
+
+		emit(code, tail ? OP_TAIL_CALL : OP_CALL);
+		emit(code, dst);
+		emit(code, first);
+		emit(code, count);
+	}
+
+	compiler->next_register = first;
+}
+
+// Compiles @form so that its value ends up in register @dst
+static void compile_form(Compiler * compiler, Cell * form, int dst, bool tail) {
+
+	if(form == NULL || getIsAtom(form)) {
+		if(form == NULL) {
+			compile_constant(compiler, NULL, dst);
+		}
+		else {
+			compile_atom(compiler, form, dst);
+		}
+		return;
+	}
+
+	switch(getType(getCar(form))) {
+		case SYS_SYM_IF:
+		case SYS_FUSED_IF_LT:
+		case SYS_FUSED_IF_NULL:
+			compile_if(compiler, form, dst, tail);
+			break;
+		case SYS_FUSED_DEC:
+			compile_form(compiler, getCar(getCdr(form)), dst, false);
+			emit(compiler->code, OP_DEC);
+			emit(compiler->code, dst);
+			emit(compiler->code, dst);
+			break;
+		case SYS_SYM_LAMBDA:
+			compile_constant(compiler, form, dst);
+			break;
+		case SYS_SYM_QUOTE:
+			compile_constant(compiler, getCar(getCdr(form)), dst);
+			break;
+		case SYS_SYM_DEFINE:
+			// The value is stored unevaluated, like sys_eval does
+			emit(compiler->code, OP_DEFINE);
+			emit(compiler->code, dst);
+			emit(compiler->code, add_constant(compiler->code, getCar(getCdr(form))));
+			emit(compiler->code, add_constant(compiler->code, getCar(getCdr(getCdr(form)))));
+			break;
+		case SYS_SYM_BEGIN:
+			compile_begin(compiler, form, dst, tail);
+			break;
+		case SYS_SYM_FUTURE:
+			// Without the pool there's no one else to run it, so it runs now
+			if(machine->owner->pool != NULL) {
+				emit(compiler->code, OP_FUTURE);
+				emit(compiler->code, dst);
+				emit(compiler->code, add_constant(compiler->code, getCar(getCdr(form))));
+			}
+			else {
+				compile_form(compiler, getCar(getCdr(form)), dst, tail);
+			}
+			break;
+		case SYS_SYM_PCALL:
+			if(getCdr(form) == machine->nil) {
+				compile_constant(compiler, machine->nil, dst);
+			}
+			else {
+				compile_call(compiler, getCdr(form), dst, tail, machine->owner->pool != NULL);
+			}
+			break;
+		default:
+			compile_call(compiler, form, dst, tail, false);
+			break;
+	}
+}
+
+// Compiles @expr into code that returns its value, keeping the first
+// @parameter_count registers for the arguments
+static Code * compile_code(Cell * expr, int parameter_count) {
+
+	Compiler compiler;
+	compiler.code = make_code();
+	compiler.next_register = 0;
+
+	alloc_registers(&compiler, parameter_count);
+	int dst = alloc_registers(&compiler, 1);
+	compile_form(&compiler, expr, dst, true);
+
+	emit(compiler.code, OP_RETURN);
+	emit(compiler.code, dst);
+
+	return compiler.code;
+}
+
+Code * compile_expression(Cell * expr) {
+	return compile_code(expr, 0);
+}
+
+/***********************************************************
+ *********************** Code Cache ************************
+ ***********************************************************/
+
+void init_code_cache(Code_Cache * cache) {
+	cache->entries = calloc(CODE_CACHE_STARTING_SIZE, sizeof(Code_Entry));
+	cache->count = 0;
+	cache->capacity = CODE_CACHE_STARTING_SIZE;
+}
+
+void destroy_code_cache(Code_Cache * cache) {
+
+	for(int i = 0; i < cache->capacity; ++i) {
+		if(cache->entries[i].lambda != NULL) {
+			free_code(cache->entries[i].code);
+		}
+	}
+
+	free(cache->entries);
+}
+
+static uint32_t hash_lambda(Cell * lambda) {
+	return ((uintptr_t)lambda * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+// Returns the entry for @lambda, or the empty entry where it belongs. The
+// capacity is always a power of two.
+static Code_Entry * find_entry(Code_Entry * entries, int capacity, Cell * lambda) {
+
+	int index = hash_lambda(lambda) & (capacity - 1);
+	while(entries[index].lambda != NULL && entries[index].lambda != lambda) {
+		index = (index + 1) & (capacity - 1);
+	}
+
+	return &entries[index];
+}
+
+static void rehash_code_cache(Code_Cache * cache, int capacity) {
+
+	Code_Entry * entries = calloc(capacity, sizeof(Code_Entry));
+
+	for(int i = 0; i < cache->capacity; ++i) {
+		if(cache->entries[i].lambda != NULL) {
+			*find_entry(entries, capacity, cache->entries[i].lambda) = cache->entries[i];
+		}
+	}
+
+	free(cache->entries);
+	cache->entries = entries;
+	cache->capacity = capacity;
+}
+
+// Returns the code for the body of @lambda, compiling it the first time
+Code * lambda_code(Cell * lambda) {
+
+	Code_Cache * cache = &machine->code_cache;
+	Code_Entry * entry = find_entry(cache->entries, cache->capacity, lambda);
+	if(entry->lambda != NULL) {
+		return entry->code;
+	}
+
+	// Keep the cache at most three quarters full
+	if((cache->count + 1) * 4 > cache->capacity * 3) {
+		rehash_code_cache(cache, cache->capacity * 2);
+		entry = find_entry(cache->entries, cache->capacity, lambda);
+	}
+
+	int parameter_count = 0;
+	for(Cell * param = getCar(getCdr(lambda)); param != machine->nil; param = getCdr(param)) {
+		++parameter_count;
+	}
+
+	entry->lambda = lambda;
+	entry->code = compile_code(getCar(getCdr(getCdr(lambda))), parameter_count);
+	++cache->count;
+
+	return entry->code;
+}
+
+// Called by the collectors once the live cells are known. Drops the code of the
+// lambdas that weren't reached. After a minor collection the surviving young
+// lambdas have been promoted, so their entries follow them to the new cell.
+void sweep_code_cache(Code_Cache * cache, bool is_minor) {
+
+	if(cache->count == 0) {
+		return;
+	}
+
+	for(int i = 0; i < cache->capacity; ++i) {
+		Code_Entry * entry = &cache->entries[i];
+		if(entry->lambda == NULL || (is_minor && !IS_YOUNG(entry->lambda))) {
+			continue;
+		}
+
+		if(!IS_SHARED(entry->lambda) && !getIsMarked(entry->lambda)) {
+			free_code(entry->code);
+			entry->lambda = NULL;
+			--cache->count;
+		}
+		else if(is_minor) {
+			entry->lambda = getCar(entry->lambda);
+		}
+	}
+
+	rehash_code_cache(cache, cache->capacity);
+}
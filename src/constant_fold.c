@@ -0,0 +1,309 @@
+#include "constant_fold.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "expr_parser.h"
+#include <stdbool.h>
+
+// Optional pass run over freshly parsed code with --fold, before the forms are
+// fused. It evaluates ahead of time the forms whose value can't change between
+// runs:
+//
+//	- arithmetic and comparisons on number literals
+//	- car, cdr, atom?, eq?, and, or and not on literals and quoted data
+//	- ifs whose test is a literal, which are replaced by the branch taken
+//
+// The value of a define is bound without being evaluated, so it's left alone
+// unless it's a lambda, whose body is folded.
+//
+// Only primitives without side effects are folded, and cons is left alone since
+// every run has to make a new cell. Anything that would fail at runtime, like
+// dividing by zero, is left for the evaluator to report.
+
+static Cell * fold_form(Cell * form);
+
+static bool is_cons(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && !getIsAtom(cell) && getType(cell) == SYS_GENERAL;
+}
+
+static bool is_number(Cell * cell) {
+	return IS_FIXNUM(cell) || (cell != NULL && cell != machine->nil && getIsAtom(cell) && getType(cell) == SYS_SYM_NUM);
+}
+
+// True if @form is a (lambda ...) form
+static bool is_lambda(Cell * form) {
+	return is_cons(form) && !IS_FIXNUM(getCar(form)) && getIsAtom(getCar(form))
+		&& getType(getCar(form)) == SYS_SYM_LAMBDA;
+}
+
+// Atoms whose value is their own cell
+static bool is_plain_atom(Cell * cell) {
+	return IS_FIXNUM(cell) || cell == machine->nil || (cell != NULL && getIsAtom(cell));
+}
+
+// Counts the cells making up @expr
+static long count_nodes(Cell * expr) {
+
+	if(!is_cons(expr)) {
+		return 1;
+	}
+
+	long count = 0;
+	for(; is_cons(expr); expr = getCdr(expr)) {
+		count += 1 + count_nodes(getCar(expr));
+	}
+
+	return count;
+}
+
+// Sets @value to the value of @form if it's a literal or quoted. Returns false
+// for anything that has to be evaluated.
+static bool constant_value(Cell * form, Cell ** value) {
+
+	if(IS_FIXNUM(form)) {
+		*value = form;
+		return true;
+	}
+	if(form == NULL || form == machine->nil) {
+		return false;
+	}
+
+	if(is_cons(form)) {
+		Cell * head = getCar(form);
+		if(is_plain_atom(head) && !IS_FIXNUM(head) && getType(head) == SYS_SYM_QUOTE && operand_count(form, 1)) {
+			*value = getCar(getCdr(form));
+			return true;
+		}
+		return false;
+	}
+
+	switch(getType(form)) {
+		case SYS_SYM_NUM:
+		case SYS_SYM_CHAR:
+		case SYS_SYM_STRING:
+			*value = form;
+			return true;
+		case SYS_SYM_TRUE:
+			*value = NULL;
+			return true;
+		case SYS_SYM_FALSE:
+		case SYS_SYM_NULL:
+			*value = machine->nil;
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Returns an expression evaluating to @value
+static Cell * literal(Cell * value) {
+
+	if(value == NULL) {
+		return make_symbol("true");
+	}
+	if(value == machine->nil) {
+		return make_symbol("false");
+	}
+	if(is_number(value) || (getIsAtom(value) && (getType(value) == SYS_SYM_CHAR || getType(value) == SYS_SYM_STRING))) {
+		return value;
+	}
+
+	return cons(make_symbol("quote"), cons(value, machine->nil));
+}
+
+// Folds @type over the number literals in @operands the way sys_evarth does
+static bool fold_arith(uint8_t type, Cell * operands, Cell ** value) {
+
+	Cell * operand;
+	for(Cell * rest = operands; rest != machine->nil; rest = getCdr(rest)) {
+		if(!constant_value(getCar(rest), &operand) || !is_number(operand)) {
+			return false;
+		}
+	}
+
+	Cell_Word total;
+	switch(type) {
+		case SYS_SYM_MULT:
+			total = 1;
+			break;
+		case SYS_SYM_ADD:
+			total = 0;
+			break;
+		default:
+			if(operands == machine->nil) {
+				return false;
+			}
+			constant_value(getCar(operands), &operand);
+			total = getNumber(operand);
+			operands = getCdr(operands);
+			break;
+	}
+
+	// Overflowing a whole word wraps around
+	for(; operands != machine->nil; operands = getCdr(operands)) {
+		constant_value(getCar(operands), &operand);
+		Cell_Word number = getNumber(operand);
+		switch(type) {
+			case SYS_SYM_MULT:
+				total = total * number;
+				break;
+			case SYS_SYM_ADD:
+				total = total + number;
+				break;
+			case SYS_SYM_SUB:
+				total = total - number;
+				break;
+			case SYS_SYM_DIV:
+			case SYS_SYM_MOD:
+				if((Cell_Int)number == 0 || (Cell_Int)number == -1) {
+					return false;
+				}
+				if(type == SYS_SYM_DIV) {
+					total = (Cell_Int)total / (Cell_Int)number;
+				}
+				else {
+					total = (Cell_Int)total % (Cell_Int)number;
+				}
+				break;
+		}
+	}
+
+	*value = make_number((Cell_Int)total);
+	return true;
+}
+
+// Applies a fixed arity primitive to literal operands, if its result is known
+static bool fold_primitive(uint8_t type, Cell * form, Cell ** value) {
+
+	int arity = primitive_arity(type);
+	if(arity == 0 || type == SYS_SYM_CONS || !operand_count(form, arity)) {
+		return false;
+	}
+
+	Cell * first;
+	Cell * second = machine->nil;
+	if(!constant_value(getCar(getCdr(form)), &first)
+		|| (arity == 2 && !constant_value(getCar(getCdr(getCdr(form))), &second))) {
+		return false;
+	}
+
+	switch(type) {
+		case SYS_SYM_CAR:
+		case SYS_SYM_CDR:
+			if(!is_cons(first)) {
+				return false;
+			}
+			break;
+		case SYS_SYM_ATOM:
+			if(first == NULL) {
+				return false;
+			}
+			break;
+		case SYS_SYM_EQ:
+			// Quoted lists could be shared by --hash-cons later on
+			if(!is_plain_atom(first) || !is_plain_atom(second)) {
+				return false;
+			}
+			break;
+		case SYS_SYM_LESS:
+		case SYS_SYM_EQUAL:
+		case SYS_SYM_GREAT:
+			if(!is_number(first) || !is_number(second)) {
+				return false;
+			}
+			break;
+	}
+
+	*value = apply_fixed_primitive(type, first, second);
+	return true;
+}
+
+// Returns what @form can be replaced with once its operands are folded
+static Cell * fold_call(Cell * form) {
+
+	Cell * head = getCar(form);
+	if(IS_FIXNUM(head) || !getIsAtom(head)) {
+		return form;
+	}
+
+	uint8_t type = getType(head);
+	Cell * value;
+
+	if(type == SYS_SYM_IF) {
+		if(operand_count(form, 3) && constant_value(getCar(getCdr(form)), &value)) {
+			Cell * branches = getCdr(getCdr(form));
+			return value != machine->nil ? getCar(branches) : getCar(getCdr(branches));
+		}
+		return form;
+	}
+	else if((type >= SYS_SYM_MULT && type <= SYS_SYM_DIV) || type == SYS_SYM_MOD) {
+		if(fold_arith(type, getCdr(form), &value)) {
+			return literal(value);
+		}
+		return form;
+	}
+	else if(fold_primitive(type, form, &value)) {
+		return literal(value);
+	}
+
+	return form;
+}
+
+// Folds each element of the list starting at @list in place
+static void fold_list(Cell * list) {
+
+	for(; is_cons(list); list = getCdr(list)) {
+		Cell * form = getCar(list);
+		Cell * folded = fold_form(form);
+		if(folded != form) {
+			setCar(list, folded);
+			write_barrier(list);
+		}
+	}
+}
+
+static Cell * fold_form(Cell * form) {
+
+	if(!is_cons(form)) {
+		return form;
+	}
+
+	Cell * head = getCar(form);
+	if(!IS_FIXNUM(head) && getIsAtom(head)) {
+		switch(getType(head)) {
+			case SYS_SYM_QUOTE:
+				// Data, not code
+				return form;
+			case SYS_SYM_LAMBDA:
+				// Parameters stay as they are
+				if(is_cons(getCdr(form))) {
+					fold_list(getCdr(getCdr(form)));
+				}
+				return form;
+			case SYS_SYM_DEFINE:
+				// The value is bound as it was written, so only the body of a
+				// lambda is ever evaluated
+				if(is_cons(getCdr(form)) && is_cons(getCdr(getCdr(form)))
+					&& is_lambda(getCar(getCdr(getCdr(form))))) {
+					fold_form(getCar(getCdr(getCdr(form))));
+				}
+				return form;
+		}
+	}
+
+	// The operands are folded first so nested constants fold all the way up
+	fold_list(form);
+
+	Cell * folded = fold_call(form);
+	if(folded != form) {
+		++machine->fold_stats.forms;
+		machine->fold_stats.nodes += count_nodes(form) - count_nodes(folded);
+	}
+
+	return folded;
+}
+
+// Folds the constant forms found anywhere in the code of @expr
+Cell * fold_constants(Cell * expr) {
+	return fold_form(expr);
+}
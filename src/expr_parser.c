@@ -1,5 +1,13 @@
 #include "expr_parser.h"
 #include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "symbol_table.h"
+#include "hash_cons.h"
+#include "tasks.h"
+#include "lexical_address.h"
+#include "fusion.h"
+#include "constant_fold.h"
 #include "repl.h"
 #include "stack.h"
 #include <stdio.h>
@@ -8,8 +16,6 @@
 #include <limits.h>
 #include <stdint.h>
 
-Lisp_Machine * machine;
-
 // @expr_type - Used to tell the make_symbol function what expression we are evaluating (eval, apply, evlis, etc...)
 //					This is important when determining symbol types for system function arguments.
 Cell * make_expression(char *expr) {
@@ -17,70 +23,103 @@ Cell * make_expression(char *expr) {
 	Stack s;
 	MAKE_STACK(s, Cell *);
 
-	Cell root = {NULL, '\0', NULL, false, 0};
-	Cell * cell = &root;
+	// The expression is built in the car of the root cell
+	Cell * root = get_free_cell();
+	Cell * cell = root;
+
+	// Let the garbage collector see the expression while it's being built
+	machine->parse_stack = &s;
+	machine->parse_root = &root;
+	machine->parse_cell = &cell;
 
 	Tokenizer * tk = make_tokenizer(expr);
 	char * token = tokenizer_next(tk);
 	while(token != NULL) {
+		// Between tokens everything we've built is reachable from the root or the stack
+		GC_SAFE_POINT();
+
 		switch(token[0]) {
 			case '(':
 				// Handles the NIL symbol. (Annoyingly reuses almost all the code in the default case. Must fix)
 				if(token[1] == ')') {
-					if(cell->car == NULL) {
-						cell->car = machine->nil;
+					if(getCar(cell) == NULL) {
+						setCar(cell, machine->nil);
 						token = tokenizer_next(tk);
 					}
 					else {
 						POP(s, Cell *, cell);
-						cell->cdr = get_free_cell();
-						PUSH(s, Cell *, cell->cdr);
-						cell = cell->cdr;
+						setCdr(cell, get_free_cell());
+						write_barrier(cell);
+						PUSH(s, Cell *, getCdr(cell));
+						cell = getCdr(cell);
 					}
 				}
 				// Makes a new sub list
-				else if(cell->car == NULL) {
-					cell->car = get_free_cell();
-					PUSH(s, Cell *, cell->car);
-					cell = cell->car;
+				else if(getCar(cell) == NULL) {
+					setCar(cell, get_free_cell());
+					write_barrier(cell);
+					PUSH(s, Cell *, getCar(cell));
+					cell = getCar(cell);
 					token = tokenizer_next(tk);
 				}
 				// Moves along the right of a list to place the sub list
 				else {
 					POP(s, Cell *, cell);
-					cell->cdr = get_free_cell();
-					PUSH(s, Cell *, cell->cdr);
-					cell = cell->cdr;
+					setCdr(cell, get_free_cell());
+					write_barrier(cell);
+					PUSH(s, Cell *, getCdr(cell));
+					cell = getCdr(cell);
 				}
 				break;
 			case ')':
 				POP(s, Cell *, cell);
-				cell->cdr = machine->nil;
+				setCdr(cell, machine->nil);
 				token = tokenizer_next(tk);
 				break;
 			default:
-				if(cell->car == NULL) {
-					cell->car = make_symbol(token);
+				if(getCar(cell) == NULL) {
+					setCar(cell, make_symbol(token));
+					write_barrier(cell);
 					token = tokenizer_next(tk);
 				}
 				else {
 					POP(s, Cell *, cell);
-					cell->cdr = get_free_cell();
-					PUSH(s, Cell *, cell->cdr);
-					cell = cell->cdr;
+					setCdr(cell, get_free_cell());
+					write_barrier(cell);
+					PUSH(s, Cell *, getCdr(cell));
+					cell = getCdr(cell);
 				}
 				break;
 		}
 	}
 
+	machine->parse_stack = NULL;
+	machine->parse_root = NULL;
+	machine->parse_cell = NULL;
+
 	// The stack is not empty so we encountered too few parenthesis
 	if(s.n != 0) {
+		DESTROY_STACK(&s);
+		destroy_tokenizer(tk);
 		return NULL;
 	}
 
+	DESTROY_STACK(&s);
 	destroy_tokenizer(tk);
 
-	return root.car;
+	Cell * result = resolve_locals(getCar(root));
+
+	if(fold_flag) {
+		result = fold_constants(result);
+	}
+
+	result = fuse_forms(result);
+
+	if(hash_cons_flag) {
+		return hash_cons(result);
+	}
+
+	return result;
 }
 
 Tokenizer * make_tokenizer(char * string) {
@@ -190,39 +229,51 @@ Cell * make_symbol(char * name) {
 	Cell * result;
 
 	if(cell_type == SYS_SYM_NUM) {
-		result = make_num(name);
-		result->is_atom = true;
+		// Fixnums are immediates, so there is no cell to set the type on
+		return make_num(name);
 	}
 	else if (cell_type == SYS_SYM_STRING) {
 		result = make_string(name);
-		result->is_atom = true;
+		setIsAtom(result, true);
 	}
 	else if (cell_type == SYS_SYM_CHAR) {
 		result = get_free_cell();
-		result->car = (Cell *)(uintptr_t)(name[1]);
-		result->is_atom = true;
+		setCarData(result, name[1]);
+		setIsAtom(result, true);
 	}
 	else {
-		result = pack_cell_string(name);
-		result->is_atom = true;
+		// Every occurrence of a name shares one chain, typed when it was interned.
+		// Names in the shared code keep the shared chain.
+		if(shared_heap != NULL) {
+			Cell * symbol = find_symbol(&shared_heap->owner->symbol_table, name);
+			if(symbol != NULL) {
+				return symbol;
+			}
+		}
+		lock_interning();
+		Cell * symbol = intern_symbol(&machine->owner->symbol_table, name, cell_type);
+		unlock_interning();
+		return symbol;
 	}
 
-	result->type = cell_type;
+	setType(result, cell_type);
 
 	return result;
 }
 
+// Symbols are interned for good, so they are packed straight into the old generation
 Cell * pack_cell_string(char * string) {
 
-	Cell * result;
-	Cell * prev_cell;
-	Cell * new_cell;
+	Cell * result = NULL;
+	Cell * prev_cell = NULL;
+	Cell * new_cell = NULL;
 	int num_of_cells = (strlen(string) + chars_per_pointer - 1) / chars_per_pointer;
 
 	// Iterate through the chain of cells we will use to store the name
 	for(int cell_index = 0; cell_index < num_of_cells; ++cell_index) {
 
-		new_cell = get_free_cell();
+		new_cell = get_old_cell();
+		setIsAtom(new_cell, true);
 
 		// Do required linking between the cells
 		if(cell_index == 0) {
@@ -230,7 +281,7 @@ Cell * pack_cell_string(char * string) {
 			prev_cell = result;
 		}
 		else {
-			prev_cell->cdr = new_cell;
+			setCdr(prev_cell, new_cell);
 			prev_cell = new_cell;
 		}
 
@@ -240,56 +291,32 @@ Cell * pack_cell_string(char * string) {
 			int index = (cell_index * chars_per_pointer) + i;
 
 			if(index >= strlen(string)) {
-				new_cell->car = (Cell *)((uintptr_t)car(new_cell) << 8);
+				setCarData(new_cell, getCarData(new_cell) << 8);
 				continue;
 			}
 			else {
-				new_cell->car = (Cell *)(((uintptr_t)car(new_cell) << 8) | (uintptr_t)string[index]);
+				setCarData(new_cell, (getCarData(new_cell) << 8) | (Cell_Word)string[index]);
 			}
 		}
 	}
 
-	new_cell->cdr = machine->nil;
+	setCdr(new_cell, machine->nil);
 
 	return result;
 }
 
 // Currently very limited.
-// Doesn't support bignums or check if the number will be larger than a long type
+// Doesn't support bignums or check if the number will be larger than a Cell_Int
 Cell * make_num(char * digits) {
 
-	long num = 0;
+	Cell_Word num = 0;
 
 	for(int i = 0; i < strlen(digits); ++i) {
 		num *= 10;
 		num += digits[i] - '0';
 	}
 
-	int num_of_cells = sizeof(long) / sizeof(Cell *);
-
-	Cell * result;
-	Cell * prev_cell;
-
-	for(int i = 0; i < num_of_cells; ++i) {
-
-		Cell * cell = get_free_cell();
-
-		// Do the linking between cells
-		if(i == 0) {
-			result = cell;
-			prev_cell = result;
-		}
-		else {
-			prev_cell->cdr = cell;
-			prev_cell = cell;
-		}
-
-		// Store more of the number
-		cell->car = (Cell *)(uintptr_t)(num >> (sizeof(long) - (num_of_cells - i) * sizeof(Cell *)));
-		cell->cdr = NULL;
-	}
-
-	return result;
+	return make_number((Cell_Int)num);
 }
 
 Cell * make_string(char * string) {
@@ -304,27 +331,23 @@ Cell * make_string(char * string) {
 	string_cpy[string_length] = '\0';
 
 	// First element is a pointer to the string
-	cell->car = make_symbol(string_cpy);
-	cell->cdr = get_free_cell();
-	cell = cell->cdr;
+	setCar(cell, make_symbol(string_cpy));
+	setCdr(cell, get_free_cell());
+	cell = getCdr(cell);
 
 	// Second is a pointer to the end of the string
 	// Must find that now
-	Cell * temp_cell = result->car;
-	while(temp_cell->cdr != machine->nil) {
-		temp_cell = temp_cell->cdr;
+	Cell * temp_cell = getCar(result);
+	while(getCdr(temp_cell) != machine->nil) {
+		temp_cell = getCdr(temp_cell);
 	}
-	cell->car = temp_cell;
-	cell->cdr = get_free_cell();
-	cell = cell->cdr;
+	setCar(cell, temp_cell);
+	setCdr(cell, get_free_cell());
+	cell = getCdr(cell);
 
 	// Third element holds the length of the string
-	Cell * num = get_free_cell();
-	num->car = (Cell *)(uintptr_t)(string_length);
-	num->type = SYS_SYM_NUM;
-	num->is_atom = false;
-	cell->car = num;
-	cell->cdr = machine->nil;
+	setCar(cell, make_number(string_length));
+	setCdr(cell, machine->nil);
 
 	return result;
 }
@@ -409,6 +432,11 @@ char * get_symbol_name(Cell * sym) {
 
 	char * string;
 
+	// Parameter references and fused heads print as the symbol they stand for
+	if(getType(sym) == SYS_SYM_LOCAL || getType(sym) >= SYS_FUSED_IF_LT) {
+		sym = getCar(sym);
+	}
+
 	// If the symbol is NIL, just return that to be printed
 	if(sym == machine->nil) {
 		string = malloc(sizeof(char) * 3);
@@ -416,20 +444,25 @@ char * get_symbol_name(Cell * sym) {
 		string[1] = ')';
 		string[2] = '\0';
 	}
+	// Futures don't print their value, which might not be there yet
+	else if(getType(sym) == SYS_FUTURE) {
+		string = malloc(sizeof(char) * 7);
+		strcpy(string, "FUTURE");
+	}
 	// The cell might represent a number
-	else if(sym->type == SYS_SYM_NUM) {
+	else if(getType(sym) == SYS_SYM_NUM) {
 		int max_num_length = 30;
 		string = malloc(sizeof(char) * max_num_length + 1);
-		snprintf(string, max_num_length + 1, "%d", (int)(uintptr_t)sym->car);
+		snprintf(string, max_num_length + 1, "%lld", (long long)getNumber(sym));
 	}
 	// It is a string
-	else if(sym->type == SYS_SYM_STRING) {
+	else if(getType(sym) == SYS_SYM_STRING) {
 		// Get the number of cells this name takes up
 		int cell_count = 1;
-		Cell * temp = sym->car;
-		while(temp->cdr != machine->nil) {
+		Cell * temp = getCar(sym);
+		while(getCdr(temp) != machine->nil) {
 			++cell_count;
-			temp = temp->cdr;
+			temp = getCdr(temp);
 		}
 
 		int string_length = chars_per_pointer * cell_count + 2;
@@ -439,10 +472,11 @@ char * get_symbol_name(Cell * sym) {
 		int cell_index = 0;
 
 		// Copy symbol name into the result string
-		sym = sym->car; // Go to the start of the string
+		sym = getCar(sym); // Go to the start of the string
 		while(sym != machine->nil) {
-			memcpy(string + (cell_index * chars_per_pointer) + 1, &sym->car, chars_per_pointer);
-			sym = sym->cdr;
+			Cell_Word chunk = getCarData(sym);
+			memcpy(string + (cell_index * chars_per_pointer) + 1, &chunk, chars_per_pointer);
+			sym = getCdr(sym);
 			++cell_index;
 		}
 
@@ -463,9 +497,9 @@ char * get_symbol_name(Cell * sym) {
 		// Get the number of cells this name takes up
 		int cell_count = 1;
 		Cell * temp = sym;
-		while(temp->cdr != machine->nil) {
+		while(getCdr(temp) != machine->nil) {
 			++cell_count;
-			temp = temp->cdr;
+			temp = getCdr(temp);
 		}
 
 		int string_length = chars_per_pointer * cell_count;
@@ -476,8 +510,9 @@ char * get_symbol_name(Cell * sym) {
 
 		// Copy symbol name into the result string
 		while(sym != machine->nil) {
-			memcpy(string + (cell_index * chars_per_pointer), &sym->car, chars_per_pointer);
-			sym = sym->cdr;
+			Cell_Word chunk = getCarData(sym);
+			memcpy(string + (cell_index * chars_per_pointer), &chunk, chars_per_pointer);
+			sym = getCdr(sym);
 			++cell_index;
 		}
 
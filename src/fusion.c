@@ -0,0 +1,141 @@
+#include "fusion.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include <stdbool.h>
+
+// Pass run over freshly parsed code, after the locals are resolved. It finds the
+// shapes that recursive code spends most of its time in and gives their head a
+// fused type that the evaluators run in one step:
+//
+//	(if (< a b) x y)		SYS_FUSED_IF_LT
+//	(if (eq? a null) x y)	SYS_FUSED_IF_NULL, with null on either side
+//	(- a 1)					SYS_FUSED_DEC
+//
+// Only the head is replaced, by an atom whose car is the symbol it stands for,
+// so fused code keeps its shape and prints as it was written. The operands have
+// to be simple enough to fetch without going through sys_eval.
+
+static void fuse_form(Cell * form);
+
+static bool is_cons(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && !getIsAtom(cell) && getType(cell) == SYS_GENERAL;
+}
+
+// True if @cell is a number, nil, a symbol or a parameter reference
+bool is_simple_operand(Cell * cell) {
+
+	if(cell == NULL) {
+		return false;
+	}
+	if(cell == machine->nil || IS_FIXNUM(cell)) {
+		return true;
+	}
+	if(!getIsAtom(cell)) {
+		return false;
+	}
+
+	uint8_t type = getType(cell);
+	return type == SYS_GENERAL || type == SYS_SYM_LOCAL || type == SYS_SYM_NUM;
+}
+
+static bool is_null(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && getIsAtom(cell) && getType(cell) == SYS_SYM_NULL;
+}
+
+// True if @form is a call to the primitive @type with two operands
+static bool is_binary_call(Cell * form, uint8_t type) {
+	return is_cons(form) && getIsAtom(getCar(form)) && getType(getCar(form)) == type
+		&& operand_count(form, 2);
+}
+
+// Returns the fused type for @form, or SYS_GENERAL if it has none
+static uint8_t fused_type(Cell * form) {
+
+	Cell * head = getCar(form);
+	if(!getIsAtom(head)) {
+		return SYS_GENERAL;
+	}
+
+	if(getType(head) == SYS_SYM_IF && is_cons(getCdr(form))) {
+		Cell * test = getCar(getCdr(form));
+
+		if(is_binary_call(test, SYS_SYM_LESS)
+			&& is_simple_operand(getCar(getCdr(test)))
+			&& is_simple_operand(getCar(getCdr(getCdr(test))))) {
+			return SYS_FUSED_IF_LT;
+		}
+
+		if(is_binary_call(test, SYS_SYM_EQ)) {
+			Cell * first = getCar(getCdr(test));
+			Cell * second = getCar(getCdr(getCdr(test)));
+			if((is_null(first) && is_simple_operand(second))
+				|| (is_null(second) && is_simple_operand(first))) {
+				return SYS_FUSED_IF_NULL;
+			}
+		}
+	}
+	else if(is_binary_call(form, SYS_SYM_SUB)
+		&& is_simple_operand(getCar(getCdr(form)))
+		&& getCar(getCdr(getCdr(form))) == makeFixnum(1)) {
+		return SYS_FUSED_DEC;
+	}
+
+	return SYS_GENERAL;
+}
+
+static void fuse_list(Cell * list) {
+	for(; is_cons(list); list = getCdr(list)) {
+		fuse_form(getCar(list));
+	}
+}
+
+static void fuse_form(Cell * form) {
+
+	if(!is_cons(form)) {
+		return;
+	}
+
+	switch(getType(getCar(form))) {
+		case SYS_SYM_QUOTE:
+			// Data, not code
+			return;
+		case SYS_SYM_LAMBDA:
+			if(is_cons(getCdr(form))) {
+				fuse_list(getCdr(getCdr(form)));
+			}
+			return;
+		case SYS_SYM_DEFINE:
+			// The value is bound as it was written, so only the body of a lambda
+			// is ever run
+			if(is_cons(getCdr(form)) && is_cons(getCdr(getCdr(form)))) {
+				Cell * value = getCar(getCdr(getCdr(form)));
+				if(is_cons(value) && getIsAtom(getCar(value)) && getType(getCar(value)) == SYS_SYM_LAMBDA) {
+					fuse_form(value);
+				}
+			}
+			return;
+	}
+
+	uint8_t type = fused_type(form);
+	if(type != SYS_GENERAL) {
+		Cell * head = get_free_cell();
+		setIsAtom(head, true);
+		setType(head, type);
+		setCar(head, getCar(form));
+		setCdr(head, machine->nil);
+
+		setCar(form, head);
+		write_barrier(form);
+		++machine->fusion_stats[FUSED_INDEX(type)].forms;
+	}
+
+	// The head can be a lambda to fuse too
+	fuse_list(form);
+}
+
+// Fuses the hot shapes found anywhere in the code of @expr
+Cell * fuse_forms(Cell * expr) {
+	fuse_form(expr);
+	return expr;
+}
@@ -0,0 +1,424 @@
+#include "garbage_collector.h"
+#include "hash_cons.h"
+#include "bytecode.h"
+#include "lisp_machine.h"
+#include "memory_sys.h"
+#include "repl.h"
+#include "stack.h"
+#include "tasks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The machines sharing the heap, which is just the current one without a pool
+static int machine_count() {
+	Task_Pool * pool = machine->owner->pool;
+	return pool != NULL ? pool->machine_count : 1;
+}
+
+static Lisp_Machine * get_machine(int index) {
+	Task_Pool * pool = machine->owner->pool;
+	return pool != NULL ? pool->machines[index] : machine;
+}
+
+// Generational collector for the cell heap. New cells are bump allocated in the
+// nursery, and a minor collection copies the survivors into the old generation.
+// The old generation is managed by a mark and sweep collector. Collections only
+// happen at safe points (see GC_SAFE_POINT) so the roots are exactly the machine
+// registers, the system stack, the symbol table, the global environment, the
+// shallow binding values, the bytecode machine's registers, frames and constants
+// and the parser's partially built expression.
+//
+// With --threads every machine of the pool allocates in one heap, so they are
+// all stopped and collected together. Their roots are found the same way.
+void collect_garbage() {
+
+	Lisp_Machine * heap = machine->owner;
+	if(heap->pool != NULL && !stop_machines()) {
+		return;
+	}
+
+	// Make sure the old generation can take everything in the nurseries
+	int young_cells = 0;
+	for(int i = 0; i < machine_count(); ++i) {
+		Lisp_Machine * m = get_machine(i);
+		young_cells += m->nursery_top - m->nursery;
+	}
+	if(heap->mem_free < young_cells) {
+		major_collection();
+
+		// Grow the heap if it's still mostly full rather than collecting again right away
+		while(heap->mem_free < heap->heap_committed / 2 && grow_heap(HEAP_CHUNK_CELLS));
+	}
+
+	minor_collection();
+
+	if(heap->pool != NULL) {
+		start_machines();
+	}
+}
+
+
+/***********************************************************
+ ********************* Minor Collection ********************
+ ***********************************************************/
+
+// Copies every live nursery cell into the old generation and empties the nursery.
+// Live cells are the ones reachable from the roots or from an old cell in the
+// remembered set. Everything that survives is promoted.
+void minor_collection() {
+
+	Lisp_Machine * heap = machine->owner;
+	int used_before = heap->mem_used;
+
+	Stack scan_stack;
+	MAKE_STACK(scan_stack, Cell *);
+
+	Cell * cell;
+	for(int m = 0; m < machine_count(); ++m) {
+		Lisp_Machine * roots = get_machine(m);
+
+		// Forward the roots
+		Stack_Frame * frames = roots->sys_stack.data;
+		for(int i = 0; i < roots->sys_stack.n; ++i) {
+			for(int j = 0; j < frames[i].arg_count; ++j) {
+				frames[i].args[j] = forward_cell(&scan_stack, frames[i].args[j]);
+			}
+		}
+		roots->result = forward_cell(&scan_stack, roots->result);
+		for(int i = 0; i < 4; ++i) {
+			roots->args[i] = forward_cell(&scan_stack, roots->args[i]);
+		}
+
+		forward_values(&scan_stack, roots);
+		forward_vm(&scan_stack, roots);
+
+		if(roots->parse_stack != NULL) {
+			*roots->parse_root = forward_cell(&scan_stack, *roots->parse_root);
+			*roots->parse_cell = forward_cell(&scan_stack, *roots->parse_cell);
+			for(int i = 0; i < roots->parse_stack->n; ++i) {
+				Cell ** slot = &((Cell **)roots->parse_stack->data)[i];
+				*slot = forward_cell(&scan_stack, *slot);
+			}
+		}
+
+		// Old cells that were written to since the last collection might be the
+		// only thing keeping a young cell alive
+		while(roots->remembered_set.n != 0) {
+			POP(roots->remembered_set, Cell *, cell);
+			setIsRemembered(cell, false);
+
+			if(car_is_reference(cell)) {
+				setCar(cell, forward_cell(&scan_stack, getCar(cell)));
+			}
+			setCdr(cell, forward_cell(&scan_stack, getCdr(cell)));
+		}
+	}
+
+	// Fix up the references held by the cells we just promoted
+	while(scan_stack.n != 0) {
+		POP(scan_stack, Cell *, cell);
+
+		if(car_is_reference(cell)) {
+			setCar(cell, forward_cell(&scan_stack, getCar(cell)));
+		}
+		setCdr(cell, forward_cell(&scan_stack, getCdr(cell)));
+	}
+
+	// Follow the compiled lambdas that were promoted
+	for(int m = 0; m < machine_count(); ++m) {
+		Lisp_Machine * roots = get_machine(m);
+		sweep_code_cache(&roots->code_cache, true);
+		roots->nursery_top = roots->nursery;
+	}
+
+	DESTROY_STACK(&scan_stack);
+
+	++heap->minor_gc_count;
+
+	if(verbose_flag) {
+		fprintf(machine->out, " => Minor collection promoted %d cells\n", heap->mem_used - used_before);
+	}
+}
+
+// Forwards the values held by the global environment, the shallow binding slots
+// and the binding stack of @roots
+void forward_values(Stack * scan_stack, Lisp_Machine * roots) {
+
+	Value_Table * tables[] = {&roots->global_env, &roots->value_table};
+	for(int t = 0; t < 2; ++t) {
+		for(int i = 0; i < tables[t]->capacity; ++i) {
+			if(tables[t]->slots[i].symbol != NULL) {
+				tables[t]->slots[i].value = forward_cell(scan_stack, tables[t]->slots[i].value);
+			}
+		}
+	}
+
+	Value_Slot * saved = roots->binding_stack.data;
+	for(int i = 0; i < roots->binding_stack.n; ++i) {
+		saved[i].value = forward_cell(scan_stack, saved[i].value);
+	}
+}
+
+// Forwards the bytecode machine's registers and frames and the constants of
+// all the code compiled by @roots
+void forward_vm(Stack * scan_stack, Lisp_Machine * roots) {
+
+	Cell ** registers = roots->vm_registers.data;
+	for(int i = 0; i < roots->vm_registers.n; ++i) {
+		registers[i] = forward_cell(scan_stack, registers[i]);
+	}
+
+	VM_Frame * frames = roots->vm_frames.data;
+	for(int i = 0; i < roots->vm_frames.n; ++i) {
+		frames[i].env = forward_cell(scan_stack, frames[i].env);
+		frames[i].lambda = forward_cell(scan_stack, frames[i].lambda);
+		forward_constants(scan_stack, frames[i].code);
+	}
+
+	Code_Cache * cache = &roots->code_cache;
+	for(int i = 0; i < cache->capacity; ++i) {
+		if(cache->entries[i].lambda != NULL) {
+			forward_constants(scan_stack, cache->entries[i].code);
+		}
+	}
+}
+
+void forward_constants(Stack * scan_stack, Code * code) {
+	for(int i = 0; i < code->constant_count; ++i) {
+		code->constants[i] = forward_cell(scan_stack, code->constants[i]);
+	}
+}
+
+// Returns where the given cell lives after the minor collection, copying it
+// into the old generation the first time it's seen. A copied nursery cell is
+// marked and its car holds the forwarding address.
+Cell * forward_cell(Stack * scan_stack, Cell * cell) {
+
+	if(cell == NULL || IS_FIXNUM(cell) || !IS_YOUNG(cell)) {
+		return cell;
+	}
+
+	if(getIsMarked(cell)) {
+		return getCar(cell);
+	}
+
+	Cell * copy = get_old_cell();
+	copyCell(copy, cell);
+
+	setIsMarked(cell, true);
+	setCar(cell, copy);
+
+	PUSH((*scan_stack), Cell *, copy);
+
+	return copy;
+}
+
+// Must be called after storing a reference into an already existing cell. Old
+// cells that might point into the nursery are remembered so the next minor
+// collection treats them as roots.
+void write_barrier(Cell * cell) {
+
+	if(IS_OLD(cell) && !getIsRemembered(cell)) {
+		setIsRemembered(cell, true);
+		PUSH(machine->remembered_set, Cell *, cell);
+	}
+}
+
+/***********************************************************
+ ********************* Major Collection ********************
+ ***********************************************************/
+
+// Precise mark and sweep of the old generation. Marking goes through the
+// nursery as well since young cells can keep old ones alive.
+void major_collection() {
+
+	Lisp_Machine * heap = machine->owner;
+	int used_before = heap->mem_used;
+
+	Stack mark_stack;
+	MAKE_STACK(mark_stack, Cell *);
+
+	// Mark everything reachable from the roots
+	mark_cell(&mark_stack, machine->nil);
+
+	// Interned symbols are never freed
+	Symbol_Table * symbol_table = &heap->symbol_table;
+	for(int i = 0; i < symbol_table->capacity; ++i) {
+		if(symbol_table->entries[i].name != NULL) {
+			mark_cell(&mark_stack, symbol_table->entries[i].symbol);
+		}
+	}
+	for(int m = 0; m < machine_count(); ++m) {
+		Lisp_Machine * roots = get_machine(m);
+
+		Stack_Frame * frames = roots->sys_stack.data;
+		for(int i = 0; i < roots->sys_stack.n; ++i) {
+			for(int j = 0; j < frames[i].arg_count; ++j) {
+				mark_cell(&mark_stack, frames[i].args[j]);
+			}
+		}
+		mark_cell(&mark_stack, roots->result);
+		for(int i = 0; i < 4; ++i) {
+			mark_cell(&mark_stack, roots->args[i]);
+		}
+
+		mark_values(&mark_stack, roots);
+		mark_vm(&mark_stack, roots);
+
+		if(roots->parse_stack != NULL) {
+			mark_cell(&mark_stack, *roots->parse_root);
+			for(int i = 0; i < roots->parse_stack->n; ++i) {
+				mark_cell(&mark_stack, ((Cell **)roots->parse_stack->data)[i]);
+			}
+		}
+
+		// Futures being run and ones still waiting in the deque
+		for(int i = 0; i < roots->futures.n; ++i) {
+			mark_cell(&mark_stack, ((Cell **)roots->futures.data)[i]);
+		}
+		if(roots->deque != NULL) {
+			for(int i = roots->deque->head; i < roots->deque->tail; ++i) {
+				mark_cell(&mark_stack, roots->deque->futures[i]);
+			}
+		}
+	}
+
+	DESTROY_STACK(&mark_stack);
+
+	// The shared code table doesn't keep its cells alive
+	sweep_cons_table(&heap->cons_table);
+
+	for(int m = 0; m < machine_count(); ++m) {
+		Lisp_Machine * roots = get_machine(m);
+		sweep_code_cache(&roots->code_cache, false);
+
+		// Forget the remembered cells that are about to be freed
+		Stack * remembered_set = &roots->remembered_set;
+		int kept = 0;
+		for(int i = 0; i < remembered_set->n; ++i) {
+			Cell * cell = ((Cell **)remembered_set->data)[i];
+			if(getIsMarked(cell)) {
+				((Cell **)remembered_set->data)[kept] = cell;
+				++kept;
+			}
+			else {
+				setIsRemembered(cell, false);
+			}
+		}
+		remembered_set->n = kept;
+	}
+
+	// Sweep the unmarked cells back onto the free list. Going backwards leaves
+	// the free list in address order.
+	heap->free_mem = NULL;
+	heap->mem_used = heap->heap_top;
+	heap->mem_free = heap->heap_committed - heap->heap_top;
+	for(int i = heap->heap_top - 1; i >= 0; --i) {
+		Cell * cell = &heap->memory_block[i];
+		if(getIsMarked(cell)) {
+			setIsMarked(cell, false);
+		}
+		else {
+			store_cell(cell);
+		}
+	}
+
+	// The minor collection uses the mark to spot forwarded cells
+	for(int m = 0; m < machine_count(); ++m) {
+		Lisp_Machine * roots = get_machine(m);
+		for(Cell * cell = roots->nursery; cell < roots->nursery_top; ++cell) {
+			setIsMarked(cell, false);
+		}
+	}
+
+	++heap->gc_count;
+
+	if(verbose_flag) {
+		fprintf(machine->out, " => Garbage collection reclaimed %d cells\n", used_before - heap->mem_used);
+	}
+}
+
+// Marks the values held by the global environment, the shallow binding slots
+// and the binding stack of @roots
+void mark_values(Stack * mark_stack, Lisp_Machine * roots) {
+
+	Value_Table * tables[] = {&roots->global_env, &roots->value_table};
+	for(int t = 0; t < 2; ++t) {
+		for(int i = 0; i < tables[t]->capacity; ++i) {
+			if(tables[t]->slots[i].symbol != NULL) {
+				mark_cell(mark_stack, tables[t]->slots[i].value);
+			}
+		}
+	}
+
+	Value_Slot * saved = roots->binding_stack.data;
+	for(int i = 0; i < roots->binding_stack.n; ++i) {
+		mark_cell(mark_stack, saved[i].value);
+	}
+}
+
+// Marks the bytecode machine's registers and frames and the constants of all
+// the code compiled by @roots
+void mark_vm(Stack * mark_stack, Lisp_Machine * roots) {
+
+	Cell ** registers = roots->vm_registers.data;
+	for(int i = 0; i < roots->vm_registers.n; ++i) {
+		mark_cell(mark_stack, registers[i]);
+	}
+
+	VM_Frame * frames = roots->vm_frames.data;
+	for(int i = 0; i < roots->vm_frames.n; ++i) {
+		mark_cell(mark_stack, frames[i].env);
+		mark_cell(mark_stack, frames[i].lambda);
+		mark_constants(mark_stack, frames[i].code);
+	}
+
+	Code_Cache * cache = &roots->code_cache;
+	for(int i = 0; i < cache->capacity; ++i) {
+		if(cache->entries[i].lambda != NULL) {
+			mark_constants(mark_stack, cache->entries[i].code);
+		}
+	}
+}
+
+void mark_constants(Stack * mark_stack, Code * code) {
+	for(int i = 0; i < code->constant_count; ++i) {
+		mark_cell(mark_stack, code->constants[i]);
+	}
+}
+
+// Marks the given cell and everything reachable from it. Uses an explicit stack
+// instead of recursion since lists can be thousands of cells long.
+void mark_cell(Stack * mark_stack, Cell * cell) {
+
+	PUSH((*mark_stack), Cell *, cell);
+
+	while(mark_stack->n != 0) {
+		POP((*mark_stack), Cell *, cell);
+
+		// Walk down the cdr chain, saving the cars for later
+		while(cell != NULL && !IS_FIXNUM(cell) && !IS_SHARED(cell) && !getIsMarked(cell)) {
+			setIsMarked(cell, true);
+
+			if(car_is_reference(cell) && getCar(cell) != NULL) {
+				PUSH((*mark_stack), Cell *, getCar(cell));
+			}
+
+			cell = getCdr(cell);
+		}
+	}
+}
+
+// Not every car holds a pointer. Symbols pack their name into the car, numbers and
+// characters hold their value and return records hold the calling function.
+// The cdr is always either a cell or NULL.
+bool car_is_reference(Cell * cell) {
+
+	uint8_t type = getType(cell);
+	if(type == SYS_SYM_STRING || type == SYS_SYM_LOCAL || type >= SYS_ENV_FRAME) {
+		return true;
+	}
+
+	return !getIsAtom(cell) && type == SYS_GENERAL;
+}
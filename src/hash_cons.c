@@ -0,0 +1,215 @@
+#include "hash_cons.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "stack.h"
+#include "tasks.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Hash consing of parsed code. Structurally equal subtrees are replaced by one
+// shared cons cell, found through a table keyed on the type, car and cdr. Parsed
+// code is never mutated so sharing it is safe. Only subtrees made entirely of
+// nil, fixnums, interned symbols and other shared cells are shared. Those never
+// move, so the table can hash their addresses. Parameter references and fused
+// heads are made fresh by the passes that run first, so they are replaced by a
+// shared copy from the same table before the code holding them is shared. The
+// shared cells live in the old generation and the table holds them weakly: a
+// major collection drops the entries it didn't mark.
+
+void init_cons_table(Cons_Table * table) {
+	table->cells = calloc(CONS_TABLE_STARTING_SIZE, sizeof(Cell *));
+	table->count = 0;
+	table->capacity = CONS_TABLE_STARTING_SIZE;
+}
+
+void destroy_cons_table(Cons_Table * table) {
+	free(table->cells);
+}
+
+static uint32_t hash_pair(uint8_t type, Cell * car, Cell * cdr) {
+
+	uint64_t hash = ((uintptr_t)car + type) * 0x9E3779B97F4A7C15ull;
+	hash ^= (uintptr_t)cdr + 0x7F4A7C15ull + (hash << 6) + (hash >> 2);
+	hash *= 0x9E3779B97F4A7C15ull;
+
+	return hash >> 32;
+}
+
+// Returns the slot holding the cell of @type for (car . cdr), or the empty slot
+// where it belongs. The capacity is always a power of two.
+static Cell ** find_slot(Cell ** cells, int capacity, uint8_t type, Cell * car, Cell * cdr) {
+
+	int index = hash_pair(type, car, cdr) & (capacity - 1);
+	while(cells[index] != NULL && (getType(cells[index]) != type
+		|| getCar(cells[index]) != car || getCdr(cells[index]) != cdr)) {
+		index = (index + 1) & (capacity - 1);
+	}
+
+	return &cells[index];
+}
+
+// Rebuilds the table at the given capacity, keeping only the cells @keep accepts
+static void rehash_cons_table(Cons_Table * table, int capacity, bool (*keep)(Cell *)) {
+
+	Cell ** cells = calloc(capacity, sizeof(Cell *));
+	int count = 0;
+
+	for(int i = 0; i < table->capacity; ++i) {
+		Cell * cell = table->cells[i];
+		if(cell != NULL && keep(cell)) {
+			*find_slot(cells, capacity, getType(cell), getCar(cell), getCdr(cell)) = cell;
+			++count;
+		}
+	}
+
+	free(table->cells);
+	table->cells = cells;
+	table->count = count;
+	table->capacity = capacity;
+}
+
+static bool keep_all(Cell * cell) {
+	return true;
+}
+
+static bool keep_marked(Cell * cell) {
+	return getIsMarked(cell);
+}
+
+// Must be called by a major collection after marking and before sweeping
+void sweep_cons_table(Cons_Table * table) {
+	if(table->count != 0) {
+		rehash_cons_table(table, table->capacity, keep_marked);
+	}
+}
+
+// Returns the shared cell of @type for (car . cdr), creating it if needed. Only
+// cons cells have the general type, every other type makes an atom.
+static Cell * shared_cell(Cons_Table * table, uint8_t type, Cell * car, Cell * cdr) {
+
+	Cell ** slot = find_slot(table->cells, table->capacity, type, car, cdr);
+	if(*slot != NULL) {
+		return *slot;
+	}
+
+	// Keep the table at most three quarters full
+	if((table->count + 1) * 4 > table->capacity * 3) {
+		rehash_cons_table(table, table->capacity * 2, keep_all);
+		slot = find_slot(table->cells, table->capacity, type, car, cdr);
+	}
+
+	Cell * cell = get_old_cell();
+	if(type != SYS_GENERAL) {
+		setIsAtom(cell, true);
+		setType(cell, type);
+	}
+	setCar(cell, car);
+	setCdr(cell, cdr);
+
+	*slot = cell;
+	++table->count;
+
+	return cell;
+}
+
+static bool is_cons(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && !getIsAtom(cell) && getType(cell) == SYS_GENERAL;
+}
+
+// Leaves that can be shared as they are. Only symbols are interned. Strings,
+// characters and boxed numbers are fresh cells for every occurrence, so anything
+// holding them stays unshared.
+static bool is_shareable_atom(Cell * cell) {
+
+	if(cell == machine->nil || IS_FIXNUM(cell)) {
+		return true;
+	}
+
+	return getIsAtom(cell) && getType(cell) < SYS_SYM_NUM;
+}
+
+static Cell * share_expression(Cell * expr, bool * is_shared);
+
+// Returns the shared copy of a parameter reference or fused head. A reference's
+// (params . index) pair is shared first, so references to the same parameter
+// of equal lambdas become one cell, whose parameter list is the one the shared
+// lambdas have.
+static Cell * share_atom(Cell * atom, bool * is_shared) {
+
+	uint8_t type = getType(atom);
+	Cell * cdr = getCdr(atom);
+	if(type == SYS_SYM_LOCAL) {
+		cdr = share_expression(cdr, is_shared);
+		if(!*is_shared) {
+			setCdr(atom, cdr);
+			write_barrier(atom);
+			return atom;
+		}
+	}
+
+	*is_shared = true;
+	return shared_cell(&machine->owner->cons_table, type, getCar(atom), cdr);
+}
+
+static Cell * share_expression(Cell * expr, bool * is_shared) {
+
+	if(!is_cons(expr)) {
+		if(expr != NULL && !IS_FIXNUM(expr) && expr != machine->nil && getIsAtom(expr)
+			&& (getType(expr) == SYS_SYM_LOCAL || getType(expr) >= SYS_FUSED_IF_LT)) {
+			return share_atom(expr, is_shared);
+		}
+		*is_shared = is_shareable_atom(expr);
+		return expr;
+	}
+
+	// Lists can be long, so only recurse into the cars and walk the spine
+	// from its end back to the front
+	Stack spine;
+	MAKE_STACK(spine, Cell *);
+
+	Cell * tail = expr;
+	while(is_cons(tail)) {
+		PUSH(spine, Cell *, tail);
+		tail = getCdr(tail);
+	}
+
+	bool tail_is_shared;
+	tail = share_expression(tail, &tail_is_shared);
+
+	Cell * cell;
+	while(spine.n != 0) {
+		POP(spine, Cell *, cell);
+
+		bool car_is_shared;
+		Cell * car = share_expression(getCar(cell), &car_is_shared);
+
+		if(car_is_shared && tail_is_shared) {
+			tail = shared_cell(&machine->owner->cons_table, SYS_GENERAL, car, tail);
+		}
+		else {
+			setCar(cell, car);
+			setCdr(cell, tail);
+			write_barrier(cell);
+			tail = cell;
+			tail_is_shared = false;
+		}
+	}
+
+	DESTROY_STACK(&spine);
+
+	*is_shared = tail_is_shared;
+	return tail;
+}
+
+// Replaces every shareable subtree of @expr with its shared copy
+Cell * hash_cons(Cell * expr) {
+
+	bool is_shared;
+	lock_interning();
+	Cell * shared = share_expression(expr, &is_shared);
+	unlock_interning();
+
+	return shared;
+}
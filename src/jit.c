@@ -0,0 +1,575 @@
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include "vm.h"
+#include "bytecode.h"
+#include "lisp_machine.h"
+#include "memory_sys.h"
+#include "shallow_binding.h"
+#include "repl.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Baseline compiler from the VM's bytecode to x86-64 machine code, used by
+// --engine=jit. vm.c counts the calls to each lambda's code and hands it over
+// here once it gets hot. The machine code works on the same registers and
+// constants as the bytecode and keeps nothing of its own between instructions,
+// so it can stop at any instruction and the VM carries on from there.
+//
+// Every instruction that stays inside the frame is compiled: constants, lookups,
+// jumps, the primitives and arithmetic, with fixnums handled inline and anything
+// else passed to the runtime's own functions. Calls, returns and defines change
+// the frames or the environment, so the machine code returns their pc and the
+// VM runs them. No garbage is collected while machine code runs because the VM
+// only collects on calls and returns.
+//
+// Compiled code is a function taking the frame's registers, the code's constants
+// and the pc to start from. It jumps through a table to the machine code of
+// that instruction, so the VM can resume it after a call the same way it
+// resumes bytecode.
+
+#define FRAME() (&((VM_Frame *)machine->vm_frames.data)[machine->vm_frames.n - 1])
+
+#if defined(__x86_64__)
+
+// Machine registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3	// The frame's registers
+#define RSI 6
+#define RDI 7
+#define R12 12	// The code's constants
+#define R13 13	// machine->nil
+
+// Condition codes
+#define CC_O	0x0
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_GE	0xD
+#define CC_LE	0xE
+
+#define ASSEMBLER_STARTING_SIZE 256
+
+// A jump to the machine code of the instruction at @pc, patched once all of
+// them have been assembled
+typedef struct fixup_t {
+	int at;
+	int pc;
+} Fixup;
+
+typedef struct assembler_t {
+	uint8_t * bytes;
+	int length;
+	int capacity;
+	int * offsets;		// Where the machine code of each instruction starts, by pc
+	Fixup * fixups;
+	int fixup_count;
+	int fixup_capacity;
+} Assembler;
+
+/***********************************************************
+ ************************ Encoding *************************
+ ***********************************************************/
+
+static void emit_byte(Assembler * a, uint8_t byte) {
+
+	if(a->length == a->capacity) {
+		a->capacity *= 2;
+		a->bytes = realloc(a->bytes, a->capacity);
+	}
+
+	a->bytes[a->length] = byte;
+	++a->length;
+}
+
+static void emit_bytes(Assembler * a, int count, ...) {
+
+	va_list bytes;
+	va_start(bytes, count);
+	for(int i = 0; i < count; ++i) {
+		emit_byte(a, va_arg(bytes, int));
+	}
+	va_end(bytes);
+}
+
+static void emit_u32(Assembler * a, uint32_t value) {
+	for(int i = 0; i < 4; ++i) {
+		emit_byte(a, (value >> (i * 8)) & 0xFF);
+	}
+}
+
+static void emit_u64(Assembler * a, uint64_t value) {
+	for(int i = 0; i < 8; ++i) {
+		emit_byte(a, (value >> (i * 8)) & 0xFF);
+	}
+}
+
+static void patch_u32(Assembler * a, int at, uint32_t value) {
+	for(int i = 0; i < 4; ++i) {
+		a->bytes[at + i] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+// mov reg, [base + disp32] or mov [base + disp32], reg, with @base either rbx
+// or r12. Only the first eight registers can be loaded or stored.
+static void emit_memory(Assembler * a, uint8_t opcode, int reg, int base, int index) {
+
+	if(base == R12) {
+		emit_bytes(a, 4, 0x49, opcode, 0x80 | (reg << 3) | 4, 0x24);
+	}
+	else {
+		emit_bytes(a, 3, 0x48, opcode, 0x80 | (reg << 3) | base);
+	}
+	emit_u32(a, index * sizeof(Cell *));
+}
+
+// reg = regs[index]
+static void load(Assembler * a, int reg, int index) {
+	emit_memory(a, 0x8B, reg, RBX, index);
+}
+
+// regs[index] = reg
+static void store(Assembler * a, int index, int reg) {
+	emit_memory(a, 0x89, reg, RBX, index);
+}
+
+// reg = constants[index]
+static void load_constant(Assembler * a, int reg, int index) {
+	emit_memory(a, 0x8B, reg, R12, index);
+}
+
+// reg = &regs[index]
+static void load_address(Assembler * a, int reg, int index) {
+	emit_memory(a, 0x8D, reg, RBX, index);
+}
+
+static void move_immediate(Assembler * a, int reg, uint64_t value) {
+	emit_bytes(a, 2, 0x48, 0xB8 + reg);
+	emit_u64(a, value);
+}
+
+// mov reg32, imm32
+static void move_int(Assembler * a, int reg, uint32_t value) {
+	emit_byte(a, 0xB8 + reg);
+	emit_u32(a, value);
+}
+
+// Calls a C function. The arguments go in rdi, rsi, rdx and rcx.
+static void call_function(Assembler * a, uint64_t function) {
+	move_immediate(a, RAX, function);
+	emit_bytes(a, 2, 0xFF, 0xD0);
+}
+
+// Adds one to the counter at @address
+static void count(Assembler * a, long * address) {
+	move_immediate(a, RAX, (uint64_t)(uintptr_t)address);
+	emit_bytes(a, 3, 0x48, 0xFF, 0x00);
+}
+
+// Jumps if @cc holds to a place given later to land()
+static int jump_forward(Assembler * a, int cc) {
+
+	if(cc < 0) {
+		emit_byte(a, 0xE9);
+	}
+	else {
+		emit_bytes(a, 2, 0x0F, 0x80 | cc);
+	}
+	emit_u32(a, 0);
+
+	return a->length - 4;
+}
+
+static void land(Assembler * a, int at) {
+	patch_u32(a, at, a->length - (at + 4));
+}
+
+// Jumps if @cc holds, or always if it's negative, to the instruction at @pc
+static void jump_to(Assembler * a, int cc, int pc) {
+
+	if(a->fixup_count == a->fixup_capacity) {
+		a->fixup_capacity *= 2;
+		a->fixups = realloc(a->fixups, sizeof(Fixup) * a->fixup_capacity);
+	}
+
+	Fixup fixup;
+	fixup.at = jump_forward(a, cc);
+	fixup.pc = pc;
+	a->fixups[a->fixup_count] = fixup;
+	++a->fixup_count;
+}
+
+// Returns @pc to the VM through the epilogue at the start of the code
+static void exit_to_vm(Assembler * a, int pc) {
+	move_int(a, RAX, pc);
+	emit_byte(a, 0xE9);
+	emit_u32(a, -(a->length + 4));
+}
+
+// Jumps to a place given to land() unless both rax and rcx hold fixnums. Uses rdx.
+static int check_fixnums(Assembler * a) {
+	emit_bytes(a, 2, 0x89, 0xC2);			// mov edx, eax
+	emit_bytes(a, 2, 0x21, 0xCA);			// and edx, ecx
+	emit_bytes(a, 3, 0xF6, 0xC2, 0x01);		// test dl, 1
+	return jump_forward(a, CC_E);
+}
+
+// Jumps to a place given to land() unless the fixnum in rax is in range. Only the 32 bit cell layouts have
+// fixnums smaller than a register.
+static int check_range(Assembler * a) {
+#if defined(COMPACT_CELLS) || defined(SOA_CELLS)
+	emit_bytes(a, 3, 0x48, 0x63, 0xC8);		// movsxd rcx, eax
+	emit_bytes(a, 3, 0x48, 0x39, 0xC1);		// cmp rcx, rax
+	return jump_forward(a, CC_NE);
+#else
+	return -1;
+#endif
+}
+
+/***********************************************************
+ ************************ Runtime **************************
+ ***********************************************************/
+
+// The machine code calls back into these for everything it doesn't do inline
+
+static bool native_lookup(Cell * symbol, Cell ** value) {
+	return lookup_symbol(symbol, FRAME()->env, value);
+}
+
+static bool native_local(Cell * local, Cell ** value) {
+	return local_value(local, FRAME()->env, value);
+}
+
+static bool native_less(Cell * first, Cell * second) {
+	return getNumber(first) < getNumber(second);
+}
+
+static Cell * native_dec(Cell * value) {
+	return make_number((Cell_Int)((Cell_Word)getNumber(value) - 1));
+}
+
+/***********************************************************
+ ************************ Compiler *************************
+ ***********************************************************/
+
+static uint8_t primitive_type(uint16_t op) {
+
+	switch(op) {
+		case OP_CAR: return SYS_SYM_CAR;
+		case OP_CDR: return SYS_SYM_CDR;
+		case OP_ATOM: return SYS_SYM_ATOM;
+		case OP_NOT: return SYS_SYM_NOT;
+		case OP_CONS: return SYS_SYM_CONS;
+		case OP_EQ: return SYS_SYM_EQ;
+		case OP_LESS: return SYS_SYM_LESS;
+		case OP_EQUAL: return SYS_SYM_EQUAL;
+		case OP_GREAT: return SYS_SYM_GREAT;
+		case OP_AND: return SYS_SYM_AND;
+		default: return SYS_SYM_OR;
+	}
+}
+
+// regs[dst] = apply_fixed_primitive(type, regs[first], regs[second])
+static void compile_primitive(Assembler * a, uint8_t type, int dst, int first, int second) {
+	move_int(a, RDI, type);
+	load(a, RSI, first);
+	load(a, RDX, second);
+	call_function(a, (uint64_t)(uintptr_t)apply_fixed_primitive);
+	store(a, dst, RAX);
+}
+
+// Compares two fixnums inline. Tagging keeps their order.
+static void compile_compare(Assembler * a, uint16_t op, int dst, int first, int second) {
+
+	load(a, RAX, first);
+	load(a, RCX, second);
+	int slow = check_fixnums(a);
+
+	// The result is nil when the comparison fails
+	uint8_t cc = op == OP_LESS ? CC_GE : op == OP_GREAT ? CC_LE : CC_NE;
+	emit_bytes(a, 2, 0x31, 0xD2);					// xor edx, edx
+	emit_bytes(a, 3, 0x48, 0x39, 0xC8);				// cmp rax, rcx
+	emit_bytes(a, 4, 0x49, 0x0F, 0x40 | cc, 0xD5);	// cmovcc rdx, r13
+	store(a, dst, RDX);
+	int done = jump_forward(a, -1);
+
+	land(a, slow);
+	compile_primitive(a, primitive_type(op), dst, first, second);
+	land(a, done);
+}
+
+static void compile_arith(Assembler * a, int dst, uint8_t type, int first, int count) {
+
+	int slow[3] = {-1, -1, -1};
+	int done = -1;
+
+	// Adding and subtracting two fixnums is done on their tagged values
+	if(count == 2 && (type == SYS_SYM_ADD || type == SYS_SYM_SUB)) {
+		load(a, RAX, first);
+		load(a, RCX, first + 1);
+		slow[0] = check_fixnums(a);
+		if(type == SYS_SYM_ADD) {
+			emit_bytes(a, 3, 0x48, 0x01, 0xC8);			// add rax, rcx
+			slow[1] = jump_forward(a, CC_O);
+			emit_bytes(a, 4, 0x48, 0x83, 0xE8, 0x01);	// sub rax, 1
+		}
+		else {
+			emit_bytes(a, 3, 0x48, 0x29, 0xC8);			// sub rax, rcx
+			slow[1] = jump_forward(a, CC_O);
+			emit_bytes(a, 4, 0x48, 0x83, 0xC8, 0x01);	// or rax, 1
+		}
+		slow[2] = check_range(a);
+		store(a, dst, RAX);
+		done = jump_forward(a, -1);
+	}
+
+	for(int i = 0; i < 3; ++i) {
+		if(slow[i] >= 0) {
+			land(a, slow[i]);
+		}
+	}
+
+	move_int(a, RDI, type);
+	load_address(a, RSI, first);
+	move_int(a, RDX, count);
+	call_function(a, (uint64_t)(uintptr_t)arith);
+	store(a, dst, RAX);
+
+	if(done >= 0) {
+		land(a, done);
+	}
+}
+
+static void compile_jump_not_less(Assembler * a, int first, int second, int target) {
+
+	count(a, &machine->fusion_stats[FUSED_INDEX(SYS_FUSED_IF_LT)].runs);
+	load(a, RAX, first);
+	load(a, RCX, second);
+	int slow = check_fixnums(a);
+	emit_bytes(a, 3, 0x48, 0x39, 0xC8);		// cmp rax, rcx
+	jump_to(a, CC_GE, target);
+	int done = jump_forward(a, -1);
+
+	land(a, slow);
+	emit_bytes(a, 3, 0x48, 0x89, 0xC7);		// mov rdi, rax
+	emit_bytes(a, 3, 0x48, 0x89, 0xCE);		// mov rsi, rcx
+	call_function(a, (uint64_t)(uintptr_t)native_less);
+	emit_bytes(a, 2, 0x84, 0xC0);			// test al, al
+	jump_to(a, CC_E, target);
+	land(a, done);
+}
+
+static void compile_dec(Assembler * a, int dst, int src) {
+
+	count(a, &machine->fusion_stats[FUSED_INDEX(SYS_FUSED_DEC)].runs);
+	load(a, RAX, src);
+	emit_bytes(a, 2, 0xA8, 0x01);				// test al, 1
+	int slow[3];
+	slow[0] = jump_forward(a, CC_E);
+	emit_bytes(a, 4, 0x48, 0x83, 0xE8, 0x02);	// sub rax, 2
+	slow[1] = jump_forward(a, CC_O);
+	slow[2] = check_range(a);
+	store(a, dst, RAX);
+	int done = jump_forward(a, -1);
+
+	for(int i = 0; i < 3; ++i) {
+		if(slow[i] >= 0) {
+			land(a, slow[i]);
+		}
+	}
+	load(a, RDI, src);
+	call_function(a, (uint64_t)(uintptr_t)native_dec);
+	store(a, dst, RAX);
+	land(a, done);
+}
+
+// Assembles the instruction at @pc and returns the pc of the next one
+static int compile_instruction(Assembler * a, uint16_t * ops, int pc) {
+
+	switch(ops[pc]) {
+		case OP_CONST:
+			load_constant(a, RAX, ops[pc + 2]);
+			store(a, ops[pc + 1], RAX);
+			return pc + 3;
+		case OP_LOOKUP: {
+			// The VM runs the lookup again to report a missing symbol
+			load_constant(a, RDI, ops[pc + 2]);
+			load_address(a, RSI, ops[pc + 1]);
+			call_function(a, (uint64_t)(uintptr_t)native_lookup);
+			emit_bytes(a, 2, 0x84, 0xC0);		// test al, al
+			int found = jump_forward(a, CC_NE);
+			exit_to_vm(a, pc);
+			land(a, found);
+			return pc + 3;
+		}
+		case OP_LOCAL: {
+			// Like OP_LOOKUP, the VM reports a missing symbol
+			load_constant(a, RDI, ops[pc + 2]);
+			load_address(a, RSI, ops[pc + 1]);
+			call_function(a, (uint64_t)(uintptr_t)native_local);
+			emit_bytes(a, 2, 0x84, 0xC0);		// test al, al
+			int found = jump_forward(a, CC_NE);
+			exit_to_vm(a, pc);
+			land(a, found);
+			return pc + 3;
+		}
+		case OP_JUMP:
+			jump_to(a, -1, ops[pc + 1]);
+			return pc + 2;
+		case OP_JUMP_NIL:
+		case OP_JUMP_NOT_NIL:
+			if(ops[pc] == OP_JUMP_NOT_NIL) {
+				count(a, &machine->fusion_stats[FUSED_INDEX(SYS_FUSED_IF_NULL)].runs);
+			}
+			load(a, RAX, ops[pc + 1]);
+			emit_bytes(a, 3, 0x4C, 0x39, 0xE8);	// cmp rax, r13
+			jump_to(a, ops[pc] == OP_JUMP_NIL ? CC_E : CC_NE, ops[pc + 2]);
+			return pc + 3;
+		case OP_CAR:
+		case OP_CDR:
+		case OP_ATOM:
+		case OP_NOT:
+			compile_primitive(a, primitive_type(ops[pc]), ops[pc + 1], ops[pc + 2], ops[pc + 2]);
+			return pc + 3;
+		case OP_CONS:
+		case OP_EQ:
+		case OP_AND:
+		case OP_OR:
+			compile_primitive(a, primitive_type(ops[pc]), ops[pc + 1], ops[pc + 2], ops[pc + 3]);
+			return pc + 4;
+		case OP_LESS:
+		case OP_EQUAL:
+		case OP_GREAT:
+			compile_compare(a, ops[pc], ops[pc + 1], ops[pc + 2], ops[pc + 3]);
+			return pc + 4;
+		case OP_ARITH:
+			compile_arith(a, ops[pc + 1], ops[pc + 2], ops[pc + 3], ops[pc + 4]);
+			return pc + 5;
+		case OP_JUMP_NOT_LESS:
+			compile_jump_not_less(a, ops[pc + 1], ops[pc + 2], ops[pc + 3]);
+			return pc + 4;
+		case OP_DEC:
+			compile_dec(a, ops[pc + 1], ops[pc + 2]);
+			return pc + 3;
+		case OP_DEFINE:
+			exit_to_vm(a, pc);
+			return pc + 4;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			exit_to_vm(a, pc);
+			return pc + 4;
+		case OP_FUTURE:
+		case OP_TOUCH:
+			exit_to_vm(a, pc);
+			return pc + 3;
+		default:
+			exit_to_vm(a, pc);
+			return pc + 2;
+	}
+}
+
+bool jit_supported() {
+	return true;
+}
+
+// Compiles @code to machine code, leaving it as bytecode if that fails
+void compile_native(Code * code) {
+
+	Assembler a;
+	a.capacity = ASSEMBLER_STARTING_SIZE;
+	a.bytes = malloc(a.capacity);
+	a.length = 0;
+	a.offsets = calloc(code->length, sizeof(int));
+	a.fixup_capacity = ASSEMBLER_STARTING_SIZE;
+	a.fixups = malloc(sizeof(Fixup) * a.fixup_capacity);
+	a.fixup_count = 0;
+
+	// The epilogue comes first so exits can jump back to it
+	emit_bytes(&a, 2, 0x41, 0x5D);			// pop r13
+	emit_bytes(&a, 2, 0x41, 0x5C);			// pop r12
+	emit_byte(&a, 0x5B);					// pop rbx
+	emit_byte(&a, 0xC3);					// ret
+
+	// Three pushes leave the stack aligned for calls
+	int entry = a.length;
+	emit_byte(&a, 0x53);					// push rbx
+	emit_bytes(&a, 2, 0x41, 0x54);			// push r12
+	emit_bytes(&a, 2, 0x41, 0x55);			// push r13
+	emit_bytes(&a, 3, 0x48, 0x89, 0xFB);	// mov rbx, rdi
+	emit_bytes(&a, 3, 0x49, 0x89, 0xF4);	// mov r12, rsi
+	move_immediate(&a, RAX, (uint64_t)(uintptr_t)&machine->nil);
+	emit_bytes(&a, 3, 0x4C, 0x8B, 0x28);	// mov r13, [rax]
+	emit_bytes(&a, 3, 0x48, 0x63, 0xD2);	// movsxd rdx, edx
+	move_immediate(&a, RCX, 0);
+	int table_address = a.length - 8;
+	emit_bytes(&a, 3, 0xFF, 0x24, 0xD1);	// jmp [rcx + rdx * 8]
+
+	for(int pc = 0; pc < code->length;) {
+		a.offsets[pc] = a.length;
+		pc = compile_instruction(&a, code->ops, pc);
+	}
+
+	for(int i = 0; i < a.fixup_count; ++i) {
+		int at = a.fixups[i].at;
+		patch_u32(&a, at, a.offsets[a.fixups[i].pc] - (at + 4));
+	}
+
+	// The jump table follows the code, with an entry for each pc
+	size_t table = (a.length + 7) & ~(size_t)7;
+	size_t size = table + sizeof(uint64_t) * code->length;
+	uint8_t * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(memory == MAP_FAILED) {
+		free(a.bytes);
+		free(a.offsets);
+		free(a.fixups);
+		return;
+	}
+
+	for(int i = 0; i < 8; ++i) {
+		a.bytes[table_address + i] = ((uintptr_t)(memory + table) >> (i * 8)) & 0xFF;
+	}
+	memcpy(memory, a.bytes, a.length);
+
+	uint64_t * entries = (uint64_t *)(memory + table);
+	for(int pc = 0; pc < code->length; ++pc) {
+		entries[pc] = (uintptr_t)(memory + a.offsets[pc]);
+	}
+
+	// Never writable and executable at once
+	if(mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+	}
+	else {
+		code->native_memory = memory;
+		code->native_size = size;
+		code->native = (Native_Code)(uintptr_t)(memory + entry);
+
+		++machine->jit_stats.lambdas;
+		machine->jit_stats.bytes += a.length;
+	}
+
+	free(a.bytes);
+	free(a.offsets);
+	free(a.fixups);
+}
+
+#else
+
+bool jit_supported() {
+	return false;
+}
+
+void compile_native(Code * code) {
+}
+
+#endif
+
+void free_native(Code * code) {
+	if(code->native_memory != NULL) {
+		munmap(code->native_memory, code->native_size);
+	}
+}
@@ -0,0 +1,104 @@
+#include "lexical_address.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "stack.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Resolution pass run over freshly parsed code. Scoping is dynamic, so the only
+// bindings whose position is known ahead of time are the parameters of the lambda
+// being evaluated: they are always in the innermost frame of the environment.
+// References to them are rewritten into SYS_SYM_LOCAL cells holding the lambda's
+// parameter list and the parameter index. When the innermost frame was made for
+// that same list, sys_eval takes the value at the index without comparing any
+// symbols. Everything else, including references to the parameters of an
+// enclosing lambda, is still looked up by name.
+
+static Cell * resolve_form(Cell * form, Cell * params);
+
+static bool is_cons(Cell * cell) {
+	return cell != NULL && !IS_FIXNUM(cell) && !getIsAtom(cell) && getType(cell) == SYS_GENERAL;
+}
+
+// Returns the index of @symbol in @params, or -1
+static int param_index(Cell * params, Cell * symbol) {
+
+	int index = 0;
+	for(; params != machine->nil; params = getCdr(params), ++index) {
+		if(getCar(params) == symbol) {
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+// Resolves each element of the list starting at @list in place
+static void resolve_list(Cell * list, Cell * params) {
+
+	for(; is_cons(list); list = getCdr(list)) {
+		Cell * form = getCar(list);
+		Cell * resolved = resolve_form(form, params);
+		if(resolved != form) {
+			setCar(list, resolved);
+			write_barrier(list);
+		}
+	}
+}
+
+// Returns @form with the references to @params resolved. @params is NULL
+// outside of any lambda.
+static Cell * resolve_form(Cell * form, Cell * params) {
+
+	if(!is_cons(form)) {
+		if(params == NULL || form == NULL || IS_FIXNUM(form) || form == machine->nil
+			|| !getIsAtom(form) || getType(form) != SYS_GENERAL) {
+			return form;
+		}
+
+		int index = param_index(params, form);
+		if(index < 0) {
+			return form;
+		}
+
+		Cell * local = get_free_cell();
+		setIsAtom(local, true);
+		setType(local, SYS_SYM_LOCAL);
+		setCar(local, form);
+		setCdr(local, cons(params, makeFixnum(index)));
+		return local;
+	}
+
+	switch(getType(getCar(form))) {
+		case SYS_SYM_QUOTE:
+			// Data, not code
+			break;
+		case SYS_SYM_LAMBDA:
+			// The body only sees its own parameters
+			if(is_cons(getCdr(form)) && is_cons(getCdr(getCdr(form)))) {
+				resolve_list(getCdr(getCdr(form)), getCar(getCdr(form)));
+			}
+			break;
+		case SYS_SYM_DEFINE:
+			// The name being defined must stay a symbol, and the value is bound
+			// as it was written. Only a lambda's body is ever evaluated.
+			if(is_cons(getCdr(form)) && is_cons(getCdr(getCdr(form)))) {
+				Cell * value = getCar(getCdr(getCdr(form)));
+				if(is_cons(value) && getIsAtom(getCar(value)) && getType(getCar(value)) == SYS_SYM_LAMBDA) {
+					resolve_form(value, params);
+				}
+			}
+			break;
+		default:
+			resolve_list(form, params);
+			break;
+	}
+
+	return form;
+}
+
+// Rewrites the parameter references in every lambda body of @expr
+Cell * resolve_locals(Cell * expr) {
+	return resolve_form(expr, NULL);
+}
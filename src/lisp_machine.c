@@ -1,139 +1,381 @@
 #include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
 #include "expr_parser.h"
 #include "repl.h"
 #include "stack.h"
+#include "symbol_table.h"
+#include "hash_cons.h"
+#include "shallow_binding.h"
+#include "value_table.h"
+#include "bytecode.h"
+#include "tasks.h"
+#include "actors.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
-int chars_per_pointer = sizeof(uintptr_t) / sizeof(char);
-Lisp_Machine * machine;
+int chars_per_pointer = sizeof(Cell_Word) / sizeof(char);
+THREAD_LOCAL Lisp_Machine * machine;
+
+static void eval_loop();
 
 Lisp_Machine * init_machine() {
 
 	machine = malloc(sizeof(Lisp_Machine));
+	machine->owner = machine;
+	machine->pool = NULL;
+	machine->deque = NULL;
+	machine->pool_index = 0;
+	machine->actor = NULL;
+	machine->is_scheduled = false;
+	machine->is_suspended = false;
+	machine->reductions = 0;
+	machine->resume = NULL;
 	machine->is_running = true;
+	machine->in = stdin;
+	machine->out = stdout;
+	machine->program = NULL;
+	machine->program_line = 0;
 	machine->mem_used = 0;
-	machine->mem_free = NUM_OF_CELLS;
+	machine->mem_free = 0;
+	machine->free_mem = NULL;
+	machine->gc_count = 0;
+	machine->minor_gc_count = 0;
+	machine->parse_stack = NULL;
+	machine->parse_root = NULL;
+	machine->parse_cell = NULL;
+	memset(machine->fusion_stats, 0, sizeof(machine->fusion_stats));
+	memset(&machine->fold_stats, 0, sizeof(machine->fold_stats));
+	memset(&machine->jit_stats, 0, sizeof(machine->jit_stats));
 
 	if(verbose_flag) {
-		printf("Initializing machine...\n");
+		fprintf(machine->out, "Initializing machine...\n");
 	}
 
-	// Create and link the memory cells
-	machine->memory_block = calloc(sizeof(Cell) * NUM_OF_CELLS, sizeof(Cell));
-	machine->free_mem = machine->memory_block;
-	for(int i = 0; i < NUM_OF_CELLS - 1; ++i) {
-		machine->free_mem[i].cdr = &machine->free_mem[i + 1];
+	// Reserve the nursery and the old generation. Old cells are committed and
+	// handed out lazily.
+	reserve_heap(max_heap_size / CELL_SIZE, heap_cells);
+
+	MAKE_STACK(machine->remembered_set, Cell *);
+
+	// Setup the nil atom. Everything compares against it so it must never move.
+	// The shared code ends its lists with the shared one.
+	if(shared_heap != NULL) {
+		machine->nil = shared_heap->nil;
+	}
+	else {
+		machine->nil = get_old_cell();
+		setCar(machine->nil, machine->nil);
+		setCdr(machine->nil, machine->nil);
+		setIsAtom(machine->nil, true);
 	}
 
-	// Setup the nil atom
-	machine->nil = get_free_cell();
-	machine->nil->car = machine->nil;
-	machine->nil->cdr = machine->nil;
-	machine->nil->is_atom = true;
+	init_symbol_table(&machine->symbol_table);
+	init_cons_table(&machine->cons_table);
+	init_value_table(&machine->global_env);
+	init_value_table(&machine->value_table);
+	MAKE_STACK(machine->binding_stack, Value_Slot);
+	init_code_cache(&machine->code_cache);
+	MAKE_STACK(machine->vm_frames, VM_Frame);
+	MAKE_STACK(machine->vm_registers, Cell *);
+
+	// The registers are garbage collection roots so they must always hold a cell
+	for(int i = 0; i < 4; ++i) {
+		machine->args[i] = machine->nil;
+	}
+	machine->result = machine->nil;
 
 	// Initialize the supported instruction lists
 	// null, false and true are pseudo system symbols. They get
 	// translated to something else during parsing
-	init_instr_list("* + - / < = > and atom? begin car cdr charat cons define eq? eval false if in join lambda mod not null or out quit quote substr true");
+	init_instr_list("* + - / < = > and atom? begin car cdr charat cons define eq? eval false future if in join lambda mod not null or out pcall quit quote receive self send spawn substr touch true");
 
 	// Initialize the machine system environment
-	machine->sys_stack = machine->nil;
-	machine->sys_stack_size = 0;
+	MAKE_STACK(machine->sys_stack, Stack_Frame);
+	MAKE_STACK(machine->futures, Cell *);
 
 	machine->memory_access_count = 0;
 	machine->cycle_count = 0;
 
 	if(verbose_flag) {
-		printf("Machine initialized!\n\n");
+		fprintf(machine->out, "Machine initialized!\n\n");
 	}
 
 	return machine;
 }
 
+// Makes a machine that evaluates futures for @owner on thread @index (see
+// tasks.c). It allocates in its own nursery and has its own stacks, registers
+// and compiled code, but the old generation, the symbols and the global
+// environment are the owner's.
+Lisp_Machine * init_task_machine(Lisp_Machine * owner, int index) {
+
+	Lisp_Machine * task = calloc(1, sizeof(Lisp_Machine));
+	task->owner = owner;
+	task->is_running = true;
+	task->in = owner->in;
+	task->out = owner->out;
+
+	task->cell_base = owner->cell_base;
+#ifdef SOA_CELLS
+	task->cell_car = owner->cell_car;
+	task->cell_cdr = owner->cell_cdr;
+	task->cell_type = owner->cell_type;
+	task->cell_flags = owner->cell_flags;
+#endif
+	task->memory_block = owner->memory_block;
+	task->heap_reserved_cells = owner->heap_reserved_cells;
+	task->nil = owner->nil;
+
+	task->nursery = owner->nursery + (size_t)index * NURSERY_CELLS;
+	task->nursery_top = task->nursery;
+	task->nursery_end = task->nursery + NURSERY_CELLS;
+	task->nursery_limit = task->nursery_end - GC_RESERVE_CELLS;
+	MAKE_STACK(task->remembered_set, Cell *);
+
+	// The tables stay empty, but the collector goes through them like the owner's
+	init_value_table(&task->global_env);
+	init_value_table(&task->value_table);
+	MAKE_STACK(task->binding_stack, Value_Slot);
+	init_code_cache(&task->code_cache);
+	MAKE_STACK(task->vm_frames, VM_Frame);
+	MAKE_STACK(task->vm_registers, Cell *);
+
+	for(int i = 0; i < 4; ++i) {
+		task->args[i] = task->nil;
+	}
+	task->result = task->nil;
+
+	task->num_of_instrs = owner->num_of_instrs;
+	task->instructions = owner->instructions;
+
+	MAKE_STACK(task->sys_stack, Stack_Frame);
+	MAKE_STACK(task->futures, Cell *);
+
+	return task;
+}
+
+void destroy_task_machine(Lisp_Machine * task) {
+
+	if(task->actor != NULL) {
+		retire_actor(task->actor);
+	}
+
+	DESTROY_STACK(&task->remembered_set);
+	DESTROY_STACK(&task->sys_stack);
+	DESTROY_STACK(&task->futures);
+	destroy_value_table(&task->global_env);
+	destroy_value_table(&task->value_table);
+	DESTROY_STACK(&task->binding_stack);
+	destroy_code_cache(&task->code_cache);
+	DESTROY_STACK(&task->vm_frames);
+	DESTROY_STACK(&task->vm_registers);
+	free(task);
+}
+
 void destroy_machine(Lisp_Machine *machine) {
 
+	if(machine->actor != NULL) {
+		retire_actor(machine->actor);
+	}
+
 	free(machine->instr_memory_block);
 	free(machine->instructions);
-	free(machine->memory_block);
+	release_heap();
+	DESTROY_STACK(&machine->remembered_set);
+	DESTROY_STACK(&machine->sys_stack);
+	DESTROY_STACK(&machine->futures);
+	destroy_symbol_table(&machine->symbol_table);
+	destroy_cons_table(&machine->cons_table);
+	destroy_value_table(&machine->global_env);
+	destroy_value_table(&machine->value_table);
+	DESTROY_STACK(&machine->binding_stack);
+	destroy_code_cache(&machine->code_cache);
+	DESTROY_STACK(&machine->vm_frames);
+	DESTROY_STACK(&machine->vm_registers);
 	free(machine);
 }
 
+// The REPL's code. Under --shared-code every machine runs the same copy.
+Cell * repl_expression() {
+	return shared_heap != NULL ? shared_heap->repl : make_repl_expression();
+}
+
+// Returns a copy of @expr with @to in place of @from. The lists might be shared
+// by hash consing, so they are copied rather than changed.
+static Cell * replace_symbol(Cell * expr, Cell * from, Cell * to) {
+
+	if(expr == from) {
+		return to;
+	}
+	if(expr == NULL || expr == machine->nil || getIsAtom(expr)) {
+		return expr;
+	}
+
+	return cons(replace_symbol(getCar(expr), from, to), replace_symbol(getCdr(expr), from, to));
+}
+
+// Parses REPL_EXPRESSION with its function renamed to REPL_FUNCTION
+Cell * make_repl_expression() {
+
+	Cell * expr = make_expression(REPL_EXPRESSION);
+
+	lock_interning();
+	Cell * function = intern_symbol(&machine->owner->symbol_table, REPL_FUNCTION, SYS_GENERAL);
+	unlock_interning();
+
+	expr = replace_symbol(expr, make_symbol("repl"), function);
+	if(hash_cons_flag) {
+		expr = hash_cons(expr);
+	}
+
+	return expr;
+}
+
+// Reads and parses the next line of input for in. Under --shared-code the
+// lines of the program were parsed before the machine started.
+Cell * read_expression() {
+
+	Shared_Program * program = machine->program;
+	if(program != NULL && machine->program_line < program->line_count) {
+		Shared_Line * line = &program->lines[machine->program_line];
+		++machine->program_line;
+
+		return line->form != NULL ? line->form : make_expression(line->text);
+	}
+
+	// Other threads can collect while this one waits for a line
+	char * string = malloc(sizeof(char) * INPUT_BUFFER_LENGTH);
+	park_machine();
+	fgets(string, INPUT_BUFFER_LENGTH, machine->in);
+	unpark_machine();
+	Cell * expr = make_expression(string);
+	free(string);
+
+	return expr;
+}
+
+// Allocates a new cell in the nursery
 Cell * get_free_cell() {
 
-	++machine->mem_used;
-	--machine->mem_free;
+	// The nursery can only be collected at a safe point. Should it fill up before
+	// then, allocate straight into the old generation and let the remembered set
+	// take care of any references into the nursery.
+	if(machine->nursery_top == machine->nursery_end) {
+		Cell * new_cell = get_old_cell();
+		write_barrier(new_cell);
+		return new_cell;
+	}
+
+	Cell * new_cell = machine->nursery_top;
+	++machine->nursery_top;
 
-	Cell * new_cell = machine->free_mem;
-	machine->free_mem = cdr(machine->free_mem);
-	new_cell->cdr = NULL;
+	clearCell(new_cell);
 
 	return new_cell;
 }
 
-void store_cell(Cell * cell) {
-	cell->car = machine->free_mem;
-	machine->free_mem = cell;
+// Allocates a new cell in the old generation. Untouched cells are bumped off the
+// top of the heap before falling back to the free list. Only once both are empty
+// does the heap grow. Every thread of --threads allocates in the owner's.
+Cell * get_old_cell() {
+
+	Lisp_Machine * heap = machine->owner;
+	lock_heap();
+
+	if(heap->heap_top == heap->heap_committed && heap->free_mem == NULL) {
+		if(!grow_heap(HEAP_CHUNK_CELLS)) {
+			fprintf(stderr, "Out of memory: all %d cells are in use.\n", heap->heap_committed);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	++heap->mem_used;
+	--heap->mem_free;
+
+	Cell * new_cell;
+	if(heap->heap_top < heap->heap_committed) {
+		new_cell = &heap->memory_block[heap->heap_top];
+		++heap->heap_top;
+	}
+	else {
+		new_cell = heap->free_mem;
+		heap->free_mem = cdr(heap->free_mem);
+	}
+
+	unlock_heap();
+
+	// Cells get reused so clear out whatever the last owner left behind
+	clearCell(new_cell);
+
+	return new_cell;
 }
 
-// Pushes the given number of arguments from the machine->args registers
-// onto the system stack. Tops it with the calling function record.
-void push_system_args(int arg_count) {
+// Returns a cell to the free list. The free list is linked through the cdr.
+// Nursery cells are reclaimed all at once by the next minor collection. Only
+// the collector frees cells, so the heap lock isn't needed.
+void store_cell(Cell * cell) {
 
-	// Push arguments still needed for calling function
-	for(int i = 0; i < arg_count; ++i) {
-		Cell * cell = get_free_cell();
-		cell->car = machine->args[arg_count - i - 1];
-		cell->cdr = machine->sys_stack;
-		machine->sys_stack = cell;
-		++machine->sys_stack_size;
+	if(IS_YOUNG(cell)) {
+		return;
 	}
 
-	// Record calling function
-	Cell * cell = get_free_cell();
-	cell->type = SYS_RETURN_RECORD;
-	cell->car = (Cell *)(intptr_t)machine->calling_func;
-	cell->cdr = machine->sys_stack;
-	machine->sys_stack = cell;
-	++machine->sys_stack_size;
+	Lisp_Machine * heap = machine->owner;
+	--heap->mem_used;
+	++heap->mem_free;
+
+	// The cell could still be in the remembered set, so make sure it doesn't look
+	// like it refers to anything
+	setCar(cell, NULL);
+	setIsAtom(cell, false);
+	setType(cell, SYS_GENERAL);
+	setCdr(cell, heap->free_mem);
+	heap->free_mem = cell;
 }
 
-// Pops the calling function and then pops the arguments in the registers
-void pop_system_args() {
+// Pushes a frame onto the system stack holding the calling function, the address
+// of the label to continue at and the given number of arguments from the
+// machine->args registers.
+void push_system_args(int arg_count, void * continuation) {
 
-	// Restore the calling function
-	machine->calling_func = (uint8_t)(intptr_t)machine->sys_stack->car;
-	machine->sys_stack = machine->sys_stack->cdr;
-	--machine->sys_stack_size;
+	Stack * stack = &machine->sys_stack;
+	if(stack->n == stack->cap) {
+		RESIZE((*stack), Stack_Frame);
+	}
 
-	int arg_count = 0;
-	// Restore arguments
-	while(machine->sys_stack->type != SYS_RETURN_RECORD && machine->sys_stack != machine->nil) {
-		machine->args[arg_count] = machine->sys_stack->car;
-		machine->sys_stack = machine->sys_stack->cdr;
-		--machine->sys_stack_size;
+	Stack_Frame * frame = &((Stack_Frame *)stack->data)[stack->n];
+	++stack->n;
 
-		++arg_count;
+	frame->calling_func = machine->calling_func;
+	frame->continuation = continuation;
+	frame->arg_count = arg_count;
+	for(int i = 0; i < arg_count; ++i) {
+		frame->args[i] = machine->args[i];
 	}
 }
 
-// Implements the various system evalution functions using gotos so that
-// we don't use the normal stack with normal function calls. We must use
-// our own machine stack built from cons cells.
+// Pops the top frame, restoring the calling function and the saved arguments.
+// Returns the label to continue at.
+void * pop_system_args() {
 
-// The calling convention is as follows:
-// - Calling function pushes the arguments needed for later onto the stack.
-// - Calling function pushes the return function onto the stack
-// - Calling function sets up arguments for next function
-// - Jump to the next function
-// - Once next function is complete, it pops the stack.
-// - Called function returns according to the machine->calling_func register set by the previous pop
-void execute() {
+	Stack * stack = &machine->sys_stack;
+	--stack->n;
+	Stack_Frame * frame = &((Stack_Frame *)stack->data)[stack->n];
 
-	machine->calling_func = SYS_REPL;
-	push_system_args(0);
+	machine->calling_func = frame->calling_func;
+	for(int i = 0; i < frame->arg_count; ++i) {
+		machine->args[i] = frame->args[i];
+	}
+
+	return frame->continuation;
+}
+
+// Runs the REPL on the tree engine. Returns once the program quits, with the
+// final value in machine->result.
+void execute() {
 
 /*
 	machine->args[0] = make_expression("				\
@@ -148,21 +390,87 @@ void execute() {
 	");
 */
 
-	// machine->args[0] = make_expression("		\
-	// 	((lambda (fact x result)				\
-	// 	   (fact x result))						\
-	// 	 (lambda (x result)						\
-	// 	   (if (< x 2)							\
-	// 	       result							\
-	// 	       (fact (- x 1) (* result x))))	\
-	// 	 10 1)									\
+	// machine->args[0] = make_expression("
+	// 	((lambda (fact x result)
+	// 	   (fact x result))
+	// 	 (lambda (x result)
+	// 	   (if (< x 2)
+	// 	       result
+	// 	       (fact (- x 1) (* result x))))
+	// 	 10 1)
 	// 	");
-	machine->args[0] = make_expression("((lambda (func)				\
-		                                   (func))					\
-		                                 (lambda () (begin (eval (in)) (func))))");
+	machine->args[0] = repl_expression();
 	//machine->args[0] = make_expression("(cons (quote a) (quote b))");
 	//machine->args[0] = make_expression("(begin (out \"Test\") (quit))");
 	machine->args[1] = make_expression("()");
+
+	eval_loop();
+}
+
+// Evaluates @expr in @env on top of whatever the machine is already running
+// and returns the value. Futures are run this way (see tasks.c).
+Cell * evaluate(Cell * expr, Cell * env) {
+
+	// The caller's registers wait on the system stack, where the collector sees them
+	int depth = machine->sys_stack.n;
+	push_system_args(4, NULL);
+
+	machine->args[0] = expr;
+	machine->args[1] = env;
+	eval_loop();
+	Cell * value = machine->result;
+
+	// Quitting leaves the frames that were running behind
+	machine->sys_stack.n = depth + 1;
+	pop_system_args();
+
+	return value;
+}
+
+// Evaluates @expr in the global environment on a spawned machine (see
+// actors.c). Returns false if the machine was suspended before it finished,
+// in which case resume_evaluation() carries on.
+bool start_evaluation(Cell * expr) {
+
+	machine->args[0] = expr;
+	machine->args[1] = machine->nil;
+	eval_loop();
+
+	return !machine->is_suspended;
+}
+
+bool resume_evaluation() {
+
+	machine->is_suspended = false;
+	eval_loop();
+
+	return !machine->is_suspended;
+}
+
+// Implements the various system evalution functions using gotos so that
+// we don't use the normal stack with normal function calls. We must use
+// our own machine stack built from cons cells.
+
+// The calling convention is as follows:
+// - Calling function pushes the arguments needed for later onto the stack.
+// - Calling function pushes the return function onto the stack
+// - Calling function sets up arguments for next function
+// - Jump to the next function
+// - Once next function is complete, it pops the stack.
+// - Called function returns by jumping to the continuation label saved in the popped frame
+//
+// Evaluates args[0] in the environment args[1], leaving the value in result.
+static void eval_loop() {
+
+	if(machine->resume != NULL) {
+		void * resume = machine->resume;
+		machine->resume = NULL;
+		goto *resume;
+	}
+
+	machine->calling_func = SYS_REPL;
+	push_system_args(0, &&sys_execute_done);
+
 	machine->args[2] = machine->nil;
 	machine->args[3] = machine->nil;
 	machine->result = machine->nil;
@@ -171,18 +479,38 @@ void execute() {
  ************************* Eval ****************************
  ***********************************************************/
 sys_eval:
-	if(machine->args[0]->is_atom) {
-		if(machine->args[0]->type == SYS_GENERAL) {
+	if(getIsAtom(machine->args[0])) {
+		if(getType(machine->args[0]) == SYS_GENERAL) {
 			machine->args[0] = machine->args[0];
 			machine->args[1] = machine->args[1];
-			SYSCALL(sys_lookup);
+
+			if(shallow_binding_flag) {
+				SYSCALL(sys_shallow_lookup);
+			}
+			else {
+				SYSCALL(sys_lookup);
+			}
 		}
-		else if(machine->args[0]->type == SYS_SYM_STRING) {
+		else if(getType(machine->args[0]) == SYS_SYM_STRING) {
 			machine->result = machine->args[0];
 			goto sys_execute_return;
 		}
+		else if(getType(machine->args[0]) == SYS_SYM_LOCAL) {
+			if(shallow_binding_flag) {
+				machine->args[0] = getCar(machine->args[0]);
+				SYSCALL(sys_shallow_lookup);
+			}
+
+			if(local_value(machine->args[0], machine->args[1], &machine->result)) {
+				goto sys_execute_return;
+			}
+
+			// Let the lookup report it
+			machine->args[0] = getCar(machine->args[0]);
+			SYSCALL(sys_lookup);
+		}
 		else {
-			switch(machine->args[0]->type) {
+			switch(getType(machine->args[0])) {
 				case SYS_SYM_NULL:
 					machine->result = machine->nil;
 					break;
@@ -193,37 +521,65 @@ sys_eval:
 					machine->result = NULL;
 					break;
 				case SYS_SYM_NUM:
+				case SYS_SYM_CHAR:
 					machine->result = machine->args[0];
 					break;
+				case SYS_FUTURE:
+					// Left in the arguments of a pcall by parallel_call()
+					machine->result = touch(machine->args[0]);
+					break;
 			}
 			goto sys_execute_return;
 		}
 	}
 	else {
-		switch(machine->args[0]->car->type) {
-			case SYS_SYM_IF:
+		switch(getType(getCar(machine->args[0]))) {
+			case SYS_FUSED_IF_LT:
+			case SYS_FUSED_IF_NULL: {
+				// The test is decided here and the branch taken evaluated in place
+				// of the if, so neither needs a frame
+				Cell * test = getCar(getCdr(machine->args[0]));
+				Cell * first;
+				Cell * second;
+				if(operand_value(getCar(getCdr(test)), machine->args[1], &first)
+					&& operand_value(getCar(getCdr(getCdr(test))), machine->args[1], &second)) {
+
+					bool is_true;
+					if(getType(getCar(machine->args[0])) == SYS_FUSED_IF_LT) {
+						is_true = getNumber(first) < getNumber(second);
+					}
+					else {
+						is_true = first == machine->nil && second == machine->nil;
+					}
+					++machine->fusion_stats[FUSED_INDEX(getType(getCar(machine->args[0])))].runs;
+
+					Cell * branches = getCdr(getCdr(machine->args[0]));
+					machine->args[0] = is_true ? getCar(branches) : getCar(getCdr(branches));
+					machine->args[1] = machine->args[1];
+					machine->args[2] = machine->args[2];
+					machine->args[3] = machine->nil;
 
-				machine->args[3] = machine->args[1];
-				machine->args[2] = machine->args[0]->cdr->cdr->cdr->car;
-				machine->args[1] = machine->args[0]->cdr->cdr->car;
-				machine->args[0] = machine->args[0]->cdr->car;
+					SYSCALL(sys_eval);
+				}
+			}
+				// An unbound operand is reported by the usual path
+			case SYS_SYM_IF:
+				machine->args[0] = getCdr(machine->args[0]);
+				machine->args[1] = machine->args[1];
+				machine->args[2] = machine->args[2];
+				machine->args[3] = machine->nil;
 
 				SYSCALL(sys_evif);
 			case SYS_SYM_LAMBDA:
 				machine->result = machine->args[0];
 				goto sys_execute_return;
 			case SYS_SYM_QUOTE:
-				machine->result = machine->args[0]->cdr->car;
+				machine->result = getCar(getCdr(machine->args[0]));
 				goto sys_execute_return;
 			case SYS_SYM_DEFINE:
 				machine->args[0] = machine->args[0];
 
-				Cell * temp = get_free_cell();
-				temp->car = machine->args[1]->car;
-				temp->cdr = machine->args[1]->cdr;
-
-				machine->args[1]->car = cons(machine->args[0]->cdr->car, machine->args[0]->cdr->cdr->car);
-				machine->args[1]->cdr = temp;
+				define_symbol(getCar(getCdr(machine->args[0])), getCar(getCdr(getCdr(machine->args[0]))), machine->args[1]);
 
 				machine->args[2] = machine->nil;
 				machine->args[3] = machine->nil;
@@ -231,18 +587,70 @@ sys_eval:
 
 				goto sys_execute_return;
 			case SYS_SYM_BEGIN:
-				machine->args[0] = machine->args[0]->cdr;
+				machine->args[0] = getCdr(machine->args[0]);
 				machine->args[1] = machine->args[1];
-				machine->args[2] = machine->nil;
+				machine->args[2] = machine->args[2];
 				machine->args[3] = machine->nil;
 
 				SYSCALL(sys_evbegin);
+			case SYS_SYM_FUTURE:
+				// Without threads to run it, the expression is evaluated in place
+				if(machine->owner->pool != NULL) {
+					machine->result = make_future(getCar(getCdr(machine->args[0])), machine->args[1]);
+					goto sys_execute_return;
+				}
+
+				machine->args[0] = getCar(getCdr(machine->args[0]));
+				machine->args[1] = machine->args[1];
+				machine->args[2] = machine->args[2];
+				machine->args[3] = machine->nil;
+
+				SYSCALL(sys_eval);
+			case SYS_SYM_PCALL:
+				// The call is evaluated in place of the pcall, with futures for
+				// all the arguments but the first
+				machine->args[0] = parallel_call(getCdr(machine->args[0]), machine->args[1]);
+				machine->args[1] = machine->args[1];
+				machine->args[2] = machine->args[2];
+				machine->args[3] = machine->nil;
+
+				SYSCALL(sys_eval);
+			case SYS_FUSED_DEC: {
+				Cell * value;
+				if(operand_value(getCar(getCdr(machine->args[0])), machine->args[1], &value)) {
+					++machine->fusion_stats[FUSED_INDEX(SYS_FUSED_DEC)].runs;
+					machine->result = make_number((Cell_Int)((Cell_Word)getNumber(value) - 1));
+					goto sys_execute_return;
+				}
+				goto sys_eval_call;
+			}
+			case SYS_SYM_CAR:
+			case SYS_SYM_CDR:
+			case SYS_SYM_CONS:
+			case SYS_SYM_EQ:
+			case SYS_SYM_ATOM:
+			case SYS_SYM_LESS:
+			case SYS_SYM_EQUAL:
+			case SYS_SYM_GREAT:
+			case SYS_SYM_AND:
+			case SYS_SYM_OR:
+			case SYS_SYM_NOT:
+				if(operand_count(machine->args[0], primitive_arity(getType(getCar(machine->args[0]))))) {
+					machine->args[0] = machine->args[0];
+					machine->args[1] = machine->args[1];
+					machine->args[2] = machine->nil;
+					machine->args[3] = machine->nil;
+
+					SYSCALL(sys_evprim);
+				}
+				// Otherwise they are applied like any other function
 			default:
-				// Push args for later access
+			sys_eval_call:
+				// Push args for later access, including whether this is a tail call
 				machine->calling_func = SYS_EVAL;
-				push_system_args(2);
+				push_system_args(3, &&sys_eval_evlis_continue);
 				// Setup args for evlis
-				machine->args[0] = machine->args[0]->cdr;
+				machine->args[0] = getCdr(machine->args[0]);
 				machine->args[1] = machine->args[1];
 				machine->args[2] = machine->nil;
 				machine->args[3] = machine->nil;
@@ -253,10 +661,10 @@ sys_eval:
 				sys_eval_evlis_continue:
 
 				// Set up args for sys_apply
-				machine->args[0] = machine->args[0]->car;
+				machine->args[3] = machine->args[2];
+				machine->args[0] = getCar(machine->args[0]);
 				machine->args[2] = machine->args[1];
 				machine->args[1] = machine->result;
-				machine->args[3] = machine->nil;
 
 				SYSCALL(sys_apply);
 		}
@@ -268,153 +676,119 @@ sys_eval:
  ***********************************************************/
 
 sys_apply:
-	
-	if(machine->args[0]->is_atom) {
+
+	// Nothing has been done with the arguments yet, so the apply can start over
+	if(SHOULD_YIELD()) {
+		machine->is_suspended = true;
+		machine->resume = &&sys_apply;
+		return;
+	}
+
+	if(getIsAtom(machine->args[0])) {
 		// Arithmetic operation with multiple args
-		if(machine->args[0]->type >= SYS_SYM_MULT && machine->args[0]->type <= SYS_SYM_DIV) {
+		if(getType(machine->args[0]) >= SYS_SYM_MULT && getType(machine->args[0]) <= SYS_SYM_DIV) {
 
 			machine->args[0] = machine->args[0];
 			machine->args[1] = machine->args[1];
-			machine->args[2] = get_free_cell();
 			machine->args[3] = machine->nil;
 
 			// Setup the starting arguments based on the operation
-			switch(machine->args[0]->type) {
+			switch(getType(machine->args[0])) {
 				case SYS_SYM_MULT:
-					machine->args[2]->car = (Cell *)1;
+					machine->args[2] = makeFixnum(1);
 					break;
 				case SYS_SYM_ADD:
-					machine->args[2]->car = (Cell *)0;
+					machine->args[2] = makeFixnum(0);
 					break;
 				case SYS_SYM_SUB:
-					machine->args[2]->car = machine->args[1]->car->car;
-					machine->args[1] = machine->args[1]->cdr;
+					machine->args[2] = getCar(machine->args[1]);
+					machine->args[1] = getCdr(machine->args[1]);
 					break;
 				case SYS_SYM_DIV:
-					machine->args[2]->car = machine->args[1]->car->car;
-					machine->args[1] = machine->args[1]->cdr;
+					machine->args[2] = getCar(machine->args[1]);
+					machine->args[1] = getCdr(machine->args[1]);
 					break;
 			}
 
-			machine->args[2]->cdr = NULL;
-			machine->args[2]->is_atom = true;
-			machine->args[2]->type = SYS_SYM_NUM;
-
 			SYSCALL(sys_evarth);
 		}
 		else {
-			switch(machine->args[0]->type) {
+			switch(getType(machine->args[0])) {
 				case SYS_SYM_CAR:
-					machine->result = machine->args[1]->car->car;
-					goto sys_execute_return;
 				case SYS_SYM_CDR:
-					machine->result = machine->args[1]->car->cdr;
-					goto sys_execute_return;
 				case SYS_SYM_CONS:
-					machine->result = cons(machine->args[1]->car, machine->args[1]->cdr->car);
-					goto sys_execute_return;
 				case SYS_SYM_EQ:
-					machine->result = eq(machine->args[1]->car, machine->args[1]->cdr->car);
-					goto sys_execute_return;
 				case SYS_SYM_ATOM:
-					machine->result = atom(machine->args[1]->car);
-					goto sys_execute_return;
-				case SYS_SYM_QUIT:
-					machine->result = make_expression("HALT");
-					printf(" => Program requested the machine to quit execution. Quiting...\n");
-					goto sys_execute_done;
 				case SYS_SYM_LESS:
-					if(machine->args[1]->car->car < machine->args[1]->cdr->car->car) {
-						machine->result = NULL;
-					}
-					else {
-						machine->result = machine->nil;
-					}
-					goto sys_execute_return;
 				case SYS_SYM_EQUAL:
-					if(machine->args[1]->car->car == machine->args[1]->cdr->car->car) {
-						machine->result = NULL;
-					}
-					else {
-						machine->result = machine->nil;
-					}
-					goto sys_execute_return;
 				case SYS_SYM_GREAT:
-					if(machine->args[1]->car->car > machine->args[1]->cdr->car->car) {
-						machine->result = NULL;
-					}
-					else {
-						machine->result = machine->nil;
-					}
+				case SYS_SYM_AND:
+				case SYS_SYM_OR:
+				case SYS_SYM_NOT:
+					machine->result = apply_fixed_primitive(getType(machine->args[0]),
+						getCar(machine->args[1]), getCar(getCdr(machine->args[1])));
 					goto sys_execute_return;
+				case SYS_SYM_QUIT:
+					machine->result = make_expression("HALT");
+					fprintf(machine->out, " => Program requested the machine to quit execution. Quiting...\n");
+					goto sys_execute_done;
 				case SYS_SYM_MOD:
 					machine->args[0] = machine->args[0];
 					machine->args[1] = machine->args[1];
-					machine->args[2] = get_free_cell();
+					machine->args[2] = getCar(machine->args[1]);
 					machine->args[3] = machine->nil;
 
-					machine->args[2]->car = machine->args[1]->car->car;
-					machine->args[1] = machine->args[1]->cdr;
-					
-					machine->args[2]->cdr = NULL;
-					machine->args[2]->is_atom = true;
-					machine->args[2]->type = SYS_SYM_NUM;
+					machine->args[1] = getCdr(machine->args[1]);
 
 					SYSCALL(sys_evarth);
-				case SYS_SYM_AND:
-					if(machine->args[1]->car == NULL && machine->args[1]->cdr->car == NULL) {
-						machine->result = NULL;
-					}
-					else {
-						machine->result = machine->nil;
-					}
-					goto sys_execute_return;
-				case SYS_SYM_OR:
-					if(machine->args[1]->car == NULL || machine->args[1]->cdr->car == NULL) {
-						machine->result = NULL;
-					}
-					else {
-						machine->result = machine->nil;
-					}
-					goto sys_execute_return;
-				case SYS_SYM_NOT:
-					if(machine->args[1]->car == NULL) {
-						machine->result = machine->nil;
-					}
-					else {
-						machine->result = NULL;
-					}
-					goto sys_execute_return;
 				case SYS_SYM_JOIN:
-					printf("JOIN");
+					fprintf(machine->out, "JOIN");
 					goto sys_execute_return;
 				case SYS_SYM_SUBSTR:
-					printf("SUBSTR");
+					fprintf(machine->out, "SUBSTR");
 					goto sys_execute_return;
 				case SYS_SYM_CHARAT:
-					machine->args[0] = machine->args[1]->car;
-					machine->args[1] = machine->args[1]->cdr->car;
-					machine->args[2] = make_num("0");
+					machine->args[0] = getCar(machine->args[1]);
+					machine->args[1] = getCar(getCdr(machine->args[1]));
+					machine->args[2] = makeFixnum(0);
 					machine->args[3] = machine->nil;
 
 					SYSCALL(sys_charat);
 				case SYS_SYM_IN:
-					printf(" <= ");
-					char * string = malloc(sizeof(char) * INPUT_BUFFER_LENGTH);
-					fgets(string, INPUT_BUFFER_LENGTH, stdin);
-					machine->result = make_expression(string);
-					free(string);
+					fprintf(machine->out, " <= ");
+					machine->result = read_expression();
 					goto sys_execute_return;
 				case SYS_SYM_OUT:
-					printf(" => ");
-					print_list(machine->args[1]->car);
+					fprintf(machine->out, " => ");
+					print_list(getCar(machine->args[1]));
 					machine->result = machine->nil;
 					goto sys_execute_return;
+				case SYS_SYM_TOUCH:
+					machine->result = touch(getCar(machine->args[1]));
+					goto sys_execute_return;
+				case SYS_SYM_SPAWN:
+					machine->result = spawn_machine(machine->args[1]);
+					goto sys_execute_return;
+				case SYS_SYM_SEND:
+					machine->result = send_message(getCar(machine->args[1]), getCar(getCdr(machine->args[1])));
+					goto sys_execute_return;
+				case SYS_SYM_RECEIVE:
+					// With an empty mailbox a spawned machine gives up its thread
+					// and applies receive again once a message comes
+					if(!receive_message(&machine->result)) {
+						machine->is_suspended = true;
+						machine->resume = &&sys_apply;
+						return;
+					}
+					goto sys_execute_return;
+				case SYS_SYM_SELF:
+					machine->result = self_id();
+					goto sys_execute_return;
 				case SYS_SYM_EVAL:
 					machine->calling_func = SYS_APPLY_0;
-					push_system_args(0);
+					push_system_args(0, &&sys_apply_eval_cont);
 
-					machine->args[0] = machine->args[1]->car;
+					machine->args[0] = getCar(machine->args[1]);
 					machine->args[1] = machine->args[2];
 					machine->args[2] = machine->nil;
 					machine->args[3] = machine->nil;
@@ -424,13 +798,13 @@ sys_apply:
 					// SYS_APPLY_0
 					sys_apply_eval_cont:
 
-					printf(" > ");
+					fprintf(machine->out, " > ");
 					print_list(machine->result);
-					printf("\n");
+					fprintf(machine->out, "\n");
 					goto sys_execute_return;
 				default:
 					machine->calling_func = SYS_APPLY_1;
-					push_system_args(3);
+					push_system_args(4, &&sys_apply_eval_continue);
 
 					machine->args[0] = machine->args[0];
 					machine->args[1] = machine->args[2];
@@ -445,29 +819,78 @@ sys_apply:
 					machine->args[0] = machine->result;
 					machine->args[1] = machine->args[1];
 					machine->args[2] = machine->args[2];
-					machine->args[3] = machine->nil;
+					machine->args[3] = machine->args[3];
 
 					SYSCALL(sys_apply);
 			}
 		}
 	}
-	else {
-		machine->calling_func = SYS_APPLY_2;
-		push_system_args(3);
+	else if(shallow_binding_flag) {
+		// Lambdas without parameters don't need to restore anything. Their
+		// body is in tail position only if the call was.
+		Cell * params = getCar(getCdr(machine->args[0]));
+		if(params != machine->nil) {
+			Stack_Frame * top = &((Stack_Frame *)machine->sys_stack.data)[machine->sys_stack.n - 1];
+
+			// A tail call returns through the caller's unbind frame. The caller's
+			// bindings can go first if the new ones hide all of them.
+			if(machine->args[3] != machine->nil && top->calling_func == SYS_UNBIND) {
+				if(bindings_shadowed(getFixnum(top->args[0]), params)) {
+					unbind_to(getFixnum(top->args[0]));
+				}
+				bind_params(params, machine->args[1]);
+			}
+			else {
+				Cell * lambda = machine->args[0];
 
-		machine->args[0] = machine->args[0]->cdr->car;
-		machine->args[1] = machine->args[1];
-		machine->args[2] = machine->args[2];
+				machine->calling_func = SYS_UNBIND;
+				machine->args[0] = makeFixnum(machine->binding_stack.n);
+				push_system_args(1, &&sys_apply_unbind_continue);
+
+				bind_params(params, machine->args[1]);
+				machine->args[0] = lambda;
+			}
+
+			machine->args[3] = TAIL_POSITION;
+		}
+
+		machine->args[0] = getCar(getCdr(getCdr(machine->args[0])));
+		machine->args[1] = machine->args[2];
+		machine->args[2] = machine->args[3];
 		machine->args[3] = machine->nil;
 
-		SYSCALL(sys_conenv);
+		SYSCALL(sys_eval);
 
-		// SYS_APPLY_2
-		sys_apply_conenv_continue:
+		// SYS_UNBIND
+		sys_apply_unbind_continue:
 
-		machine->args[0] = machine->args[0]->cdr->cdr->car;
-		machine->args[1] = machine->result;
-		machine->args[2] = machine->nil;
+		unbind_to(getFixnum(machine->args[0]));
+		goto sys_execute_return;
+	}
+	else {
+		// Bind all the parameters at once with a single frame in front of the
+		// environment. The evaluated arguments are used as is for the values.
+		// Lambdas without parameters keep the caller's environment, and their
+		// body is in tail position only if the call was.
+		Cell * params = getCar(getCdr(machine->args[0]));
+		if(params != machine->nil) {
+			// A tail call is the last thing the caller does, so the caller's
+			// frame can go if the new one hides all of its bindings
+			if(machine->args[3] != machine->nil && frame_shadowed(machine->args[2], params)) {
+				machine->args[2] = getCdr(machine->args[2]);
+			}
+
+			Cell * frame = get_free_cell();
+			setType(frame, SYS_ENV_FRAME);
+			setCar(frame, params);
+			setCdr(frame, machine->args[1]);
+			machine->args[2] = cons(frame, machine->args[2]);
+			machine->args[3] = TAIL_POSITION;
+		}
+
+		machine->args[0] = getCar(getCdr(getCdr(machine->args[0])));
+		machine->args[1] = machine->args[2];
+		machine->args[2] = machine->args[3];
 		machine->args[3] = machine->nil;
 
 		SYSCALL(sys_eval);
@@ -485,9 +908,9 @@ sys_evlis:
 	}
 	else {
 		machine->calling_func = SYS_EVLIS_0;
-		push_system_args(2);
+		push_system_args(2, &&sys_evlis_eval_continue);
 
-		machine->args[0] = machine->args[0]->car;
+		machine->args[0] = getCar(machine->args[0]);
 		machine->args[1] = machine->args[1];
 		machine->args[2] = machine->nil;
 		machine->args[3] = machine->nil;
@@ -500,9 +923,9 @@ sys_evlis:
 		// Save the result so push 3 args
 		machine->calling_func = SYS_EVLIS_1;
 		machine->args[2] = machine->result;
-		push_system_args(3);
+		push_system_args(3, &&sys_evlis_evlis_continue);
 
-		machine->args[0] = machine->args[0]->cdr;
+		machine->args[0] = getCdr(machine->args[0]);
 		machine->args[1] = machine->args[1];
 		machine->args[2] = machine->nil;
 		machine->args[3] = machine->nil;
@@ -520,13 +943,15 @@ sys_evlis:
  ************************* Evif ****************************
  ***********************************************************/
 
+// Takes the list of the test and the two branches. Both branches are in tail
+// position when the if is.
 sys_evif:
 	
 	machine->calling_func = SYS_EVIF;
-	push_system_args(4);
+	push_system_args(3, &&sys_evif_eval_continue);
 
-	machine->args[0] = machine->args[0];
-	machine->args[1] = machine->args[3];
+	machine->args[0] = getCar(machine->args[0]);
+	machine->args[1] = machine->args[1];
 	machine->args[2] = machine->nil;
 	machine->args[3] = machine->nil;
 
@@ -536,17 +961,17 @@ sys_evif:
 	sys_evif_eval_continue:
 
 	if(machine->result != machine->nil) {
-		machine->args[0] = machine->args[1];
-		machine->args[1] = machine->args[3];
-		machine->args[2] = machine->nil;
+		machine->args[0] = getCar(getCdr(machine->args[0]));
+		machine->args[1] = machine->args[1];
+		machine->args[2] = machine->args[2];
 		machine->args[3] = machine->nil;
 
 		SYSCALL(sys_eval);
 	}
 	else {
-		machine->args[0] = machine->args[2];
-		machine->args[1] = machine->args[3];
-		machine->args[2] = machine->nil;
+		machine->args[0] = getCar(getCdr(getCdr(machine->args[0])));
+		machine->args[1] = machine->args[1];
+		machine->args[2] = machine->args[2];
 		machine->args[3] = machine->nil;
 
 		SYSCALL(sys_eval);
@@ -562,11 +987,21 @@ sys_evbegin:
 		machine->result = machine->result;
 		goto sys_execute_return;
 	}
+	else if(getCdr(machine->args[0]) == machine->nil) {
+		// The last form is evaluated in place of the begin, so it's in tail
+		// position when the begin is
+		machine->args[0] = getCar(machine->args[0]);
+		machine->args[1] = machine->args[1];
+		machine->args[2] = machine->args[2];
+		machine->args[3] = machine->nil;
+
+		SYSCALL(sys_eval);
+	}
 	else {
 		machine->calling_func = SYS_EVBEGIN;
-		push_system_args(2);
+		push_system_args(3, &&sys_evbegin_eval_cont);
 
-		machine->args[0] = machine->args[0]->car;
+		machine->args[0] = getCar(machine->args[0]);
 		machine->args[1] = machine->args[1];
 		machine->args[2] = machine->nil;
 		machine->args[3] = machine->nil;
@@ -576,14 +1011,58 @@ sys_evbegin:
 		// SYS_EVBEGIN
 		sys_evbegin_eval_cont:
 
-		machine->args[0] = machine->args[0]->cdr;
+		machine->args[0] = getCdr(machine->args[0]);
 		machine->args[1] = machine->args[1];
-		machine->args[2] = machine->nil;
+		machine->args[2] = machine->args[2];
 		machine->args[3] = machine->nil;
 
 		SYSCALL(sys_evbegin);
 	}
 
+/***********************************************************
+ ************************* Evprim **************************
+ ***********************************************************/
+
+// Applies a fixed arity primitive to its one or two operands. They are kept in
+// args[2] and args[3] instead of a list, so the call allocates nothing.
+sys_evprim:
+
+	machine->calling_func = SYS_EVPRIM_0;
+	push_system_args(2, &&sys_evprim_first_continue);
+
+	machine->args[0] = getCar(getCdr(machine->args[0]));
+	machine->args[1] = machine->args[1];
+	machine->args[2] = machine->nil;
+	machine->args[3] = machine->nil;
+
+	SYSCALL(sys_eval);
+
+	// SYS_EVPRIM_0
+	sys_evprim_first_continue:
+
+	machine->args[2] = machine->result;
+	machine->args[3] = machine->nil;
+
+	if(getCdr(getCdr(machine->args[0])) != machine->nil) {
+		machine->calling_func = SYS_EVPRIM_1;
+		push_system_args(3, &&sys_evprim_second_continue);
+
+		machine->args[0] = getCar(getCdr(getCdr(machine->args[0])));
+		machine->args[1] = machine->args[1];
+		machine->args[2] = machine->nil;
+		machine->args[3] = machine->nil;
+
+		SYSCALL(sys_eval);
+
+		// SYS_EVPRIM_1
+		sys_evprim_second_continue:
+
+		machine->args[3] = machine->result;
+	}
+
+	machine->result = apply_fixed_primitive(getType(getCar(machine->args[0])), machine->args[2], machine->args[3]);
+	goto sys_execute_return;
+
 /***********************************************************
  ************************* Evarth **************************
  ***********************************************************/
@@ -595,65 +1074,51 @@ sys_evbegin:
  	}
  	else {
  		machine->args[0] = machine->args[0];
- 		switch(machine->args[0]->type) {
+
+ 		// The running total only needs a cell if it outgrows a fixnum. Overflowing
+ 		// a whole word wraps around.
+ 		Cell_Word total = getNumber(machine->args[2]);
+ 		Cell_Word operand = getNumber(getCar(machine->args[1]));
+ 		switch(getType(machine->args[0])) {
  			case SYS_SYM_MULT:
- 				machine->args[2]->car = (Cell *)((uintptr_t)machine->args[2]->car * (uintptr_t)machine->args[1]->car->car);
+ 				total = total * operand;
  				break;
  			case SYS_SYM_ADD:
- 				machine->args[2]->car = (Cell *)((uintptr_t)machine->args[2]->car + (uintptr_t)machine->args[1]->car->car);
+ 				total = total + operand;
  				break;
  			case SYS_SYM_SUB:
- 				machine->args[2]->car = (Cell *)((uintptr_t)machine->args[2]->car - (uintptr_t)machine->args[1]->car->car);
+ 				total = total - operand;
  				break;
  			case SYS_SYM_DIV:
- 				machine->args[2]->car = (Cell *)((uintptr_t)machine->args[2]->car / (uintptr_t)machine->args[1]->car->car);
+ 				total = (Cell_Int)total / (Cell_Int)operand;
  				break;
  			case SYS_SYM_MOD:
- 				machine->args[2]->car = (Cell *)((uintptr_t)machine->args[2]->car % (uintptr_t)machine->args[1]->car->car);
+ 				total = (Cell_Int)total % (Cell_Int)operand;
  				break;
  		}
- 		machine->args[1] = machine->args[1]->cdr;
+ 		machine->args[2] = make_number((Cell_Int)total);
+ 		machine->args[1] = getCdr(machine->args[1]);
 
  		SYSCALL(sys_evarth);
  	}
 
-/***********************************************************
- ************************* Conenv **************************
- ***********************************************************/
-
-sys_conenv:
-
-	if(machine->args[0] == machine->nil) {
-		machine->result = machine->args[2];
-		goto sys_execute_return;
-	}
-	else {
-		machine->calling_func = SYS_CONENV;
-		machine->args[3] = cons(machine->args[0]->car, machine->args[1]->car);
-		push_system_args(4);
-
-		machine->args[0] = machine->args[0]->cdr;
-		machine->args[1] = machine->args[1]->cdr;
-		machine->args[2] = machine->args[2];
-		machine->args[3] = machine->nil;
-
-		SYSCALL(sys_conenv);
-
-		// SYS_CONENV_0
-		sys_conenv_conenv_continue:
-
-		machine->result = cons(machine->args[3], machine->result);
-		goto sys_execute_return;
-	}
-
 /***********************************************************
  ************************* Lookup **************************
  ***********************************************************/
 
 sys_lookup:
 
+	// The local frames are exhausted, so try the global environment
 	if(machine->args[1] == machine->nil) {
-		printf(" => Symbol not found: %s\n", get_symbol_name(machine->args[0]));
+		Value_Slot * slot = table_find(&machine->owner->global_env, machine->args[0]);
+		if(slot != NULL && slot->is_bound) {
+			machine->result = slot->value;
+			goto sys_execute_return;
+		}
+
+		char * name = get_symbol_name(machine->args[0]);
+		fprintf(machine->out, " => Symbol not found: %s\n", name);
+		free(name);
 
 		machine->args[0] = make_expression("(quit)");
 		machine->args[1] = machine->nil;
@@ -663,21 +1128,53 @@ sys_lookup:
 		SYSCALL(sys_eval);
 	}
 	else {
-		// NULL is true in this machine
-		if(eq(machine->args[1]->car->car, machine->args[0]) == NULL) {
-			machine->result = machine->args[1]->car->cdr;
+		// Search a lambda's parameters
+		if(getType(getCar(machine->args[1])) == SYS_ENV_FRAME) {
+			Cell * params = getCar(getCar(machine->args[1]));
+			Cell * values = getCdr(getCar(machine->args[1]));
+			while(params != machine->nil) {
+				if(getCar(params) == machine->args[0]) {
+					machine->result = getCar(values);
+					goto sys_execute_return;
+				}
+				params = getCdr(params);
+				values = getCdr(values);
+			}
+		}
+		// Symbols are interned so a pointer comparison is enough
+		else if(getCar(getCar(machine->args[1])) == machine->args[0]) {
+			machine->result = getCdr(getCar(machine->args[1]));
 			goto sys_execute_return;
 		}
-		else {
-			machine->args[0] = machine->args[0];
-			machine->args[1] = machine->args[1]->cdr;
-			machine->args[2] = machine->nil;
-			machine->args[3] = machine->nil;
 
-			SYSCALL(sys_lookup);
+		machine->args[0] = machine->args[0];
+		machine->args[1] = getCdr(machine->args[1]);
+		machine->args[2] = machine->nil;
+		machine->args[3] = machine->nil;
+
+		SYSCALL(sys_lookup);
+	}
+
+/***********************************************************
+ ********************* Shallow Lookup **********************
+ ***********************************************************/
+
+// Every symbol has a single slot holding its current value, so there's no
+// environment to search
+sys_shallow_lookup:
+
+	{
+		Value_Slot * slot = value_slot(machine->args[0]);
+		if(slot->is_bound) {
+			machine->result = slot->value;
+			goto sys_execute_return;
 		}
 	}
 
+	// Reports the missing symbol
+	machine->args[1] = machine->nil;
+	SYSCALL(sys_lookup);
+
 /***********************************************************
  ************************* Charat **************************
  ***********************************************************/
@@ -687,23 +1184,23 @@ sys_lookup:
 // the index counter to zero. This way, we don't need division.
 sys_charat:
 
-	if(machine->args[1]->car == machine->args[2]->car) {
+	if(getNumber(machine->args[1]) == getNumber(machine->args[2])) {
 		machine->result = get_free_cell();
 		// Extract the character at the requested location
-		machine->result->car = (Cell *)(uintptr_t)(((int)(uintptr_t)machine->args[0]->car >> ((int)(uintptr_t)machine->args[1]->car)) & 0xFF);
-		machine->result->type = SYS_SYM_CHAR;
+		setCarData(machine->result, ((int)getCarData(machine->args[0]) >> getNumber(machine->args[1])) & 0xFF);
+		setType(machine->result, SYS_SYM_CHAR);
 		goto sys_execute_return;
 	}
 	else {
-		if((int)(uintptr_t)machine->args[2]->car == chars_per_pointer - 1) {
-			machine->args[0] = machine->args[0]->cdr;
-			machine->args[1]->car = (Cell *)(uintptr_t)((int)(uintptr_t)machine->args[1]->car - chars_per_pointer);
-			machine->args[2]->car = (Cell *)(uintptr_t)0;
+		if(getNumber(machine->args[2]) == chars_per_pointer - 1) {
+			machine->args[0] = getCdr(machine->args[0]);
+			machine->args[1] = make_number(getNumber(machine->args[1]) - chars_per_pointer);
+			machine->args[2] = makeFixnum(0);
 		}
 		else {
 			machine->args[0] = machine->args[0];
 			machine->args[1] = machine->args[1];
-			machine->args[2]->car = (Cell *)(uintptr_t)((int)(uintptr_t)machine->args[2]->car + 1);
+			machine->args[2] = makeFixnum(getNumber(machine->args[2]) + 1);
 		}
 
 		machine->args[3] = machine->nil;
@@ -716,29 +1213,8 @@ sys_charat:
  ***********************************************************/
 
 sys_execute_return:
-	pop_system_args();
-	switch(machine->calling_func) {
-		case SYS_EVAL:
-			goto sys_eval_evlis_continue;
-		case SYS_APPLY_0:
-			goto sys_apply_eval_cont;
-		case SYS_APPLY_1:
-			goto sys_apply_eval_continue;
-		case SYS_APPLY_2:
-			goto sys_apply_conenv_continue;
-		case SYS_EVLIS_0:
-			goto sys_evlis_eval_continue;
-		case SYS_EVLIS_1:
-			goto sys_evlis_evlis_continue;
-		case SYS_EVIF:
-			goto sys_evif_eval_continue;
-		case SYS_EVBEGIN:
-			goto sys_evbegin_eval_cont;
-		case SYS_CONENV:
-			goto sys_conenv_conenv_continue;
-		case SYS_REPL:
-			goto sys_execute_done;
-	}
+	GC_SAFE_POINT();
+	goto *pop_system_args();
 
 sys_execute_done:
 	return;
@@ -749,19 +1225,270 @@ sys_execute_done:
  */
 
 Cell * car(Cell * cell) {
-	return cell->car;
+	return getCar(cell);
 }
 
 Cell * cdr(Cell * cell) {
-	return cell->cdr;
+	return getCdr(cell);
 }
 
 Cell * cons(Cell * cell1, Cell * cell2) {
 
 	Cell * new_cell = get_free_cell();
 
-	new_cell->car = cell1;
-	new_cell->cdr = cell2;
+	setCar(new_cell, cell1);
+	setCdr(new_cell, cell2);
+
+	return new_cell;
+}
+
+// Finds the value of the parameter reference @local. Its lambda's frame is
+// normally the innermost one in @env, and is recognized by its parameter list.
+// Definitions made since the frame was pushed sit in front of it and can shadow
+// the parameter. Code that escaped its lambda, through eval, finds some other
+// frame or none at all, so then the symbol is looked up by name. Returns false
+// if it isn't bound.
+bool local_value(Cell * local, Cell * env, Cell ** value) {
+
+	Cell * symbol = getCar(local);
+	if(shallow_binding_flag) {
+		return lookup_symbol(symbol, env, value);
+	}
+
+	for(Cell * entry = env; entry != machine->nil; entry = getCdr(entry)) {
+		if(getType(getCar(entry)) == SYS_ENV_FRAME) {
+			if(getCar(getCar(entry)) == getCar(getCdr(local))) {
+				*value = frame_value(getCar(entry), getFixnum(getCdr(getCdr(local))));
+				return true;
+			}
+			break;
+		}
+		if(getCar(getCar(entry)) == symbol) {
+			*value = getCdr(getCar(entry));
+			return true;
+		}
+	}
+
+	return lookup_symbol(symbol, env, value);
+}
+
+// Returns the value of the parameter @index of an env @frame. Frames made by
+// the VM point at the registers holding the arguments (see vm.c), the others
+// hold the list of values.
+Cell * frame_value(Cell * frame, Cell_Int index) {
+
+	Cell * values = getCdr(frame);
+	if(IS_FIXNUM(values)) {
+		return ((Cell **)machine->vm_registers.data)[getFixnum(values) + index];
+	}
+
+	for(; index > 0; --index) {
+		values = getCdr(values);
+	}
+
+	return getCar(values);
+}
+
+// Binds @symbol to @value in @env. Top level definitions go in the global
+// environment, where redefining a symbol replaces its value. Anywhere else the
+// definition lasts until the enclosing lambda returns.
+void define_symbol(Cell * symbol, Cell * value, Cell * env) {
+
+	if(shallow_binding_flag) {
+		// Every lambda with parameters leaves bindings on the stack until it
+		// returns. With none running, nothing would ever restore the old value,
+		// so the definition is global and replaces it.
+		if(machine->binding_stack.n == 0) {
+			Value_Slot * slot = value_slot(symbol);
+			slot->value = value;
+			slot->is_bound = true;
+		}
+		else {
+			bind_symbol(symbol, value);
+		}
+	}
+	else if(env == machine->nil) {
+		// Other threads read the global environment without locking it
+		if(futures_active()) {
+			char * name = get_symbol_name(symbol);
+			fprintf(stderr, "Unable to define '%s' while futures are running.\n", name);
+			free(name);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+
+		Value_Slot * slot = table_slot(&machine->owner->global_env, symbol);
+		slot->value = value;
+		slot->is_bound = true;
+	}
+	else {
+		// Splice the binding in front of the environment's first entry
+		Cell * temp = get_free_cell();
+		setCar(temp, getCar(env));
+		setCdr(temp, getCdr(env));
+
+		setCar(env, cons(symbol, value));
+		setCdr(env, temp);
+		write_barrier(env);
+	}
+}
+
+// True if a frame binding @params would hide every binding made by the
+// innermost frame of @env. Definitions in front of the frame are never hidden.
+bool frame_shadowed(Cell * env, Cell * params) {
+
+	if(env == machine->nil || getType(getCar(env)) != SYS_ENV_FRAME) {
+		return false;
+	}
+
+	for(Cell * old = getCar(getCar(env)); old != machine->nil; old = getCdr(old)) {
+		Cell * param = params;
+		while(param != machine->nil && getCar(param) != getCar(old)) {
+			param = getCdr(param);
+		}
+		if(param == machine->nil) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Finds the value of @symbol the same way sys_lookup does. Returns false if the
+// symbol isn't bound.
+bool lookup_symbol(Cell * symbol, Cell * env, Cell ** value) {
+
+	if(shallow_binding_flag) {
+		Value_Slot * slot = value_slot(symbol);
+		*value = slot->value;
+		return slot->is_bound;
+	}
+
+	for(; env != machine->nil; env = getCdr(env)) {
+		if(getType(getCar(env)) == SYS_ENV_FRAME) {
+			Cell_Int index = 0;
+			for(Cell * params = getCar(getCar(env)); params != machine->nil; params = getCdr(params)) {
+				if(getCar(params) == symbol) {
+					*value = frame_value(getCar(env), index);
+					return true;
+				}
+				++index;
+			}
+		}
+		else if(getCar(getCar(env)) == symbol) {
+			*value = getCdr(getCar(env));
+			return true;
+		}
+	}
+
+	Value_Slot * slot = table_find(&machine->owner->global_env, symbol);
+	if(slot == NULL) {
+		return false;
+	}
+	*value = slot->value;
+	return slot->is_bound;
+}
+
+// Finds the value of an operand that fusion.c took as simple. Returns false if
+// it's an unbound symbol.
+bool operand_value(Cell * operand, Cell * env, Cell ** value) {
+
+	if(operand == machine->nil || IS_FIXNUM(operand) || getType(operand) == SYS_SYM_NUM) {
+		*value = operand;
+		return true;
+	}
+	else if(getType(operand) == SYS_SYM_NULL) {
+		*value = machine->nil;
+		return true;
+	}
+	else if(getType(operand) == SYS_SYM_LOCAL) {
+		return local_value(operand, env, value);
+	}
+
+	return lookup_symbol(operand, env, value);
+}
+
+// Returns how many operands the primitive @type takes, or 0 if it takes any
+// number of them or changes the flow of control
+int primitive_arity(uint8_t type) {
+
+	switch(type) {
+		case SYS_SYM_CAR:
+		case SYS_SYM_CDR:
+		case SYS_SYM_ATOM:
+		case SYS_SYM_NOT:
+			return 1;
+		case SYS_SYM_CONS:
+		case SYS_SYM_EQ:
+		case SYS_SYM_LESS:
+		case SYS_SYM_EQUAL:
+		case SYS_SYM_GREAT:
+		case SYS_SYM_AND:
+		case SYS_SYM_OR:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+// True if the call @form has exactly @count operands
+bool operand_count(Cell * form, int count) {
+
+	Cell * operands = getCdr(form);
+	for(; count > 0; --count) {
+		if(operands == machine->nil) {
+			return false;
+		}
+		operands = getCdr(operands);
+	}
+
+	return operands == machine->nil;
+}
+
+// Applies a primitive of arity 1 or 2 to its operands. The second one is
+// ignored by the primitives that take one.
+Cell * apply_fixed_primitive(uint8_t type, Cell * first, Cell * second) {
+
+	switch(type) {
+		case SYS_SYM_CAR:
+			return getCar(first);
+		case SYS_SYM_CDR:
+			return getCdr(first);
+		case SYS_SYM_CONS:
+			return cons(first, second);
+		case SYS_SYM_EQ:
+			return eq(first, second);
+		case SYS_SYM_ATOM:
+			return atom(first);
+		case SYS_SYM_LESS:
+			return getNumber(first) < getNumber(second) ? NULL : machine->nil;
+		case SYS_SYM_EQUAL:
+			return getNumber(first) == getNumber(second) ? NULL : machine->nil;
+		case SYS_SYM_GREAT:
+			return getNumber(first) > getNumber(second) ? NULL : machine->nil;
+		case SYS_SYM_AND:
+			return first == NULL && second == NULL ? NULL : machine->nil;
+		case SYS_SYM_OR:
+			return first == NULL || second == NULL ? NULL : machine->nil;
+		case SYS_SYM_NOT:
+			return first == NULL ? machine->nil : NULL;
+		default:
+			return machine->nil;
+	}
+}
+
+// Returns a fixnum when the value fits in one, otherwise boxes it in a cell
+Cell * make_number(Cell_Int value) {
+
+	if(value >= FIXNUM_MIN && value <= FIXNUM_MAX) {
+		return makeFixnum(value);
+	}
+
+	Cell * new_cell = get_free_cell();
+
+	setCarData(new_cell, (Cell_Word)value);
+	setIsAtom(new_cell, true);
+	setType(new_cell, SYS_SYM_NUM);
 
 	return new_cell;
 }
@@ -772,7 +1499,7 @@ Cell * quote(Cell * cell) {
 
 Cell * atom(Cell * cell) {
 
-	if(cell->is_atom) {
+	if(getIsAtom(cell)) {
 		return NULL;
 	}
 	else {
@@ -798,31 +1525,31 @@ Cell * eq(Cell * cell1, Cell * cell2) {
 	// Compare two symbols that aren't nil
 	else if (cell1 != machine->nil && cell2 != machine->nil) {
 
-		if(cell1->is_atom && cell2->is_atom) {
+		// Numbers are equal when their values are. Boxed numbers are always too
+		// big to be fixnums so a fixnum never equals a boxed number.
+		if(getType(cell1) == SYS_SYM_NUM || getType(cell2) == SYS_SYM_NUM) {
+			if(getType(cell1) == getType(cell2) && getNumber(cell1) == getNumber(cell2)) {
+				return NULL;
+			}
+			return machine->nil;
+		}
 
-			while(true) {
-				char * name1 = (char *)cell1;
-				char * name2 = (char *)cell2;
+		if(getIsAtom(cell1) && getIsAtom(cell2)) {
 
-				if(strcmp(name1, name2) == 0) {
-					// Both beginnings are the same. But we have more cells to examine
-					if(cdr(cell1) != machine->nil && cdr(cell2) != machine->nil) {
-						cell1 = cell1->cdr;
-						cell2 = cell2->cdr;
-					}
-					//	Both symbols are the same and don't have a cdr. They are eq
-					else if(cdr(cell1) == machine->nil && cdr(cell2) == machine->nil) {
-						return NULL;
-					}
-					else {
-						return machine->nil;
-					}
-				}
-				// The strings aren't the same
-				else {
-					return machine->nil;
+			// Characters hold their value in the car. Strings point to their
+			// contents, which are interned.
+			if(getType(cell1) == SYS_SYM_CHAR || getType(cell1) == SYS_SYM_STRING) {
+				if(getType(cell1) == getType(cell2) && getCarData(cell1) == getCarData(cell2)) {
+					return NULL;
 				}
+				return machine->nil;
+			}
+
+			// Symbols are interned so equal names are the same cell
+			if(cell1 == cell2) {
+				return NULL;
 			}
+			return machine->nil;
 		}
 		else {
 			// Somehow report that the given arguments are not atomic
@@ -857,7 +1584,9 @@ void init_instr_list(char * funcs) {
 		}
 	}
 
-	char (*memory_block)[INSTR_MAX_LENGTH + 1] = malloc(sizeof(char) * (INSTR_MAX_LENGTH + 1) * func_count);
+	// Zeroed so every name is terminated. Memory reused from an earlier machine
+	// isn't zero like a fresh heap.
+	char (*memory_block)[INSTR_MAX_LENGTH + 1] = calloc(func_count, sizeof(char) * (INSTR_MAX_LENGTH + 1));
 	char **instructions = malloc(sizeof(char *) * func_count);
 
 	int func_index = 0;
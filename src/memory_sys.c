@@ -1,48 +1,162 @@
+// MAP_ANONYMOUS isn't part of the POSIX version we build against
+#define _DEFAULT_SOURCE
+
 #include "memory_sys.h"
 #include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "repl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-Cell * getCar(Cell * cell) {
-	manageMetaData(cell);
-	return cell->car;
+void putCellAway(Cell * cell) {
+	setIsFetched(cell, false);
 }
 
-void setCar(Cell *cell, Cell * value) {
-	manageMetaData(cell);
-	cell->car = value;
+void manageMetaData(Cell * cell) {
+	if(!getIsFetched(cell)) {
+		setIsFetched(cell, true);
+		machine->memory_access_count += 1;
+	}
 }
 
-Cell * getCdr(Cell * cell) {
-	manageMetaData(cell);
-	return cell->cdr;
-}
+/***********************************************************
+ ************************* Heap ****************************
+ ***********************************************************/
 
-void setCdr(Cell *cell, Cell * value) {
-	manageMetaData(cell);
-	cell->cdr = value;
-}
+// Reserves @size bytes of address space without committing any of it
+static void * reserve_region(size_t size) {
 
-bool getIsAtom(Cell * cell) {
-	manageMetaData(cell);
-	return cell->is_atom;
+	void * region = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return region == MAP_FAILED ? NULL : region;
 }
 
-void setIsAtom(Cell * cell, bool value) {
-	manageMetaData(cell);
-	cell->is_atom = value;
+// Commits the pages of @region needed to hold @new_size bytes when the first
+// @old_size bytes are already committed
+static bool commit_region(void * region, size_t old_size, size_t new_size) {
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	old_size = (old_size + page_size - 1) / page_size * page_size;
+	new_size = (new_size + page_size - 1) / page_size * page_size;
+
+	if(new_size <= old_size) {
+		return true;
+	}
+
+	return mprotect((char *)region + old_size, new_size - old_size, PROT_READ | PROT_WRITE) == 0;
 }
 
-uint8_t getType(Cell * cell) {
-	manageMetaData(cell);
-	return cell->type;
+// Commits the storage for the cells between @old_cells and @new_cells
+static bool commit_cells(size_t old_cells, size_t new_cells) {
+
+#ifdef SOA_CELLS
+	return commit_region(machine->cell_car, old_cells * sizeof(Cell_Word), new_cells * sizeof(Cell_Word))
+		&& commit_region(machine->cell_cdr, old_cells * sizeof(Cell_Word), new_cells * sizeof(Cell_Word))
+		&& commit_region(machine->cell_type, old_cells, new_cells)
+		&& commit_region(machine->cell_flags, old_cells, new_cells);
+#else
+	return commit_region(machine->cell_base, old_cells * sizeof(Cell), new_cells * sizeof(Cell));
+#endif
 }
 
-void putCellAway(Cell * cell) {
-	cell->is_fetched = false;
+// All cells live in one region of address space that is reserved up front but only
+// committed as the heap grows. Committed pages are zero filled by the kernel the first
+// time they are touched, so nothing has to be initialized at startup.
+//
+// The region starts with a guard cell so that no cell sits at index 0 (compact cells
+// use it for NULL), followed by the nursery and then the old generation. Under
+// --threads there is a nursery for each thread, one after the other, and the
+// machine starting the threads takes the first.
+void reserve_heap(int max_cells, int initial_cells) {
+
+	size_t nursery_cells = (size_t)NURSERY_CELLS * thread_count;
+	size_t max_total = (size_t)max_cells + 1 + nursery_cells;
+
+#if defined(COMPACT_CELLS) || defined(SOA_CELLS)
+	// Cells are addressed with 32 bit words, and the low bit tags fixnums
+	if(max_total > INT32_MAX) {
+		max_total = INT32_MAX;
+	}
+#endif
+
+#ifdef SOA_CELLS
+	// The handles are only ever compared and subtracted, so their region is never committed
+	machine->cell_base = reserve_region(max_total * sizeof(Cell));
+	machine->cell_car = reserve_region(max_total * sizeof(Cell_Word));
+	machine->cell_cdr = reserve_region(max_total * sizeof(Cell_Word));
+	machine->cell_type = reserve_region(max_total);
+	machine->cell_flags = reserve_region(max_total);
+	bool reserved = machine->cell_base != NULL && machine->cell_car != NULL && machine->cell_cdr != NULL
+		&& machine->cell_type != NULL && machine->cell_flags != NULL;
+#else
+	machine->cell_base = reserve_region(max_total * sizeof(Cell));
+	bool reserved = machine->cell_base != NULL;
+#endif
+
+	if(!reserved) {
+		fprintf(stderr, "Unable to reserve a heap of %d cells.\n", max_cells);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	machine->nursery = machine->cell_base + 1;
+	machine->nursery_top = machine->nursery;
+	machine->nursery_end = machine->nursery + NURSERY_CELLS;
+	machine->nursery_limit = machine->nursery_end - GC_RESERVE_CELLS;
+	machine->memory_block = machine->nursery + nursery_cells;
+
+	machine->heap_reserved_cells = max_total;
+	machine->heap_committed_cells = 0;
+	machine->heap_committed = 0;
+	machine->heap_top = 0;
+
+	// The guard cell and the nursery are committed along with the first old cells
+	if(!grow_heap(initial_cells)) {
+		fprintf(stderr, "Unable to commit the initial heap of %d cells.\n", initial_cells);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
-void manageMetaData(Cell * cell) {
-	if(!cell->is_fetched) {
-		cell->is_fetched = true;
-		machine->memory_access_count += 1;
+// Commits @cell_count more cells at the end of the old generation, or whatever
+// is left of the reservation. Returns false once the reservation is used up.
+bool grow_heap(int cell_count) {
+
+	Lisp_Machine * heap = machine->owner;
+	size_t old_cells_offset = heap->memory_block - heap->cell_base;
+	size_t end = old_cells_offset + (size_t)heap->heap_committed + cell_count;
+
+	if(end > heap->heap_reserved_cells) {
+		end = heap->heap_reserved_cells;
+	}
+
+	if(end <= heap->heap_committed_cells || !commit_cells(heap->heap_committed_cells, end)) {
+		return false;
+	}
+
+	heap->heap_committed_cells = end;
+
+	int new_cells = end - old_cells_offset - heap->heap_committed;
+	heap->heap_committed += new_cells;
+	heap->mem_free += new_cells;
+
+	if(verbose_flag) {
+		fprintf(machine->out, " => Heap grown to %d cells\n", heap->heap_committed);
 	}
-}
\ No newline at end of file
+
+	return true;
+}
+
+void release_heap() {
+#ifdef SOA_CELLS
+	munmap(machine->cell_base, machine->heap_reserved_cells * sizeof(Cell));
+	munmap(machine->cell_car, machine->heap_reserved_cells * sizeof(Cell_Word));
+	munmap(machine->cell_cdr, machine->heap_reserved_cells * sizeof(Cell_Word));
+	munmap(machine->cell_type, machine->heap_reserved_cells);
+	munmap(machine->cell_flags, machine->heap_reserved_cells);
+#else
+	munmap(machine->cell_base, machine->heap_reserved_cells * sizeof(Cell));
+#endif
+}
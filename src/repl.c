@@ -18,23 +18,51 @@
 
 #include "repl.h"
 #include "lisp_machine.h"
+#include "jit.h"
+#include "aot.h"
+#include "workers.h"
+#include "tasks.h"
+#include "actors.h"
 #include "expr_parser.h"
+#include "vm.h"
+#include "memory_sys.h"
 #include "stack.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 bool quiet_flag;
 bool runtime_info_flag;
 bool verbose_flag;
-
-Lisp_Machine * machine;
-
+bool hash_cons_flag;
+bool shallow_binding_flag;
+bool stats_flag;
+bool fold_flag;
+bool emit_c_flag;
+bool shared_code_flag;
+int engine;
+int heap_cells;
+size_t max_heap_size;
+int worker_count;
+int thread_count;
+int scheduler_count;
+char ** program_paths;
+int program_count;
+
+// Compiled programs bring their own main
+#ifndef AOT
 int main(int argc, char * argv[]) {
 
 	// Init variables and the machine
 	process_args(argc, argv);
 
+	// Programs named on the command line run on the worker pool instead
+	if(program_count > 0) {
+		run_workers(worker_count, program_paths, program_count);
+		return 0;
+	}
+
 	if(!quiet_flag) {
 		printf("\n");
 		printf(" => ********************\n");
@@ -44,6 +72,12 @@ int main(int argc, char * argv[]) {
 
 	machine = init_machine();
 
+	if(emit_c_flag) {
+		emit_c();
+		destroy_machine(machine);
+		return 0;
+	}
+
 	if(!quiet_flag) {
 		printf(" => Starting session...\n\n");
 	}
@@ -54,14 +88,40 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
+	// Futures run on a pool of threads alongside the REPL
+	if(thread_count > 1) {
+		start_tasks(thread_count);
+	}
+
+	run_session();
+
+	if(thread_count > 1) {
+		stop_tasks();
+	}
+	stop_actors();
+
+	destroy_machine(machine);
+}
+#endif
+
+// Runs the REPL on the current machine until the program quits
+void run_session() {
+
 	// Begin execution of the machine
-	execute();
+	if(engine == ENGINE_VM || engine == ENGINE_JIT) {
+		run_vm();
+	}
+	else {
+		execute();
+	}
 
-	printf(" > ");
+	fprintf(machine->out, " > ");
 	print_list(machine->result);
-	printf("\n");
+	fprintf(machine->out, "\n");
 
-	destroy_machine(machine);
+	if(stats_flag) {
+		print_stats();
+	}
 }
 
 void print_runtime_info(char * func) {
@@ -78,7 +138,8 @@ void print_runtime_info(char * func) {
 	// Print runtime info
 	printf("\033[%dA", RUNTIME_LINES + MAX_PRINT_STACK_DEPTH);
 	printf("In Use: %-10d\n", machine->mem_used);
-	printf("Stack Depth: %-10d\n", machine->sys_stack_size);
+	printf("Collections: %d major, %-10d minor\n", machine->gc_count, machine->minor_gc_count);
+	printf("Stack Depth: %-10d\n", machine->sys_stack.n);
 	printf("\n");
 	printf("Func: %-30s\n", func);	
 	printf("Arg 0: ");
@@ -96,56 +157,70 @@ void print_runtime_info(char * func) {
 	print_runtime_stack();
 }
 
+// Prints what the passes over the parsed code did
+void print_stats() {
+
+	fprintf(machine->out, " => Folded        %ld forms, %ld nodes eliminated\n",
+		machine->fold_stats.forms, machine->fold_stats.nodes);
+
+	char * names[FUSED_TYPE_COUNT] = {"if <", "if null", "dec"};
+	for(int i = 0; i < FUSED_TYPE_COUNT; ++i) {
+		fprintf(machine->out, " => Fused %-8s %ld forms, %ld runs\n", names[i],
+			machine->fusion_stats[i].forms, machine->fusion_stats[i].runs);
+	}
+
+	fprintf(machine->out, " => Compiled      %ld lambdas, %ld bytes of machine code\n",
+		machine->jit_stats.lambdas, machine->jit_stats.bytes);
+}
+
 void print_runtime_stack() {
 
-	int index = 0;
-	Cell * stack = machine->sys_stack;
-	while(index < MAX_PRINT_STACK_DEPTH) {
+	// Print from the top of the stack down
+	Stack_Frame * frames = machine->sys_stack.data;
+	int depth = machine->sys_stack.n - 1;
+	for(int index = 0; index < MAX_PRINT_STACK_DEPTH; ++index, --depth) {
 
-		if(stack == machine->nil) {
-			for(int i = 0; i < MAX_PRINT_STACK_DEPTH - index; ++i) {
-				printf("\n");
-			}
-			break;
+		if(depth < 0) {
+			printf("\n");
+			continue;
 		}
 
-		if(stack->type == SYS_RETURN_RECORD) {
-			switch((int)(uintptr_t)stack->car) {
-				case SYS_REPL:
-					printf("%s\n", "repl");
-					break;
-				case SYS_EVAL:
-					printf("%s\n", "eval");
-					break;
-				case SYS_APPLY_0:
-					printf("%s\n", "apply");
-					break;
-				case SYS_APPLY_1:
-					printf("%s\n", "apply");
-					break;
-				case SYS_APPLY_2:
-					printf("%s\n", "apply");
-					break;
-				case SYS_EVLIS_0:
-					printf("%s\n", "evlis");
-					break;
-				case SYS_EVLIS_1:
-					printf("%s\n", "evlis");
-					break;
-				case SYS_EVIF:
-					printf("%s\n", "evif");
-					break;
-				case SYS_CONENV:
-					printf("%s\n", "conenv");
-					break;
-				default:
-					printf("UNKNOWN: %d\n", (int)(intptr_t)stack->car);
-					break;
-			}
-			++index;
+		switch(frames[depth].calling_func) {
+			case SYS_REPL:
+				printf("%s\n", "repl");
+				break;
+			case SYS_EVAL:
+				printf("%s\n", "eval");
+				break;
+			case SYS_APPLY_0:
+				printf("%s\n", "apply");
+				break;
+			case SYS_APPLY_1:
+				printf("%s\n", "apply");
+				break;
+			case SYS_EVLIS_0:
+				printf("%s\n", "evlis");
+				break;
+			case SYS_EVLIS_1:
+				printf("%s\n", "evlis");
+				break;
+			case SYS_EVIF:
+				printf("%s\n", "evif");
+				break;
+			case SYS_EVBEGIN:
+				printf("%s\n", "evbegin");
+				break;
+			case SYS_UNBIND:
+				printf("%s\n", "unbind");
+				break;
+			case SYS_EVPRIM_0:
+			case SYS_EVPRIM_1:
+				printf("%s\n", "evprim");
+				break;
+			default:
+				printf("UNKNOWN: %d\n", frames[depth].calling_func);
+				break;
 		}
-		
-		stack = stack->cdr;
 	}
 }
 
@@ -158,7 +233,7 @@ void print_list(Cell *list) {
 	print_list_helper(list, string, &index, false);
 	string[index] = '\0';
 
-	printf("%s\n", string);
+	fprintf(machine->out, "%s\n", string);
 }
 
 // Returns 1 if the string gets too long, 0 otherwise
@@ -182,12 +257,12 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 		return 0;
 	}
 
-	if(!list->is_atom) {
+	if(!getIsAtom(list)) {
 		// Executed when we reach the end of list of cells
-		if(list->cdr == machine->nil) {
+		if(getCdr(list) == machine->nil) {
 			// Executed when we reach the end of a list
 			if(is_in_list) {
-				if(print_list_helper(list->car, string, index, false)) {
+				if(print_list_helper(getCar(list), string, index, false)) {
 					return 1;
 				}
 			}
@@ -197,7 +272,7 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 				string[*index] = '(';
 				++*index;
 
-				if(print_list_helper(list->car, string, index, false)) {
+				if(print_list_helper(getCar(list), string, index, false)) {
 					return 1;
 				}
 
@@ -207,14 +282,14 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 		}
 		// Handle lists
 		else {
-			bool car_is_atom = list->car->is_atom;
-			bool cdr_is_pair = !(list->cdr == NULL) && !list->cdr->is_atom; // NULL means true. Thus is an atom
+			bool car_is_atom = getIsAtom(getCar(list));
+			bool cdr_is_pair = !(getCdr(list) == NULL) && !getIsAtom(getCdr(list)); // NULL means true. Thus is an atom
 			bool is_dotted_pair = car_is_atom & (!cdr_is_pair);
 
 			// We are in the middle of a list
 			if(is_in_list) {
 				if(is_dotted_pair) {
-					if(print_list_helper(list->car, string, index, false)) {
+					if(print_list_helper(getCar(list), string, index, false)) {
 						return 1;
 					}
 
@@ -223,19 +298,19 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 					string[*index + 2] = ' ';
 					*index += 3;
 
-					if(print_list_helper(list->cdr, string, index, cdr_is_pair)) {
+					if(print_list_helper(getCdr(list), string, index, cdr_is_pair)) {
 						return 1;
 					}
 				}
 				else {
-					if(print_list_helper(list->car, string, index, false)) {
+					if(print_list_helper(getCar(list), string, index, false)) {
 						return 1;
 					}
 
 					string[*index] = ' ';
 					++*index;
 
-					if(print_list_helper(list->cdr, string, index, cdr_is_pair)) {
+					if(print_list_helper(getCdr(list), string, index, cdr_is_pair)) {
 						return 1;
 					}
 				}
@@ -246,7 +321,7 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 					string[*index] = '(';
 					++*index;
 
-					if(print_list_helper(list->car, string, index, false)) {
+					if(print_list_helper(getCar(list), string, index, false)) {
 						return 1;
 					}
 
@@ -255,7 +330,7 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 					string[*index + 2] = ' ';
 					*index += 3;
 
-					if(print_list_helper(list->cdr, string, index, cdr_is_pair)) {
+					if(print_list_helper(getCdr(list), string, index, cdr_is_pair)) {
 						return 1;
 					}
 
@@ -266,14 +341,14 @@ int print_list_helper(Cell *list, char *string, int *index, bool is_in_list) {
 					string[*index] = '(';
 					++*index;
 
-					if(print_list_helper(list->car, string, index, false)) {
+					if(print_list_helper(getCar(list), string, index, false)) {
 						return 1;
 					}
 
 					string[*index] = ' ';
 					++*index;
 
-					if(print_list_helper(list->cdr, string, index, cdr_is_pair)) {
+					if(print_list_helper(getCdr(list), string, index, cdr_is_pair)) {
 						return 1;
 					}
 
@@ -304,17 +379,100 @@ void process_args(int argc, char * argv[]) {
 
 	quiet_flag = false;
 	runtime_info_flag = false;
+	hash_cons_flag = false;
+	shallow_binding_flag = false;
+	stats_flag = false;
+	fold_flag = false;
+	emit_c_flag = false;
+	shared_code_flag = false;
+	worker_count = 0;
+	thread_count = 1;
+	scheduler_count = 0;
+	program_paths = malloc(sizeof(char *) * argc);
+	program_count = 0;
+	engine = ENGINE_TREE;
+	heap_cells = NUM_OF_CELLS;
+	max_heap_size = DEFAULT_MAX_HEAP_SIZE;
 
 	for(int i = 1; i < argc; ++i) {
 		if(strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
 			quiet_flag = true;
 		}
 		else if(strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--show-runtime-info") == 0) {
+#ifdef RUNTIME_INFO
 			runtime_info_flag = true;
+#else
+			fprintf(stderr, "Option '%s' needs a build made with 'make TRACE=1'.\n", argv[i]);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+#endif
 		}
 		else if(strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
 			verbose_flag = true;
 		}
+		else if(strcmp(argv[i], "--hash-cons") == 0) {
+			hash_cons_flag = true;
+		}
+		else if(strcmp(argv[i], "--shallow-binding") == 0) {
+			shallow_binding_flag = true;
+		}
+		else if(strcmp(argv[i], "--fold") == 0) {
+			fold_flag = true;
+		}
+		else if(strcmp(argv[i], "--emit-c") == 0) {
+			emit_c_flag = true;
+			quiet_flag = true;
+		}
+		else if(strcmp(argv[i], "--shared-code") == 0) {
+#if defined(COMPACT_CELLS) || defined(SOA_CELLS)
+			// Cells are numbered from the base of their own machine's heap
+			fprintf(stderr, "Option '%s' needs a build with the default cell layout.\n", argv[i]);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+#endif
+			shared_code_flag = true;
+		}
+		else if(strcmp(argv[i], "--stats") == 0) {
+			stats_flag = true;
+		}
+		else if(strcmp(argv[i], "--engine=tree") == 0) {
+			engine = ENGINE_TREE;
+		}
+		else if(strcmp(argv[i], "--engine=vm") == 0) {
+			engine = ENGINE_VM;
+		}
+		else if(strcmp(argv[i], "--engine=jit") == 0) {
+			if(!jit_supported()) {
+				fprintf(stderr, "Option '%s' is only supported on x86-64.\n", argv[i]);
+				fprintf(stderr, "Exiting...\n");
+				exit(EXIT_FAILURE);
+			}
+			engine = ENGINE_JIT;
+		}
+		else if(strcmp(argv[i], "--heap-cells") == 0 && i + 1 < argc) {
+			++i;
+			heap_cells = (int)parse_size(argv[i - 1], argv[i], MAX_HEAP_CELLS);
+		}
+		else if(strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc) {
+			++i;
+			max_heap_size = parse_size(argv[i - 1], argv[i], (size_t)MAX_HEAP_CELLS * CELL_SIZE);
+		}
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			++i;
+			worker_count = parse_count(argv[i - 1], argv[i]);
+		}
+		else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			++i;
+			thread_count = parse_count(argv[i - 1], argv[i]);
+		}
+		else if(strcmp(argv[i], "--schedulers") == 0 && i + 1 < argc) {
+			++i;
+			scheduler_count = parse_count(argv[i - 1], argv[i]);
+		}
+		else if(argv[i][0] != '-') {
+			program_paths[program_count] = argv[i];
+			++program_count;
+		}
 		else {
 			fprintf(stderr, "Unrecognized command line option '%s'.\n", argv[i]);
 			fprintf(stderr, "Exiting...\n");
@@ -327,4 +485,94 @@ void process_args(int argc, char * argv[]) {
 		fprintf(stderr, "Exiting...\n");
 		exit(EXIT_FAILURE);
 	}
+
+	if(worker_count > 0 && program_count == 0) {
+		fprintf(stderr, "Option '%s' needs program files to run.\n", "--workers");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Each program gets its own worker machine, and they print to buffers
+	if(program_count > 0 && (runtime_info_flag || emit_c_flag)) {
+		fprintf(stderr, "Conflicting flags: program files can't be used with '%s'\n",
+			runtime_info_flag ? "--show-runtime-info" : "--emit-c");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Futures share one machine's heap and global environment between its
+	// threads, so there's only one machine and the bindings can't be shallow
+	if(thread_count > 1 && (program_count > 0 || runtime_info_flag || shallow_binding_flag)) {
+		fprintf(stderr, "Conflicting flags: '%s' can't be used with %s\n", "--threads",
+			program_count > 0 ? "program files" : runtime_info_flag ? "'--show-runtime-info'" : "'--shallow-binding'");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+	if(shared_code_flag && program_count == 0) {
+		fprintf(stderr, "Option '%s' needs program files to run.\n", "--shared-code");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+	if(program_count > 0 && worker_count == 0) {
+		worker_count = 1;
+	}
+
+	// Only the tree engine can be traced, so -r falls back to it
+	if(runtime_info_flag && engine != ENGINE_TREE) {
+		engine = ENGINE_TREE;
+	}
+
+	if((size_t)heap_cells * CELL_SIZE > max_heap_size) {
+		fprintf(stderr, "Conflicting flags: '%s' is larger than '%s'\n", "--heap-cells", "--max-heap");
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Parses a size for a command line option. Accepts an optional K, M or G suffix.
+// Sizes larger than @max are rejected.
+size_t parse_size(char * option, char * value, size_t max) {
+
+	char * end;
+	unsigned long long size = strtoull(value, &end, 10);
+
+	int shift = 0;
+	switch(*end) {
+		case 'k': case 'K':
+			shift = 10;
+			++end;
+			break;
+		case 'm': case 'M':
+			shift = 20;
+			++end;
+			break;
+		case 'g': case 'G':
+			shift = 30;
+			++end;
+			break;
+	}
+
+	if(value[0] < '0' || value[0] > '9' || *end != '\0' || size == 0 || size > (max >> shift)) {
+		fprintf(stderr, "Invalid value '%s' for option '%s'. Expected a size from 1 to %zu.\n", value, option, max);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return size << shift;
+}
+
+// Parses a thread count for a command line option. Only plain numbers from 1
+// to MAX_THREADS are accepted.
+int parse_count(char * option, char * value) {
+
+	char * end;
+	long count = strtol(value, &end, 10);
+
+	if(value[0] < '0' || value[0] > '9' || *end != '\0' || count < 1 || count > MAX_THREADS) {
+		fprintf(stderr, "Invalid value '%s' for option '%s'. Expected a count from 1 to %d.\n", value, option, MAX_THREADS);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return (int)count;
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "shallow_binding.h"
+#include "value_table.h"
+#include "lisp_machine.h"
+#include "memory_sys.h"
+#include "stack.h"
+#include <string.h>
+
+// Shallow binding for the dynamically scoped evaluator. Instead of searching the
+// environment, every symbol has one slot holding its current value. Binding a
+// symbol saves the old contents of its slot on the binding stack, and returning
+// from the lambda that made the binding restores them. Symbols are interned and
+// never move, so the slots are kept in a table keyed by the symbol's address.
+
+// Returns the value slot of @symbol, creating an unbound one if needed. The
+// pointer is only good until the next slot is created.
+Value_Slot * value_slot(Cell * symbol) {
+	return table_slot(&machine->value_table, symbol);
+}
+
+// Gives @symbol a new value until the binding stack is unwound past this point
+void bind_symbol(Cell * symbol, Cell * value) {
+
+	Value_Slot * slot = value_slot(symbol);
+	PUSH(machine->binding_stack, Value_Slot, *slot);
+
+	slot->value = value;
+	slot->is_bound = true;
+}
+
+// Binds each parameter to the matching value
+void bind_params(Cell * params, Cell * values) {
+
+	while(params != machine->nil) {
+		bind_symbol(getCar(params), getCar(values));
+		params = getCdr(params);
+		values = getCdr(values);
+	}
+}
+
+// Binds each parameter to the matching one of @count values. Parameters
+// without a value are bound to nil.
+void bind_param_array(Cell * params, Cell ** values, int count) {
+
+	for(int i = 0; params != machine->nil; params = getCdr(params), ++i) {
+		bind_symbol(getCar(params), i < count ? values[i] : machine->nil);
+	}
+}
+
+// True if binding @params would hide every binding made since the binding
+// stack was @height high
+bool bindings_shadowed(int height, Cell * params) {
+
+	Value_Slot * saved = machine->binding_stack.data;
+	for(int i = height; i < machine->binding_stack.n; ++i) {
+		Cell * param = params;
+		while(param != machine->nil && getCar(param) != saved[i].symbol) {
+			param = getCdr(param);
+		}
+		if(param == machine->nil) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Restores every binding made since the binding stack was @height high
+void unbind_to(int height) {
+
+	Value_Slot saved;
+	while(machine->binding_stack.n > height) {
+		POP(machine->binding_stack, Value_Slot, saved);
+		*value_slot(saved.symbol) = saved;
+	}
+}
@@ -0,0 +1,132 @@
+#include "shared_heap.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "expr_parser.h"
+#include "stack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Code shared by the worker machines under --shared-code. The REPL and every
+// program are parsed once, on a machine of their own, before the workers
+// start. Its old generation is then made read-only and the workers run the
+// same cells: they take their nil and their interned symbols from it, and in
+// hands them the parsed lines instead of reading the file again. Everything a
+// worker builds goes in its own heap. Shared cells never point into a worker's
+// heap, so the collectors leave them alone.
+
+Shared_Heap * shared_heap;
+
+static bool is_blank(char * string) {
+	for(; *string != '\0'; ++string) {
+		if(*string != ' ' && *string != '\t' && *string != '\n') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parses the program at @path a line at a time, the way in would read it. The
+// parsed lines are kept on the register stack so the collector can find them.
+static void parse_program(Shared_Program * program, char * path) {
+
+	FILE * file = fopen(path, "r");
+	if(file == NULL) {
+		fprintf(stderr, "Unable to open program '%s'.\n", path);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Stack lines;
+	MAKE_STACK(lines, Shared_Line);
+
+	char * string = malloc(sizeof(char) * INPUT_BUFFER_LENGTH);
+	while(fgets(string, INPUT_BUFFER_LENGTH, file) != NULL) {
+		Shared_Line line;
+		line.text = strdup(string);
+		line.form = NULL;
+		PUSH(lines, Shared_Line, line);
+
+		// The REPL fails on a blank line. Only fail if the program gets to it.
+		Cell * form = is_blank(string) ? NULL : make_expression(string);
+		PUSH(machine->vm_registers, Cell *, form);
+	}
+	free(string);
+	fclose(file);
+
+	program->path = path;
+	program->lines = lines.data;
+	program->line_count = lines.n;
+}
+
+// Parses the REPL and the programs at @paths into a new shared heap
+Shared_Heap * build_shared_heap(char ** paths, int path_count) {
+
+	Shared_Heap * heap = malloc(sizeof(Shared_Heap));
+	heap->owner = init_machine();
+	heap->programs = malloc(sizeof(Shared_Program) * path_count);
+	heap->program_count = 0;
+
+	PUSH(machine->vm_registers, Cell *, make_repl_expression());
+	for(int i = 0; i < path_count; ++i) {
+		if(find_shared_program(heap, paths[i]) == NULL) {
+			parse_program(&heap->programs[heap->program_count], paths[i]);
+			++heap->program_count;
+		}
+	}
+
+	// Promote everything out of the nursery so the shared cells are all in one
+	// piece of the old generation
+	minor_collection();
+
+	Cell ** forms = machine->vm_registers.data;
+	heap->repl = forms[0];
+	int index = 1;
+	for(int i = 0; i < heap->program_count; ++i) {
+		for(int j = 0; j < heap->programs[i].line_count; ++j) {
+			heap->programs[i].lines[j].form = forms[index];
+			++index;
+		}
+	}
+	machine->vm_registers.n = 0;
+
+	heap->nil = machine->nil;
+	heap->start = machine->memory_block;
+	heap->end = machine->memory_block + machine->heap_top;
+
+	// Nothing may write to the shared cells from now on
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t)machine->cell_base & ~(page_size - 1);
+	uintptr_t last = ((uintptr_t)heap->end + page_size - 1) & ~(page_size - 1);
+	mprotect((void *)first, last - first, PROT_READ);
+
+	return heap;
+}
+
+void destroy_shared_heap(Shared_Heap * heap) {
+
+	for(int i = 0; i < heap->program_count; ++i) {
+		for(int j = 0; j < heap->programs[i].line_count; ++j) {
+			free(heap->programs[i].lines[j].text);
+		}
+		free(heap->programs[i].lines);
+	}
+	free(heap->programs);
+
+	machine = heap->owner;
+	destroy_machine(heap->owner);
+	machine = NULL;
+	free(heap);
+}
+
+Shared_Program * find_shared_program(Shared_Heap * heap, char * path) {
+	for(int i = 0; i < heap->program_count; ++i) {
+		if(strcmp(heap->programs[i].path, path) == 0) {
+			return &heap->programs[i];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,94 @@
+#include "symbol_table.h"
+#include "lisp_machine.h"
+#include "memory_sys.h"
+#include "expr_parser.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Open addressing hash table from symbol names to their cell chains. Every
+// occurrence of a name in the source shares one chain, so symbols can be
+// compared by address.
+
+void init_symbol_table(Symbol_Table * table) {
+	table->entries = calloc(SYMBOL_TABLE_STARTING_SIZE, sizeof(Symbol_Entry));
+	table->count = 0;
+	table->capacity = SYMBOL_TABLE_STARTING_SIZE;
+}
+
+void destroy_symbol_table(Symbol_Table * table) {
+	for(int i = 0; i < table->capacity; ++i) {
+		free(table->entries[i].name);
+	}
+	free(table->entries);
+}
+
+// FNV-1a
+static uint32_t hash_name(char * name) {
+
+	uint32_t hash = 2166136261u;
+	for(; *name != '\0'; ++name) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// Returns the entry holding @name, or the empty entry where it belongs.
+// The capacity is always a power of two.
+static Symbol_Entry * find_entry(Symbol_Entry * entries, int capacity, char * name) {
+
+	int index = hash_name(name) & (capacity - 1);
+	while(entries[index].name != NULL && strcmp(entries[index].name, name) != 0) {
+		index = (index + 1) & (capacity - 1);
+	}
+
+	return &entries[index];
+}
+
+static void grow_symbol_table(Symbol_Table * table) {
+
+	int capacity = table->capacity * 2;
+	Symbol_Entry * entries = calloc(capacity, sizeof(Symbol_Entry));
+
+	for(int i = 0; i < table->capacity; ++i) {
+		if(table->entries[i].name != NULL) {
+			*find_entry(entries, capacity, table->entries[i].name) = table->entries[i];
+		}
+	}
+
+	free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+}
+
+// Returns the cell chain for @name, or NULL if it hasn't been interned. Never
+// changes the table, so any number of threads can look up a frozen one.
+Cell * find_symbol(Symbol_Table * table, char * name) {
+	return find_entry(table->entries, table->capacity, name)->symbol;
+}
+
+// Returns the cell chain for @name, packing it the first time the name is seen
+Cell * intern_symbol(Symbol_Table * table, char * name, uint8_t type) {
+
+	Symbol_Entry * entry = find_entry(table->entries, table->capacity, name);
+	if(entry->name != NULL) {
+		return entry->symbol;
+	}
+
+	// Keep the table at most three quarters full
+	if((table->count + 1) * 4 > table->capacity * 3) {
+		grow_symbol_table(table);
+		entry = find_entry(table->entries, table->capacity, name);
+	}
+
+	entry->name = malloc(strlen(name) + 1);
+	strcpy(entry->name, name);
+	entry->symbol = pack_cell_string(name);
+	setIsAtom(entry->symbol, true);
+	setType(entry->symbol, type);
+	++table->count;
+
+	return entry->symbol;
+}
@@ -0,0 +1,480 @@
+#include "tasks.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "repl.h"
+#include "vm.h"
+#include "stack.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Futures for --threads. (future expr) hands expr and its environment to a pool
+// of machines, one per thread, that all allocate in the same heap, and (touch f)
+// waits for the value. (pcall f a1 a2 ... an) makes futures of a2 to an, and
+// evaluating a1 on the calling machine in the meantime lets the recursive calls
+// of a divide and conquer program run side by side. Without the pool futures
+// are evaluated where they are made.
+//
+// Every machine keeps a deque of the futures it made. Touching a future that
+// hasn't been started runs it right there, on top of the toucher's own frames,
+// and idle machines steal the oldest futures, which tend to be the biggest. A
+// future is only ever run once: whoever moves its state from pending to running
+// runs it, and the others drop it when they find it in a deque. A machine
+// touching a future that another one is running runs other futures meanwhile.
+//
+// A future is a cell in the old generation so it never moves while threads hold
+// it. The machine that finishes it stores the value in the car before setting
+// the state, so a machine that sees the state done can read the value.
+//
+// Collections stop every machine. The machine that runs out of nursery lowers
+// the others' nursery limits so they stop at their next safe point, and waits
+// until none of them is running. Definitions in the global environment are
+// refused while futures run, so threads can read it without locks. Futures are
+// meant for code without side effects, and nothing orders the ones they have.
+
+static Task_Deque * make_deque() {
+
+	Task_Deque * deque = malloc(sizeof(Task_Deque));
+	pthread_mutex_init(&deque->lock, NULL);
+	deque->futures = malloc(sizeof(Cell *) * DEQUE_STARTING_SIZE);
+	deque->head = 0;
+	deque->tail = 0;
+	deque->capacity = DEQUE_STARTING_SIZE;
+
+	return deque;
+}
+
+static void destroy_deque(Task_Deque * deque) {
+	pthread_mutex_destroy(&deque->lock);
+	free(deque->futures);
+	free(deque);
+}
+
+static void push_future(Task_Deque * deque, Cell * future) {
+
+	pthread_mutex_lock(&deque->lock);
+
+	// Slide the futures down to the front before growing
+	if(deque->tail == deque->capacity) {
+		int count = deque->tail - deque->head;
+		if(count * 2 > deque->capacity) {
+			deque->capacity *= 2;
+			deque->futures = realloc(deque->futures, sizeof(Cell *) * deque->capacity);
+		}
+		memmove(deque->futures, deque->futures + deque->head, sizeof(Cell *) * count);
+		deque->head = 0;
+		deque->tail = count;
+	}
+
+	deque->futures[deque->tail] = future;
+	++deque->tail;
+
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes the newest future off @deque, or the oldest if @steal is set. Returns
+// NULL if it's empty.
+static Cell * pop_future(Task_Deque * deque, bool steal) {
+
+	Cell * future = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+	if(deque->head != deque->tail) {
+		if(steal) {
+			future = deque->futures[deque->head];
+			++deque->head;
+		}
+		else {
+			--deque->tail;
+			future = deque->futures[deque->tail];
+		}
+	}
+	if(deque->head == deque->tail) {
+		deque->head = 0;
+		deque->tail = 0;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return future;
+}
+
+static bool future_done(Cell * future) {
+	return loadCdr(future) == makeFixnum(FUTURE_DONE);
+}
+
+// Moves @future from pending to running. Only one machine ever manages to.
+static bool claim_future(Cell * future) {
+	return casCdr(future, makeFixnum(FUTURE_PENDING), makeFixnum(FUTURE_RUNNING));
+}
+
+/***********************************************************
+ ************************* Parking *************************
+ ***********************************************************/
+
+// A parked machine holds no cells the collector can't find in its roots, so a
+// collection can go ahead without it. Both are called with the pool lock held.
+static void park(Task_Pool * pool) {
+
+	--pool->running;
+	if(pool->stopping && pool->running == 0) {
+		pthread_cond_signal(&pool->stopped);
+	}
+}
+
+// Waits out any collection before the machine runs again
+static void unpark(Task_Pool * pool) {
+
+	while(pool->stopping) {
+		pthread_cond_wait(&pool->resumed, &pool->lock);
+	}
+	++pool->running;
+}
+
+// Parks the machine while it blocks outside the pool, like reading input
+void park_machine() {
+
+	Task_Pool * pool = machine->owner->pool;
+	if(pool != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		park(pool);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void unpark_machine() {
+
+	Task_Pool * pool = machine->owner->pool;
+	if(pool != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		unpark(pool);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// Wakes the machines waiting for a change. Called after making the change. The
+// fences pair with the ones in wait_for_change() so that either the sleeper
+// sees the change or we see the sleeper.
+static void wake_sleepers(Task_Pool * pool) {
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool->sleeping, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->changed);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// Parks until a future is made or one finishes. Returns straight away if there
+// are futures queued or @future, if there is one, is already done.
+static void wait_for_change(Task_Pool * pool, Cell * future) {
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 && !pool->shutdown
+		&& (future == NULL || !future_done(future))) {
+		park(pool);
+		pthread_cond_wait(&pool->changed, &pool->lock);
+		unpark(pool);
+	}
+
+	__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/***********************************************************
+ ************************* Futures *************************
+ ***********************************************************/
+
+Cell * make_future(Cell * expr, Cell * env) {
+
+	Task_Pool * pool = machine->owner->pool;
+
+	Cell * future = get_old_cell();
+	setCar(future, cons(expr, env));
+	setCdr(future, makeFixnum(FUTURE_PENDING));
+	setIsAtom(future, true);
+	setType(future, SYS_FUTURE);
+	write_barrier(future);
+
+	__atomic_add_fetch(&pool->active, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+	push_future(machine->deque, future);
+	wake_sleepers(pool);
+
+	return future;
+}
+
+// Rewrites the call (f a1 a2 ... an) of a pcall into (f a1 F2 ... Fn), where
+// the Fi are futures of the ai. Evaluating a future touches it, so the call
+// evaluates a1 while the others run and then waits for them. Without the pool
+// the call is evaluated as it is.
+Cell * parallel_call(Cell * call, Cell * env) {
+
+	if(machine->owner->pool == NULL || call == machine->nil || getCdr(call) == machine->nil) {
+		return call;
+	}
+
+	Stack args;
+	MAKE_STACK(args, Cell *);
+	for(Cell * arg = getCdr(getCdr(call)); arg != machine->nil; arg = getCdr(arg)) {
+		PUSH(args, Cell *, getCar(arg));
+	}
+
+	// The last argument's future is made first, so the first one is on top of
+	// the deque when the call touches it
+	Cell * list = machine->nil;
+	Cell * arg;
+	while(args.n != 0) {
+		POP(args, Cell *, arg);
+		list = cons(make_future(arg, env), list);
+	}
+	DESTROY_STACK(&args);
+
+	return cons(getCar(call), cons(getCar(getCdr(call)), list));
+}
+
+// Evaluates a claimed future on this machine and publishes its value
+static void run_future(Cell * future) {
+
+	Task_Pool * pool = machine->owner->pool;
+
+	PUSH(machine->futures, Cell *, future);
+
+	Cell * task = getCar(future);
+	Cell * value;
+	if(engine == ENGINE_TREE) {
+		value = evaluate(getCar(task), getCdr(task));
+	}
+	else {
+		value = vm_evaluate(getCar(task), getCdr(task));
+	}
+
+	--machine->futures.n;
+
+	setCar(future, value);
+	write_barrier(future);
+	storeCdr(future, makeFixnum(FUTURE_DONE));
+
+	__atomic_sub_fetch(&pool->active, 1, __ATOMIC_RELAXED);
+	wake_sleepers(pool);
+}
+
+// Claims a future from this machine's deque, or failing that steals one from
+// another machine's. Returns NULL if there's nothing to run.
+static Cell * find_future(Task_Pool * pool) {
+
+	for(int i = 0; i < pool->machine_count; ++i) {
+		Lisp_Machine * victim = pool->machines[(machine->pool_index + i) % pool->machine_count];
+
+		Cell * future;
+		while((future = pop_future(victim->deque, i != 0)) != NULL) {
+			__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+			if(claim_future(future)) {
+				return future;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// Returns the value of @value if it's a future, waiting for it if needed.
+// Anything else is its own value.
+Cell * touch(Cell * value) {
+
+	if(!IS_FUTURE(value)) {
+		return value;
+	}
+
+	Task_Pool * pool = machine->owner->pool;
+	Cell * future = value;
+	while(!future_done(future)) {
+		if(claim_future(future)) {
+			run_future(future);
+			break;
+		}
+
+		// Another machine is running it, so make ourselves useful
+		Cell * other = find_future(pool);
+		if(other != NULL) {
+			run_future(other);
+		}
+		else {
+			wait_for_change(pool, future);
+		}
+	}
+
+	return getCar(future);
+}
+
+// True while futures that haven't finished exist
+bool futures_active() {
+
+	Task_Pool * pool = machine->owner->pool;
+	return pool != NULL && __atomic_load_n(&pool->active, __ATOMIC_RELAXED) > 0;
+}
+
+/***********************************************************
+ ******************** Stopping the World *******************
+ ***********************************************************/
+
+// Stops every other machine for a collection by this one. Returns false if
+// there's no need to collect any more, because another machine collected
+// while this one waited.
+bool stop_machines() {
+
+	Task_Pool * pool = machine->owner->pool;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if(pool->stopping) {
+		park(pool);
+		unpark(pool);
+		pthread_mutex_unlock(&pool->lock);
+		return false;
+	}
+	if(machine->nursery_top < machine->nursery_limit) {
+		pthread_mutex_unlock(&pool->lock);
+		return false;
+	}
+
+	pool->stopping = true;
+	for(int i = 0; i < pool->machine_count; ++i) {
+		if(pool->machines[i] != machine) {
+			__atomic_store_n(&pool->machines[i]->nursery_limit, pool->machines[i]->nursery, __ATOMIC_RELAXED);
+		}
+	}
+
+	park(pool);
+	while(pool->running > 0) {
+		pthread_cond_wait(&pool->stopped, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+// Lets the machines stopped by stop_machines() run again
+void start_machines() {
+
+	Task_Pool * pool = machine->owner->pool;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for(int i = 0; i < pool->machine_count; ++i) {
+		Lisp_Machine * other = pool->machines[i];
+		__atomic_store_n(&other->nursery_limit, other->nursery_end - GC_RESERVE_CELLS, __ATOMIC_RELAXED);
+	}
+	pool->stopping = false;
+	++pool->running;
+	pthread_cond_broadcast(&pool->resumed);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/***********************************************************
+ ************************** Pool ***************************
+ ***********************************************************/
+
+static void * task_thread(void * arg) {
+
+	machine = arg;
+	Task_Pool * pool = machine->owner->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	unpark(pool);
+	pthread_mutex_unlock(&pool->lock);
+
+	while(!__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED)) {
+		Cell * future = find_future(pool);
+		if(future != NULL) {
+			run_future(future);
+		}
+		else {
+			wait_for_change(pool, NULL);
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	park(pool);
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+// Starts @thread_count - 1 threads to run futures next to the current machine
+void start_tasks(int thread_count) {
+
+	Task_Pool * pool = malloc(sizeof(Task_Pool));
+	pool->machines = malloc(sizeof(Lisp_Machine *) * thread_count);
+	pool->threads = malloc(sizeof(pthread_t) * thread_count);
+	pool->machine_count = thread_count;
+	pthread_mutex_init(&pool->heap_lock, NULL);
+	pthread_mutex_init(&pool->intern_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->changed, NULL);
+	pthread_cond_init(&pool->stopped, NULL);
+	pthread_cond_init(&pool->resumed, NULL);
+	pool->running = 1;
+	pool->stopping = false;
+	pool->shutdown = false;
+	pool->queued = 0;
+	pool->active = 0;
+	pool->sleeping = 0;
+
+	for(int i = 0; i < thread_count; ++i) {
+		Lisp_Machine * task = i == 0 ? machine : init_task_machine(machine, i);
+		task->deque = make_deque();
+		task->pool_index = i;
+		pool->machines[i] = task;
+	}
+	machine->pool = pool;
+
+	for(int i = 1; i < thread_count; ++i) {
+		if(pthread_create(&pool->threads[i], NULL, task_thread, pool->machines[i]) != 0) {
+			fprintf(stderr, "Unable to start thread %d.\n", i);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Waits for the threads to finish the futures they are running and stops them.
+// Futures nobody started are dropped.
+void stop_tasks() {
+
+	Task_Pool * pool = machine->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->shutdown, true, __ATOMIC_RELAXED);
+	park(pool);
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i = 1; i < pool->machine_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	machine->pool = NULL;
+	for(int i = 0; i < pool->machine_count; ++i) {
+		destroy_deque(pool->machines[i]->deque);
+		pool->machines[i]->deque = NULL;
+		if(i != 0) {
+			destroy_task_machine(pool->machines[i]);
+		}
+	}
+
+	pthread_mutex_destroy(&pool->heap_lock);
+	pthread_mutex_destroy(&pool->intern_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->changed);
+	pthread_cond_destroy(&pool->stopped);
+	pthread_cond_destroy(&pool->resumed);
+	free(pool->machines);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,81 @@
+#include "value_table.h"
+#include "lisp_machine.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Maps symbols to values. Symbols are interned and never move, so the slots are
+// found by hashing the symbol's address. Used for the shallow binding slots and
+// the global environment.
+
+void init_value_table(Value_Table * table) {
+	table->slots = calloc(VALUE_TABLE_STARTING_SIZE, sizeof(Value_Slot));
+	table->count = 0;
+	table->capacity = VALUE_TABLE_STARTING_SIZE;
+}
+
+void destroy_value_table(Value_Table * table) {
+	free(table->slots);
+}
+
+static uint32_t hash_symbol(Cell * symbol) {
+	return ((uintptr_t)symbol * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+// Returns the slot for @symbol, or the empty slot where it belongs. The
+// capacity is always a power of two.
+static Value_Slot * find_slot(Value_Slot * slots, int capacity, Cell * symbol) {
+
+	int index = hash_symbol(symbol) & (capacity - 1);
+	while(slots[index].symbol != NULL && slots[index].symbol != symbol) {
+		index = (index + 1) & (capacity - 1);
+	}
+
+	return &slots[index];
+}
+
+static void grow_value_table(Value_Table * table) {
+
+	int capacity = table->capacity * 2;
+	Value_Slot * slots = calloc(capacity, sizeof(Value_Slot));
+
+	for(int i = 0; i < table->capacity; ++i) {
+		if(table->slots[i].symbol != NULL) {
+			*find_slot(slots, capacity, table->slots[i].symbol) = table->slots[i];
+		}
+	}
+
+	free(table->slots);
+	table->slots = slots;
+	table->capacity = capacity;
+}
+
+// Returns the slot of @symbol in @table, or NULL if it has none. Never changes
+// the table, so threads can share it while nobody adds to it.
+Value_Slot * table_find(Value_Table * table, Cell * symbol) {
+
+	Value_Slot * slot = find_slot(table->slots, table->capacity, symbol);
+	return slot->symbol != NULL ? slot : NULL;
+}
+
+// Returns the slot of @symbol in @table, creating an unbound one if needed. The
+// pointer is only good until the next slot is created.
+Value_Slot * table_slot(Value_Table * table, Cell * symbol) {
+
+	Value_Slot * slot = find_slot(table->slots, table->capacity, symbol);
+	if(slot->symbol != NULL) {
+		return slot;
+	}
+
+	// Keep the table at most three quarters full
+	if((table->count + 1) * 4 > table->capacity * 3) {
+		grow_value_table(table);
+		slot = find_slot(table->slots, table->capacity, symbol);
+	}
+
+	slot->symbol = symbol;
+	slot->value = NULL;
+	slot->is_bound = false;
+	++table->count;
+
+	return slot;
+}
@@ -0,0 +1,669 @@
+#include "vm.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "lisp_machine.h"
+#include "garbage_collector.h"
+#include "memory_sys.h"
+#include "expr_parser.h"
+#include "shallow_binding.h"
+#include "repl.h"
+#include "stack.h"
+#include "tasks.h"
+#include "actors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Register machine running the code built by bytecode.c. It's the engine used
+// with --engine=vm and follows the semantics of execute(): the same dynamically
+// scoped environments, define and lookup rules, and in/out/eval behaviour. Each
+// call pushes a VM_Frame and a window of registers. Garbage is only collected
+// on calls and returns, where the registers, the frames and the constants of
+// the code in use hold every live value.
+//
+// Arguments are passed in place. The caller evaluates them into consecutive
+// registers and the called lambda's window starts at the first of them, so
+// its env frame just records where they are and shallow binding reads them
+// from there. A frame is only given a list of values when it has to outlive
+// its registers, which happens when a tail call keeps it in the environment.
+//
+// With --engine=jit the code of a lambda called often enough is compiled to
+// machine code by jit.c, which runs in place of the bytecode until it reaches
+// a call or return.
+//
+// Futures are run on whichever machine of the pool takes them, which can't see
+// our registers, so their environment is escaped before they are made.
+//
+// A spawned machine is suspended at a call, when it runs out of reductions or
+// receive finds its mailbox empty. Its frames are left as they are and the
+// call runs again when it's resumed.
+
+#define FRAME() (&((VM_Frame *)machine->vm_frames.data)[machine->vm_frames.n - 1])
+#define REGISTERS ((Cell **)machine->vm_registers.data)
+
+// Pushes a frame running @code with its registers from @base up, the first
+// @argument_count of which already hold the arguments. Returning restores the
+// register stack to the height @top.
+static void push_frame(Code * code, Cell * env, Cell * lambda, int result, int binding_mark, uint8_t kind,
+	int base, int argument_count, int top) {
+
+	Stack * registers = &machine->vm_registers;
+	int end = base + code->register_count;
+	while(end > registers->cap) {
+		RESIZE((*registers), Cell *);
+	}
+
+	// Registers are garbage collection roots so they must always hold a cell
+	for(int i = base + argument_count; i < end; ++i) {
+		REGISTERS[i] = machine->nil;
+	}
+	registers->n = end > top ? end : top;
+
+	VM_Frame frame;
+	frame.code = code;
+	frame.pc = 0;
+	frame.base = base;
+	frame.top = top;
+	frame.result = result;
+	frame.env = env;
+	frame.lambda = lambda;
+	frame.binding_mark = binding_mark;
+	frame.kind = kind;
+
+	PUSH(machine->vm_frames, VM_Frame, frame);
+}
+
+// Pushes a frame with fresh registers on top of the ones in use
+static void push_code(Code * code, Cell * env, int result, uint8_t kind) {
+	int top = machine->vm_registers.n;
+	push_frame(code, env, machine->nil, result, -1, kind, top, 0, top);
+}
+
+// Gives the innermost env frame in @env a list of the values in its registers,
+// so it stays valid once they are reused
+static void escape_frame(Cell * env) {
+
+	while(getType(getCar(env)) != SYS_ENV_FRAME) {
+		env = getCdr(env);
+	}
+
+	Cell * frame = getCar(env);
+	if(!IS_FIXNUM(getCdr(frame))) {
+		return;
+	}
+
+	int count = 0;
+	for(Cell * param = getCar(frame); param != machine->nil; param = getCdr(param)) {
+		++count;
+	}
+
+	Cell * values = machine->nil;
+	for(int i = count - 1; i >= 0; --i) {
+		values = cons(frame_value(frame, i), values);
+	}
+
+	setCdr(frame, values);
+	write_barrier(frame);
+}
+
+// Escapes every env frame in @env, not just the innermost one
+static void escape_environment(Cell * env) {
+
+	for(; env != machine->nil; env = getCdr(env)) {
+		if(getType(getCar(env)) == SYS_ENV_FRAME && IS_FIXNUM(getCdr(getCar(env)))) {
+			escape_frame(env);
+		}
+	}
+}
+
+static void quit() {
+	machine->result = make_expression("HALT");
+	fprintf(machine->out, " => Program requested the machine to quit execution. Quiting...\n");
+}
+
+static void symbol_not_found(Cell * symbol) {
+	char * name = get_symbol_name(symbol);
+	fprintf(machine->out, " => Symbol not found: %s\n", name);
+	free(name);
+
+	quit();
+}
+
+bool is_primitive(uint8_t type) {
+
+	switch(type) {
+		case SYS_SYM_MULT: case SYS_SYM_ADD: case SYS_SYM_SUB: case SYS_SYM_DIV:
+		case SYS_SYM_MOD: case SYS_SYM_LESS: case SYS_SYM_EQUAL: case SYS_SYM_GREAT:
+		case SYS_SYM_AND: case SYS_SYM_OR: case SYS_SYM_NOT: case SYS_SYM_ATOM:
+		case SYS_SYM_CAR: case SYS_SYM_CDR: case SYS_SYM_CONS: case SYS_SYM_EQ:
+		case SYS_SYM_CHARAT: case SYS_SYM_JOIN: case SYS_SYM_SUBSTR: case SYS_SYM_IN:
+		case SYS_SYM_OUT: case SYS_SYM_EVAL: case SYS_SYM_QUIT: case SYS_SYM_TOUCH:
+		case SYS_SYM_SPAWN: case SYS_SYM_SEND: case SYS_SYM_RECEIVE: case SYS_SYM_SELF:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static Cell * truth(bool value) {
+	return value ? NULL : machine->nil;
+}
+
+// Folds the arithmetic operator @type over @count arguments like sys_evarth
+Cell * arith(uint8_t type, Cell ** args, int count) {
+
+	Cell_Word total;
+	int i = 0;
+	switch(type) {
+		case SYS_SYM_MULT:
+			total = 1;
+			break;
+		case SYS_SYM_ADD:
+			total = 0;
+			break;
+		default:
+			total = getNumber(args[0]);
+			i = 1;
+			break;
+	}
+
+	// Overflowing a whole word wraps around
+	for(; i < count; ++i) {
+		Cell_Word operand = getNumber(args[i]);
+		switch(type) {
+			case SYS_SYM_MULT:
+				total = total * operand;
+				break;
+			case SYS_SYM_ADD:
+				total = total + operand;
+				break;
+			case SYS_SYM_SUB:
+				total = total - operand;
+				break;
+			case SYS_SYM_DIV:
+				total = (Cell_Int)total / (Cell_Int)operand;
+				break;
+			case SYS_SYM_MOD:
+				total = (Cell_Int)total % (Cell_Int)operand;
+				break;
+		}
+	}
+
+	return make_number((Cell_Int)total);
+}
+
+// Returns the character at @index of @string
+static Cell * char_at(Cell * string, Cell_Int index) {
+
+	Cell * chars = getCar(string);
+	for(; index >= chars_per_pointer; index -= chars_per_pointer) {
+		chars = getCdr(chars);
+	}
+
+	Cell * result = get_free_cell();
+	setCarData(result, (getCarData(chars) >> (index * 8)) & 0xFF);
+	setIsAtom(result, true);
+	setType(result, SYS_SYM_CHAR);
+
+	return result;
+}
+
+// Applies a primitive that doesn't change the flow of control. Missing
+// arguments are nil, like in sys_apply.
+Cell * apply_primitive(uint8_t type, Cell ** args, int count) {
+
+	#define ARG(i) ((i) < count ? args[i] : machine->nil)
+
+	switch(type) {
+		case SYS_SYM_CAR:
+			return getCar(ARG(0));
+		case SYS_SYM_CDR:
+			return getCdr(ARG(0));
+		case SYS_SYM_CONS:
+			return cons(ARG(0), ARG(1));
+		case SYS_SYM_EQ:
+			return eq(ARG(0), ARG(1));
+		case SYS_SYM_ATOM:
+			return atom(ARG(0));
+		case SYS_SYM_LESS:
+			return truth(getNumber(ARG(0)) < getNumber(ARG(1)));
+		case SYS_SYM_EQUAL:
+			return truth(getNumber(ARG(0)) == getNumber(ARG(1)));
+		case SYS_SYM_GREAT:
+			return truth(getNumber(ARG(0)) > getNumber(ARG(1)));
+		case SYS_SYM_AND:
+			return truth(ARG(0) == NULL && ARG(1) == NULL);
+		case SYS_SYM_OR:
+			return truth(ARG(0) == NULL || ARG(1) == NULL);
+		case SYS_SYM_NOT:
+			return truth(ARG(0) != NULL);
+		case SYS_SYM_MULT:
+		case SYS_SYM_ADD:
+		case SYS_SYM_SUB:
+		case SYS_SYM_DIV:
+		case SYS_SYM_MOD:
+			return arith(type, args, count);
+		case SYS_SYM_CHARAT:
+			return char_at(ARG(0), getNumber(ARG(1)));
+		case SYS_SYM_JOIN:
+			fprintf(machine->out, "JOIN");
+			return machine->nil;
+		case SYS_SYM_SUBSTR:
+			fprintf(machine->out, "SUBSTR");
+			return machine->nil;
+		case SYS_SYM_IN:
+			fprintf(machine->out, " <= ");
+			return read_expression();
+		case SYS_SYM_OUT:
+			fprintf(machine->out, " => ");
+			print_list(ARG(0));
+			return machine->nil;
+		case SYS_SYM_TOUCH:
+			return touch(ARG(0));
+		case SYS_SYM_SPAWN: {
+			Cell * list = machine->nil;
+			for(int i = count - 1; i >= 0; --i) {
+				list = cons(args[i], list);
+			}
+			return spawn_machine(list);
+		}
+		case SYS_SYM_SEND:
+			return send_message(ARG(0), ARG(1));
+		case SYS_SYM_RECEIVE: {
+			// Only machines with a thread of their own get here, and they wait
+			Cell * value = machine->nil;
+			receive_message(&value);
+			return value;
+		}
+		case SYS_SYM_SELF:
+			return self_id();
+	}
+
+	#undef ARG
+
+	return machine->nil;
+}
+
+// Calls the function in register @first with the @count registers after it as
+// arguments. The value ends up in register @result. A @tail call to a lambda
+// from a lambda replaces the running frame, which returns to its own caller.
+// Returns false if the machine has to stop.
+static bool call(int result, int first, int count, bool tail) {
+
+	GC_SAFE_POINT();
+
+	// Symbols in the function position are evaluated until we reach something
+	// that can be applied, like sys_apply does
+	Cell * function = REGISTERS[first];
+	while(function != NULL && getIsAtom(function)
+		&& (getType(function) == SYS_GENERAL || getType(function) == SYS_SYM_LOCAL)) {
+
+		if(getType(function) == SYS_SYM_LOCAL) {
+			Cell * symbol = getCar(function);
+			if(!local_value(function, FRAME()->env, &function)) {
+				symbol_not_found(symbol);
+				return false;
+			}
+		}
+		else {
+			Cell * symbol = function;
+			if(!lookup_symbol(symbol, FRAME()->env, &function)) {
+				symbol_not_found(symbol);
+				return false;
+			}
+		}
+	}
+
+	if(function == NULL || getIsAtom(function)) {
+		uint8_t type = function == NULL ? SYS_SYM_TRUE : getType(function);
+
+		if(type == SYS_SYM_EVAL) {
+			Code * code = compile_expression(count > 0 ? REGISTERS[first + 1] : machine->nil);
+			push_code(code, FRAME()->env, result, VM_FRAME_EVAL);
+			return true;
+		}
+		else if(type == SYS_SYM_QUIT) {
+			quit();
+			return false;
+		}
+		else if(type == SYS_SYM_RECEIVE) {
+			Cell * value;
+			if(!receive_message(&value)) {
+				FRAME()->pc -= 4;
+				machine->is_suspended = true;
+				return false;
+			}
+			REGISTERS[result] = value;
+			return true;
+		}
+		else if(!is_primitive(type)) {
+			fprintf(machine->out, " => Not a function: ");
+			print_list(function);
+			quit();
+			return false;
+		}
+
+		Cell * value = apply_primitive(type, &REGISTERS[first + 1], count);
+		REGISTERS[result] = value;
+		return true;
+	}
+
+	// Eval and top frames own their code, so they are never replaced
+	tail = tail && FRAME()->kind == VM_FRAME_CALL;
+
+	Cell * params = getCar(getCdr(function));
+	Cell * env = FRAME()->env;
+	int base = first + 1;
+	int top = machine->vm_registers.n;
+	int binding_mark = -1;
+	if(tail) {
+		VM_Frame frame = *FRAME();
+		--machine->vm_frames.n;
+		result = frame.result;
+		top = frame.top;
+		binding_mark = frame.binding_mark;
+
+		// The bindings of the replaced frame can go if the new ones hide all of
+		// them, like sys_apply does
+		if(shallow_binding_flag) {
+			if(params != machine->nil && binding_mark >= 0 && bindings_shadowed(binding_mark, params)) {
+				unbind_to(binding_mark);
+			}
+		}
+		else if(params != machine->nil && frame_shadowed(env, params)) {
+			env = getCdr(env);
+		}
+		else if(getCar(getCdr(frame.lambda)) != machine->nil) {
+			escape_frame(env);
+		}
+
+		// The arguments move down to the start of the replaced frame
+		base = frame.base;
+		memmove(&REGISTERS[base], &REGISTERS[first + 1], sizeof(Cell *) * count);
+	}
+
+	// Bind the parameters the same way sys_apply does
+	if(params != machine->nil) {
+		if(shallow_binding_flag) {
+			if(binding_mark < 0) {
+				binding_mark = machine->binding_stack.n;
+			}
+			bind_param_array(params, &REGISTERS[base], count);
+		}
+		else {
+			Cell * frame = get_free_cell();
+			setType(frame, SYS_ENV_FRAME);
+			setCar(frame, params);
+			setCdr(frame, makeFixnum(base));
+			env = cons(frame, env);
+		}
+	}
+
+	// Under the jit engine a lambda's code is compiled to machine code once it's hot
+	Code * code = lambda_code(function);
+	if(engine == ENGINE_JIT && code->native == NULL && ++code->call_count == JIT_THRESHOLD) {
+		compile_native(code);
+	}
+
+	push_frame(code, env, function, result, binding_mark, VM_FRAME_CALL, base, count, top);
+
+	return true;
+}
+
+// Pops the running frame and hands @value to its caller. Returns false once
+// the outermost frame returns.
+static bool vm_return(Cell * value) {
+
+	VM_Frame frame = *FRAME();
+	--machine->vm_frames.n;
+	machine->vm_registers.n = frame.top;
+
+	if(frame.binding_mark >= 0) {
+		unbind_to(frame.binding_mark);
+	}
+
+	if(frame.kind != VM_FRAME_CALL) {
+		free_code(frame.code);
+	}
+
+	if(frame.kind == VM_FRAME_EVAL) {
+		fprintf(machine->out, " > ");
+		print_list(value);
+		fprintf(machine->out, "\n");
+	}
+	else if(frame.kind == VM_FRAME_TOP) {
+		machine->result = value;
+		return false;
+	}
+
+	REGISTERS[frame.result] = value;
+	GC_SAFE_POINT();
+
+	return true;
+}
+
+static void run() {
+
+	VM_Frame * frame;
+	uint16_t * ops;
+	Cell ** constants;
+	Cell ** regs;
+	Native_Code native;
+	int pc;
+
+reload:
+	frame = FRAME();
+	ops = frame->code->ops;
+	constants = frame->code->constants;
+	regs = REGISTERS + frame->base;
+	pc = frame->pc;
+	native = frame->code->native;
+
+	for(;;) {
+		// Compiled code runs up to the next instruction it leaves to us
+		if(native != NULL) {
+			pc = native(regs, constants, pc);
+		}
+
+		switch(ops[pc]) {
+			case OP_CONST:
+				regs[ops[pc + 1]] = constants[ops[pc + 2]];
+				pc += 3;
+				break;
+			case OP_LOOKUP:
+				if(!lookup_symbol(constants[ops[pc + 2]], frame->env, &regs[ops[pc + 1]])) {
+					symbol_not_found(constants[ops[pc + 2]]);
+					return;
+				}
+				pc += 3;
+				break;
+			case OP_LOCAL:
+				if(!local_value(constants[ops[pc + 2]], frame->env, &regs[ops[pc + 1]])) {
+					symbol_not_found(getCar(constants[ops[pc + 2]]));
+					return;
+				}
+				pc += 3;
+				break;
+			case OP_DEFINE:
+				define_symbol(constants[ops[pc + 2]], constants[ops[pc + 3]], frame->env);
+				regs[ops[pc + 1]] = NULL;
+				pc += 4;
+				break;
+			case OP_JUMP:
+				pc = ops[pc + 1];
+				break;
+			case OP_JUMP_NIL:
+				pc = regs[ops[pc + 1]] == machine->nil ? ops[pc + 2] : pc + 3;
+				break;
+			case OP_CAR:
+				regs[ops[pc + 1]] = getCar(regs[ops[pc + 2]]);
+				pc += 3;
+				break;
+			case OP_CDR:
+				regs[ops[pc + 1]] = getCdr(regs[ops[pc + 2]]);
+				pc += 3;
+				break;
+			case OP_ATOM:
+				regs[ops[pc + 1]] = atom(regs[ops[pc + 2]]);
+				pc += 3;
+				break;
+			case OP_NOT:
+				regs[ops[pc + 1]] = truth(regs[ops[pc + 2]] != NULL);
+				pc += 3;
+				break;
+			case OP_CONS:
+				regs[ops[pc + 1]] = cons(regs[ops[pc + 2]], regs[ops[pc + 3]]);
+				pc += 4;
+				break;
+			case OP_EQ:
+				regs[ops[pc + 1]] = eq(regs[ops[pc + 2]], regs[ops[pc + 3]]);
+				pc += 4;
+				break;
+			case OP_LESS:
+				regs[ops[pc + 1]] = truth(getNumber(regs[ops[pc + 2]]) < getNumber(regs[ops[pc + 3]]));
+				pc += 4;
+				break;
+			case OP_EQUAL:
+				regs[ops[pc + 1]] = truth(getNumber(regs[ops[pc + 2]]) == getNumber(regs[ops[pc + 3]]));
+				pc += 4;
+				break;
+			case OP_GREAT:
+				regs[ops[pc + 1]] = truth(getNumber(regs[ops[pc + 2]]) > getNumber(regs[ops[pc + 3]]));
+				pc += 4;
+				break;
+			case OP_AND:
+				regs[ops[pc + 1]] = truth(regs[ops[pc + 2]] == NULL && regs[ops[pc + 3]] == NULL);
+				pc += 4;
+				break;
+			case OP_OR:
+				regs[ops[pc + 1]] = truth(regs[ops[pc + 2]] == NULL || regs[ops[pc + 3]] == NULL);
+				pc += 4;
+				break;
+			case OP_JUMP_NOT_LESS:
+				++machine->fusion_stats[FUSED_INDEX(SYS_FUSED_IF_LT)].runs;
+				pc = getNumber(regs[ops[pc + 1]]) < getNumber(regs[ops[pc + 2]]) ? pc + 4 : ops[pc + 3];
+				break;
+			case OP_JUMP_NOT_NIL:
+				++machine->fusion_stats[FUSED_INDEX(SYS_FUSED_IF_NULL)].runs;
+				pc = regs[ops[pc + 1]] != machine->nil ? ops[pc + 2] : pc + 3;
+				break;
+			case OP_DEC:
+				++machine->fusion_stats[FUSED_INDEX(SYS_FUSED_DEC)].runs;
+				regs[ops[pc + 1]] = make_number((Cell_Int)((Cell_Word)getNumber(regs[ops[pc + 2]]) - 1));
+				pc += 3;
+				break;
+			case OP_ARITH:
+				regs[ops[pc + 1]] = arith(ops[pc + 2], &regs[ops[pc + 3]], ops[pc + 4]);
+				pc += 5;
+				break;
+			case OP_FUTURE:
+				escape_environment(frame->env);
+				regs[ops[pc + 1]] = make_future(constants[ops[pc + 2]], frame->env);
+				pc += 3;
+				break;
+			case OP_TOUCH: {
+				Cell * value = regs[ops[pc + 2]];
+				if(!IS_FUTURE(value)) {
+					regs[ops[pc + 1]] = value;
+					pc += 3;
+					break;
+				}
+
+				// Waiting can run other futures on this machine, which moves the
+				// frames and registers
+				frame->pc = pc + 3;
+				int index = frame->base + ops[pc + 1];
+				value = touch(value);
+				REGISTERS[index] = value;
+				goto reload;
+			}
+			case OP_CALL:
+			case OP_TAIL_CALL:
+				if(SHOULD_YIELD()) {
+					frame->pc = pc;
+					machine->is_suspended = true;
+					return;
+				}
+				frame->pc = pc + 4;
+				if(!call(frame->base + ops[pc + 1], frame->base + ops[pc + 2], ops[pc + 3], ops[pc] == OP_TAIL_CALL)) {
+					return;
+				}
+				goto reload;
+			case OP_RETURN:
+				if(!vm_return(regs[ops[pc + 1]])) {
+					return;
+				}
+				goto reload;
+		}
+	}
+}
+
+// Pops the frames above @depth. Quitting leaves the frames that were running
+// behind.
+static void unwind_frames(int depth) {
+
+	while(machine->vm_frames.n > depth) {
+		VM_Frame frame = *FRAME();
+		--machine->vm_frames.n;
+		if(frame.kind != VM_FRAME_CALL) {
+			free_code(frame.code);
+		}
+	}
+}
+
+// Runs the REPL on the bytecode machine. Like execute(), it returns once the
+// program quits with the final value in machine->result.
+void run_vm() {
+
+	Code * code = compile_expression(repl_expression());
+	push_code(code, machine->nil, -1, VM_FRAME_TOP);
+
+	run();
+
+	unwind_frames(0);
+	machine->vm_registers.n = 0;
+}
+
+// Evaluates @expr on a spawned machine, like start_evaluation() does on the
+// tree engine. Returns false if the machine was suspended first, in which case
+// vm_resume() carries on.
+bool vm_start(Cell * expr) {
+
+	Code * code = compile_expression(expr);
+	push_code(code, machine->nil, -1, VM_FRAME_TOP);
+
+	return vm_resume();
+}
+
+bool vm_resume() {
+
+	machine->is_suspended = false;
+	run();
+
+	if(machine->is_suspended) {
+		return false;
+	}
+
+	unwind_frames(0);
+	machine->vm_registers.n = 0;
+
+	return true;
+}
+
+// Returns the value of @expr in @env, run above whatever this machine is
+// already running. Used for futures.
+Cell * vm_evaluate(Cell * expr, Cell * env) {
+
+	int depth = machine->vm_frames.n;
+	int top = machine->vm_registers.n;
+
+	Code * code = compile_expression(expr);
+	push_code(code, env, -1, VM_FRAME_TOP);
+
+	run();
+
+	unwind_frames(depth);
+	machine->vm_registers.n = top;
+
+	return machine->result;
+}
@@ -0,0 +1,122 @@
+#include "workers.h"
+#include "lisp_machine.h"
+#include "repl.h"
+#include "shared_heap.h"
+#include "actors.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Worker pool for --workers. Every program named on the command line is a job
+// that runs on its own machine, reading the file the way the REPL reads stdin.
+// The machines share nothing, so the workers never wait on each other. Their
+// output is buffered and printed in the order the programs were given, as if
+// each had been run by itself with -q. With --shared-code the programs are
+// parsed once, before the workers start, and the machines share that code.
+
+typedef struct job_t {
+	char * path;
+	char * output;
+	size_t output_size;
+} Job;
+
+typedef struct worker_pool_t {
+	Job * jobs;
+	int job_count;
+	int next_job;		// Taken by workers with an atomic increment
+} Worker_Pool;
+
+static void run_job(Job * job) {
+
+	FILE * in = fopen(job->path, "r");
+	if(in == NULL) {
+		fprintf(stderr, "Unable to open program '%s'.\n", job->path);
+		fprintf(stderr, "Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE * out = open_memstream(&job->output, &job->output_size);
+
+	machine = init_machine();
+	machine->in = in;
+	machine->out = out;
+
+	// The file has already been parsed, so in only reads it once that runs out
+	if(shared_heap != NULL) {
+		machine->program = find_shared_program(shared_heap, job->path);
+		fseek(in, 0, SEEK_END);
+	}
+
+	run_session();
+
+	destroy_machine(machine);
+	machine = NULL;
+
+	fclose(in);
+	fclose(out);
+}
+
+static void * worker(void * arg) {
+
+	Worker_Pool * pool = arg;
+	for(;;) {
+		int index = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED);
+		if(index >= pool->job_count) {
+			return NULL;
+		}
+
+		run_job(&pool->jobs[index]);
+	}
+}
+
+// Runs each of the programs at @paths on a pool of @worker_count threads
+void run_workers(int worker_count, char ** paths, int path_count) {
+
+	if(shared_code_flag) {
+		shared_heap = build_shared_heap(paths, path_count);
+	}
+
+	Worker_Pool pool;
+	pool.jobs = malloc(sizeof(Job) * path_count);
+	pool.job_count = path_count;
+	pool.next_job = 0;
+
+	for(int i = 0; i < path_count; ++i) {
+		pool.jobs[i].path = paths[i];
+		pool.jobs[i].output = NULL;
+		pool.jobs[i].output_size = 0;
+	}
+
+	if(worker_count > path_count) {
+		worker_count = path_count;
+	}
+
+	pthread_t * threads = malloc(sizeof(pthread_t) * worker_count);
+	for(int i = 0; i < worker_count; ++i) {
+		if(pthread_create(&threads[i], NULL, worker, &pool) != 0) {
+			fprintf(stderr, "Unable to start worker %d.\n", i);
+			fprintf(stderr, "Exiting...\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(int i = 0; i < worker_count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Machines the programs spawned may still use the shared code
+	stop_actors();
+
+	for(int i = 0; i < path_count; ++i) {
+		fwrite(pool.jobs[i].output, 1, pool.jobs[i].output_size, stdout);
+		free(pool.jobs[i].output);
+	}
+
+	free(threads);
+	free(pool.jobs);
+
+	if(shared_heap != NULL) {
+		destroy_shared_heap(shared_heap);
+		shared_heap = NULL;
+	}
+}
@@ -0,0 +1,13 @@
+(define a 5)
+(define x (- a 1))
+(out x)
+(out (eq? (car x) (quote -)))
+(define y (if (< a 1) a 0))
+(out (car y))
+(out (eq? (car y) (quote if)))
+(define d (lambda (n) (- n 1)))
+(out (d a))
+(define g (lambda (a) (begin (define x (- a 1)) x)))
+(out (g 1))
+(out (eq? (car (cdr (g 1))) (quote a)))
+(quit)
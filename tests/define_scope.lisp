@@ -0,0 +1,13 @@
+(define x 1)
+(define x 2)
+(out x)
+(define f (lambda (a) (begin (define x 3) x)))
+(out (f 5))
+(out x)
+(define g (lambda () (define x 7)))
+(g)
+(out x)
+(define h (lambda (n) (begin (define x n) (g) x)))
+(out (h 4))
+(out x)
+(quit)
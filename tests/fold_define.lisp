@@ -0,0 +1,7 @@
+(define x (+ 1 2))
+(out x)
+(define y (if true 1 2))
+(out y)
+(define f (lambda (a) (+ a (* 2 3))))
+(out (f 1))
+(quit)
@@ -0,0 +1,5 @@
+(define f (lambda (x) (- x 1)))
+(define g (lambda (x) (- x 1)))
+(define run (lambda (n) (if (< n 1) n (run (g (f (+ n 1)))))))
+(out (run 150))
+(quit)
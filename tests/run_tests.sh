@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Runs every tests/*.lisp program with each set of flags below and checks that
+# what it prints matches tests/<name>.out. The optional passes and the engines
+# must never change what a program prints. A program that needs particular
+# flags lists its own sets, one per line, in tests/<name>.flags. The REPL reads
+# at most 62 characters of a line, so keep each form on a short line of its own.
+# The size of the machine code --stats reports depends on the cell layout, so
+# it's left out of the comparison.
+#
+# Usage: tests/run_tests.sh [lisp binary]
+
+LISP=${1:-bin/lisp}
+TEST_DIR=$(dirname "$0")
+
+FLAG_SETS="
+--fold
+--hash-cons
+--hash-cons --fold
+--shallow-binding
+--shallow-binding --hash-cons --fold
+--engine=vm
+--engine=vm --hash-cons --fold
+--engine=jit"
+
+# Runs @program with @flags, leaving out what the build can change
+run() {
+	"$LISP" -q $2 < "$1" 2>&1 | sed 's/, [0-9]* bytes of machine code//'
+}
+
+failed=0
+for program in "$TEST_DIR"/*.lisp; do
+	expected="${program%.lisp}.out"
+	flag_sets="$FLAG_SETS"
+	if [ -f "${program%.lisp}.flags" ]; then
+		flag_sets=$(cat "${program%.lisp}.flags")
+	fi
+
+	while read -r flags; do
+		if ! run "$program" "$flags" | diff -u "$expected" - > /dev/null; then
+			echo "FAIL: $program ${flags:-(no flags)}"
+			run "$program" "$flags" | diff -u "$expected" - | head -20
+			failed=1
+		fi
+	done <<FLAGS
+$flag_sets
+FLAGS
+done
+
+if [ $failed -eq 0 ]; then
+	echo "All tests passed."
+fi
+exit $failed